@@ -0,0 +1,51 @@
+#include "AllocationCounter.hpp"
+
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+namespace {
+std::atomic<size_t> allocations_ { 0 };
+std::atomic<size_t> allocated_bytes_ { 0 };
+thread_local size_t allocated_bytes_on_this_thread_ { 0 };
+} // namespace
+
+namespace nps::allocation_counter {
+
+size_t allocations() { return allocations_.load(std::memory_order_relaxed); }
+size_t allocated_bytes() { return allocated_bytes_.load(std::memory_order_relaxed); }
+size_t allocated_bytes_on_this_thread() { return allocated_bytes_on_this_thread_; }
+
+} // namespace nps::allocation_counter
+
+#if NPS_COUNT_ALLOCATIONS
+
+// Array and nothrow forms forward to these by default
+
+void* operator new(const size_t size) {
+    allocations_.fetch_add(1, std::memory_order_relaxed);
+    allocated_bytes_.fetch_add(size, std::memory_order_relaxed);
+    allocated_bytes_on_this_thread_ += size;
+
+    if (const auto pointer = std::malloc(size == 0 ? 1 : size)) { return pointer; }
+    throw std::bad_alloc {};
+}
+
+void* operator new(const size_t size, const std::align_val_t alignment) {
+    allocations_.fetch_add(1, std::memory_order_relaxed);
+    allocated_bytes_.fetch_add(size, std::memory_order_relaxed);
+    allocated_bytes_on_this_thread_ += size;
+
+    // aligned_alloc wants a size that is a multiple of the alignment
+    const auto align = static_cast<size_t>(alignment);
+    const auto padded_size = (size + align - 1) / align * align;
+    if (const auto pointer = std::aligned_alloc(align, padded_size == 0 ? align : padded_size)) { return pointer; }
+    throw std::bad_alloc {};
+}
+
+void operator delete(void* pointer) noexcept { std::free(pointer); }
+void operator delete(void* pointer, size_t) noexcept { std::free(pointer); }
+void operator delete(void* pointer, std::align_val_t) noexcept { std::free(pointer); }
+void operator delete(void* pointer, size_t, std::align_val_t) noexcept { std::free(pointer); }
+
+#endif
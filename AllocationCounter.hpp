@@ -0,0 +1,26 @@
+#pragma once
+
+#include <cstddef>
+
+// Global operator new is instrumented in debug builds, define NPS_COUNT_ALLOCATIONS=0 to opt out
+#ifndef NPS_COUNT_ALLOCATIONS
+#ifdef NDEBUG
+#define NPS_COUNT_ALLOCATIONS 0
+#else
+#define NPS_COUNT_ALLOCATIONS 1
+#endif
+#endif
+
+namespace nps::allocation_counter {
+
+// False when operator new is not instrumented and the counters stay at zero
+constexpr bool enabled = NPS_COUNT_ALLOCATIONS;
+
+// Totals since program start, never decremented by frees
+size_t allocations();
+size_t allocated_bytes();
+
+// Bytes allocated by the calling thread, unaffected by what other threads allocate meanwhile
+size_t allocated_bytes_on_this_thread();
+
+} // namespace nps::allocation_counter
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <span>
+#include <type_traits>
+#include <utility>
+
+namespace nps {
+
+template <size_t axis>
+using axis_constant = std::integral_constant<size_t, axis>;
+
+// Calls f(axis_constant<axis>) for axis = 0, ..., dimensions - 1, unrolled at compile time.
+// The argument converts to size_t, so it can index per axis arrays directly.
+template <size_t dimensions, typename F>
+constexpr void for_each_axis(F&& f) {
+    [&]<size_t... axis>(std::index_sequence<axis...>) {
+        (f(axis_constant<axis> {}), ...);
+    }(std::make_index_sequence<dimensions> {});
+}
+
+template <size_t dimensions>
+struct box {
+    std::array<double, dimensions> min;
+    std::array<double, dimensions> extent;
+};
+
+// Smallest coordinate and extent per axis of a non-empty set of particles, the extents slightly inflated
+// so that particles on the upper edges stay inside of [min, min + extent)
+template <size_t dimensions>
+box<dimensions> bounding_box(const std::array<std::span<const double>, dimensions>& coordinates) {
+    box<dimensions> bounds;
+    for_each_axis<dimensions>([&](const size_t axis) {
+        const auto [axis_min, axis_max] = std::ranges::minmax(coordinates[axis]);
+        bounds.min[axis] = axis_min;
+        bounds.extent[axis] = (axis_max - axis_min) * (1.0 + 1e-12);
+    });
+    return bounds;
+}
+
+} // namespace nps
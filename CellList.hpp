@@ -0,0 +1,242 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cmath>
+#include <span>
+#include <vector>
+
+#include "Axes.hpp"
+#include "CountingSort.hpp"
+#include "ThreadPool.hpp"
+
+namespace nps {
+
+/*
+Softening of the pair force at small distances, with length epsilon.
+plummer: m d / (d^2 + epsilon^2)^(3/2).
+spline: the cubic spline kernel of Monaghan & Lattanzio as used in GADGET, exactly Newtonian beyond
+        2.8 epsilon and with the same central potential as plummer.
+ */
+enum class softening { none, plummer, spline };
+
+/*
+Uniform grid of cells at least cutoff wide over raw particle coordinates, for short range forces.
+
+Particles are counting sorted by cell (see sort_by_key) and, as in Orthtree, copied into that order so that
+every cell owns a contiguous range of them. A particle then only meets the particles of its own and
+the adjacent cells, and of those only the ones closer than cutoff, which is O(N) for a bounded density.
+ */
+template <size_t dimensions>
+class CellList {
+  public:
+    using point = std::array<double, dimensions>;
+
+  private:
+    double cutoff_ { 1.0 };
+    softening softening_ { softening::none };
+    double epsilon_ { 0.0 };
+
+    std::array<size_t, dimensions> cells_per_axis_ {};
+    point origin_ {};
+    double cell_width_ { 1.0 };
+
+    // Sorted position -> particle index, and the first sorted position of every cell (plus the end)
+    std::vector<size_t> order_ {};
+    std::vector<size_t> cell_starts_ {};
+    std::vector<size_t> cell_of_ {};
+    std::array<std::vector<double>, dimensions> coordinates_ {};
+    std::vector<double> masses_ {};
+    // Accelerations of the last evaluate, in sorted order
+    std::array<std::vector<double>, dimensions> accelerations_ {};
+    // Pairs closer than cutoff in the last evaluate, each counted once from both of its particles
+    size_t pair_interactions_ { 0 };
+
+    // m / d^3 of the unsoftened force, for d2 = d^2 below cutoff^2
+    double softened_inverse_cube(const double d2) const {
+        switch (softening_) {
+        case softening::none: break;
+        case softening::plummer: {
+            const auto s2 = d2 + epsilon_ * epsilon_;
+            return 1.0 / (s2 * std::sqrt(s2));
+        }
+        case softening::spline: {
+            const auto h = 2.8 * epsilon_;
+            const auto d = std::sqrt(d2);
+            if (d >= h) { break; }
+            const auto u = d / h;
+            const auto inv_h3 = 1.0 / (h * h * h);
+            if (u < 0.5) { return inv_h3 * (10.666666666667 + u * u * (32.0 * u - 38.4)); }
+            return inv_h3 * (21.333333333333 - 48.0 * u + 38.4 * u * u - 10.666666666667 * u * u * u -
+                             0.066666666667 / (u * u * u));
+        }
+        }
+        return 1.0 / (d2 * std::sqrt(d2));
+    }
+
+    void fit_grid(const std::array<std::span<const double>, dimensions>& coordinates, const size_t particles) {
+        const auto bounds = bounding_box<dimensions>(coordinates);
+        origin_ = bounds.min;
+
+        // Cells at least cutoff wide, but not so many that sparse runs spend their time on empty cells
+        const auto max_cells = 4 * particles + 64;
+        cell_width_ = cutoff_;
+        while (true) {
+            size_t cells { 1 };
+            for_each_axis<dimensions>([&](const size_t axis) {
+                cells_per_axis_[axis] = std::max<size_t>(1, static_cast<size_t>(bounds.extent[axis] / cell_width_));
+                cells *= cells_per_axis_[axis];
+            });
+            if (cells <= max_cells) { break; }
+            cell_width_ *= 2.0;
+        }
+    }
+
+    size_t cell_of(const std::array<std::span<const double>, dimensions>& coordinates, const size_t i) const {
+        size_t cell { 0 };
+        size_t stride { 1 };
+        for_each_axis<dimensions>([&](const size_t axis) {
+            const auto c = static_cast<size_t>((coordinates[axis][i] - origin_[axis]) / cell_width_);
+            cell += std::min(c, cells_per_axis_[axis] - 1) * stride;
+            stride *= cells_per_axis_[axis];
+        });
+        return cell;
+    }
+
+  public:
+    // Grows the particle storage up front so that steady state builds do not allocate.
+    // The cell count depends on the extent of the particles, so cell_starts_ may still grow.
+    void reserve(const size_t particles) {
+        order_.reserve(particles);
+        cell_of_.reserve(particles);
+        cell_starts_.reserve(4 * particles + 65);
+        for (auto& coordinate : coordinates_) {
+            coordinate.reserve(particles);
+        }
+        masses_.reserve(particles);
+        for (auto& accelerations : accelerations_) {
+            accelerations.reserve(particles);
+        }
+    }
+
+    void set_cutoff(const double cutoff) { cutoff_ = cutoff; }
+    double cutoff() const { return cutoff_; }
+
+    void set_softening(const softening kind, const double epsilon) {
+        softening_ = kind;
+        epsilon_ = epsilon;
+    }
+
+    void build(const std::array<std::span<const double>, dimensions>& coordinates, std::span<const double> masses) {
+        const auto particles = masses.size();
+        order_.resize(particles);
+        cell_of_.resize(particles);
+        if (particles == 0) {
+            cell_starts_.assign(1, 0);
+            return;
+        }
+
+        fit_grid(coordinates, particles);
+        size_t cells { 1 };
+        for (const auto cells_on_axis : cells_per_axis_) {
+            cells *= cells_on_axis;
+        }
+
+        for (size_t i { 0 }; i < particles; ++i) {
+            cell_of_[i] = cell_of(coordinates, i);
+        }
+        sort_by_key<dimensions>(cell_of_, cells, coordinates, order_, cell_starts_, coordinates_);
+        masses_.resize(particles);
+        for (size_t p { 0 }; p < particles; ++p) {
+            masses_[p] = masses[order_[p]];
+        }
+    }
+
+    // Sorted position -> particle index of the last build
+    const std::vector<size_t>& order() const { return order_; }
+
+    /*
+    Accelerations without G from the pairs closer than cutoff, see acceleration_at.
+    Cells are split between the threads and every particle sums over its whole neighbourhood,
+    so each thread only writes its own particles and no reduction is needed.
+     */
+    void evaluate(ThreadPool& pool) {
+        const auto particles = masses_.size();
+        for (auto& accelerations : accelerations_) {
+            accelerations.resize(particles);
+        }
+        pair_interactions_ = 0;
+        if (particles == 0) { return; }
+
+        const auto cells = cell_starts_.size() - 1;
+        const auto cutoff2 = cutoff_ * cutoff_;
+        std::atomic<size_t> interactions { 0 };
+
+        pool.parallel_for(cells, [&](const size_t cells_begin, const size_t cells_end, size_t) {
+            size_t thread_interactions { 0 };
+            for (size_t cell { cells_begin }; cell < cells_end; ++cell) {
+                std::array<size_t, dimensions> c;
+                size_t rest { cell };
+                for_each_axis<dimensions>([&](const size_t axis) {
+                    c[axis] = rest % cells_per_axis_[axis];
+                    rest /= cells_per_axis_[axis];
+                });
+
+                for (size_t p { cell_starts_[cell] }; p < cell_starts_[cell + 1]; ++p) {
+                    point a {};
+
+                    // The 3^dimensions cells around c, the ones outside of the grid skipped
+                    size_t neighbours { 1 };
+                    for (size_t axis { 0 }; axis < dimensions; ++axis) {
+                        neighbours *= 3;
+                    }
+                    for (size_t neighbour { 0 }; neighbour < neighbours; ++neighbour) {
+                        size_t other { 0 };
+                        size_t stride { 1 };
+                        size_t offsets { neighbour };
+                        bool inside { true };
+                        for_each_axis<dimensions>([&](const size_t axis) {
+                            const auto n = c[axis] + offsets % 3;
+                            offsets /= 3;
+                            inside = inside && n >= 1 && n <= cells_per_axis_[axis];
+                            other += (n - 1) * stride;
+                            stride *= cells_per_axis_[axis];
+                        });
+                        if (!inside) { continue; }
+
+                        for (size_t q { cell_starts_[other] }; q < cell_starts_[other + 1]; ++q) {
+                            if (q == p) { continue; }
+                            point d;
+                            double d2 { 0.0 };
+                            for_each_axis<dimensions>([&](const size_t axis) {
+                                d[axis] = coordinates_[axis][q] - coordinates_[axis][p];
+                                d2 += d[axis] * d[axis];
+                            });
+                            if (d2 >= cutoff2) { continue; }
+
+                            ++thread_interactions;
+                            const auto m_over_d3 = masses_[q] * softened_inverse_cube(d2);
+                            for_each_axis<dimensions>([&](const size_t axis) { a[axis] += m_over_d3 * d[axis]; });
+                        }
+                    }
+
+                    for_each_axis<dimensions>([&](const size_t axis) { accelerations_[axis][p] = a[axis]; });
+                }
+            }
+            interactions += thread_interactions;
+        });
+        pair_interactions_ = interactions / 2;
+    }
+
+    size_t pair_interactions() const { return pair_interactions_; }
+
+    // Acceleration of the particle at sorted position p from the last evaluate
+    point acceleration_at(const size_t p) const {
+        point acceleration;
+        for_each_axis<dimensions>([&](const size_t axis) { acceleration[axis] = accelerations_[axis][p]; });
+        return acceleration;
+    }
+};
+
+} // namespace nps
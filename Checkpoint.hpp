@@ -0,0 +1,118 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <span>
+#include <string>
+#include <type_traits>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "FileIO.hpp"
+
+namespace nps {
+
+/*
+Binary checkpoint layout, version 1, in the byte order of the machine that wrote it:
+
+    CheckpointHeader                              128 bytes
+    coordinates, one column per axis              particles doubles each
+    speeds, one column per axis                   particles doubles each
+    masses                                        particles doubles
+
+Columns are the raw numbers of the simulation's units, the units themselves are recorded in the header
+as their size in SI, so a checkpoint can be restored into a simulation with other units.
+ */
+struct CheckpointHeader {
+    static constexpr std::array<char, 8> expected_magic { 'N', 'P', 'S', 'C', 'K', 'P', 'T', '\0' };
+    static constexpr std::uint32_t current_version = 1;
+
+    std::array<char, 8> magic;
+    std::uint32_t version;
+    std::uint32_t dimensions;
+    std::uint64_t particles;
+    // Size in SI of the coordinate, mass, time, speed and acceleration units
+    std::array<double, 5> units_in_si;
+    // In the time unit
+    double timestep;
+    double simulation_time;
+    std::array<std::uint64_t, 6> reserved;
+
+    size_t columns() const { return 2 * dimensions + 1; }
+
+    // Whether a file of `bytes` holds exactly the columns of particles, without overflowing for any count
+    bool fits(const size_t bytes) const {
+        if (bytes < sizeof(CheckpointHeader)) { return false; }
+        const auto column_bytes = bytes - sizeof(CheckpointHeader);
+        return particles <= column_bytes / (columns() * sizeof(double)) &&
+               column_bytes == columns() * particles * sizeof(double);
+    }
+
+    // Every unit size finite and positive, so that the scaling on restore keeps finite numbers finite
+    bool valid_units() const {
+        return std::ranges::all_of(units_in_si, [](const double size) { return std::isfinite(size) && size > 0.0; });
+    }
+};
+static_assert(sizeof(CheckpointHeader) == 128 && std::is_trivially_copyable_v<CheckpointHeader>);
+
+// Read only memory mapping of a whole file, empty when the file cannot be mapped
+class MappedFile {
+  private:
+    void* data_ { MAP_FAILED };
+    size_t size_ { 0 };
+
+  public:
+    explicit MappedFile(const std::string& path) {
+        const auto fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) { return; }
+        struct stat status;
+        if (::fstat(fd, &status) == 0 && status.st_size > 0) {
+            size_ = static_cast<size_t>(status.st_size);
+            data_ = ::mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (data_ != MAP_FAILED) { ::madvise(data_, size_, MADV_SEQUENTIAL); }
+        }
+        ::close(fd);
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    ~MappedFile() {
+        if (data_ != MAP_FAILED) { ::munmap(data_, size_); }
+    }
+
+    std::span<const std::byte> bytes() const {
+        if (data_ == MAP_FAILED) { return {}; }
+        return { static_cast<const std::byte*>(data_), size_ };
+    }
+};
+
+/*
+Writes the header and then every column with a single write each. The data goes to path + ".tmp",
+is synced and then renamed over path, so an interrupted save never leaves a torn checkpoint behind.
+ */
+inline bool write_checkpoint(const std::string& path, const CheckpointHeader& header,
+                             std::span<const std::span<const double>> columns) {
+    const auto temporary = path + ".tmp";
+    const auto fd = ::open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) { return false; }
+
+    auto ok = write_all(fd, &header, sizeof(header));
+    for (const auto column : columns) {
+        ok = ok && write_all(fd, column.data(), column.size_bytes());
+    }
+    ok = ::fsync(fd) == 0 && ok;
+    ok = ::close(fd) == 0 && ok;
+    ok = ok && std::rename(temporary.c_str(), path.c_str()) == 0;
+    if (!ok) { std::remove(temporary.c_str()); }
+    return ok;
+}
+
+} // namespace nps
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <array>
+#include <span>
+#include <vector>
+
+#include "Axes.hpp"
+
+namespace nps {
+
+/*
+Counting sorts particles by their keys[i] < key_count and copies their coordinates into that order, the
+grouping behind CellList and SpatialHash. Afterwards order[p] is the particle at sorted position p and
+the particles of key k sit at sorted positions starts[k] up to starts[k + 1]. Particles of the same key
+keep their order. Reuses the storage of the outputs.
+ */
+template <size_t dimensions>
+void sort_by_key(std::span<const size_t> keys, const size_t key_count,
+                 const std::array<std::span<const double>, dimensions>& coordinates, std::vector<size_t>& order,
+                 std::vector<size_t>& starts, std::array<std::vector<double>, dimensions>& sorted_coordinates) {
+    const auto particles = keys.size();
+    order.resize(particles);
+    starts.assign(key_count + 1, 0);
+    for (const auto key : keys) {
+        ++starts[key + 1];
+    }
+    for (size_t key { 0 }; key < key_count; ++key) {
+        starts[key + 1] += starts[key];
+    }
+    // Scatter with the starts as cursors, which leaves each start at the end of its key
+    for (size_t i { 0 }; i < particles; ++i) {
+        order[starts[keys[i]]++] = i;
+    }
+    for (size_t key { key_count }; key > 0; --key) {
+        starts[key] = starts[key - 1];
+    }
+    starts[0] = 0;
+
+    for_each_axis<dimensions>([&](const size_t axis) {
+        sorted_coordinates[axis].resize(particles);
+        for (size_t p { 0 }; p < particles; ++p) {
+            sorted_coordinates[axis][p] = coordinates[axis][order[p]];
+        }
+    });
+}
+
+} // namespace nps
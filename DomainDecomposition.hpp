@@ -0,0 +1,392 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <limits>
+#include <numeric>
+#include <span>
+#include <vector>
+
+#include "Axes.hpp"
+#include "NewtonPointSimulation.hpp"
+#include "StepMetrics.hpp"
+#include "Transport.hpp"
+
+namespace nps {
+
+/*
+Distributed run of a NewtonPointSimulation, one rank per process and every rank holding the particles
+of its own slab of space along x in its local simulation. See Transport.hpp for the ranks.
+
+Before every step each rank sends its particles closer than the short range cutoff to another rank's
+slab to that rank, where they pull as the halo of the local simulation (see set_halo) without being
+stepped. After the step the particles that left a slab are handed over to the rank that owns their
+new position. The local simulations must run the short_range engine, the one with a finite reach,
+and semi_implicit_euler, whose single force evaluation per step sees the halo at the same time as
+the own particles; distribute and evolve_n_steps refuse any other.
+
+Load balancing: every balance_every steps the ranks spread the force and integration time their
+local simulation measured since the last balancing evenly over its particles, histogram that cost
+along x, add up the histograms and move the slab bounds to equal shares of the total cost. A rank
+whose steps ran slow, from a denser slab or a busier core, gets a thinner slab.
+ */
+template <size_t dimensions, typename Simulation>
+class DomainDecomposition {
+  private:
+    // A particle on the wire: global ID, coordinates, speeds and mass
+    static constexpr size_t particle_doubles_ = 2 * dimensions + 2;
+    // A halo particle: coordinates and mass
+    static constexpr size_t halo_doubles_ = dimensions + 1;
+    static constexpr size_t bins_per_rank_ = 64;
+    static constexpr double infinity_ = std::numeric_limits<double>::infinity();
+
+    using columns = std::array<std::span<const double>, dimensions>;
+
+    Transport& transport_;
+    Simulation& local_;
+    // A decomposition of an unsupported local simulation refuses every call that exchanges, see valid
+    bool supported_at_construction_;
+
+    // Rank r owns the particles with bounds_[r] <= x < bounds_[r + 1], the outermost bounds are infinite
+    std::vector<double> bounds_ {};
+    // Local particle ID -> global ID, see global_id
+    std::vector<size_t> global_ids_ {};
+
+    // The bounds move after every balance_every_ steps, never when 0, see set_balancing
+    size_t balance_every_ { 0 };
+    size_t steps_since_balance_ { 0 };
+    // Force and integration time of the local simulation up to the last balancing
+    std::uint64_t cost_ns_at_balance_ { 0 };
+
+    std::vector<std::vector<double>> outgoing_ {};
+    std::vector<std::vector<double>> incoming_ {};
+    // Particles the local simulation is rebuilt from, as on the wire
+    std::vector<double> staying_ {};
+    std::vector<double> column_ {};
+    std::array<std::vector<double>, dimensions> halo_coordinates_ {};
+    std::vector<double> halo_masses_ {};
+    std::vector<double> cost_histogram_ {};
+    std::vector<double> gathered_ {};
+
+    columns local_coordinates() const {
+        columns coordinates;
+        for_each_axis<dimensions>([&](const size_t axis) { coordinates[axis] = local_.coordinates_view(axis); });
+        return coordinates;
+    }
+
+    columns local_speeds() const {
+        columns speeds;
+        for_each_axis<dimensions>([&](const size_t axis) { speeds[axis] = local_.speeds_view(axis); });
+        return speeds;
+    }
+
+    static void append_particle(std::vector<double>& records, const double id, const columns& coordinates,
+                                const columns& speeds, std::span<const double> masses, const size_t i) {
+        records.push_back(id);
+        for_each_axis<dimensions>([&](const size_t axis) { records.push_back(coordinates[axis][i]); });
+        for_each_axis<dimensions>([&](const size_t axis) { records.push_back(speeds[axis][i]); });
+        records.push_back(masses[i]);
+    }
+
+    size_t owner_of(const double x) const {
+        const auto above = std::ranges::upper_bound(bounds_, x);
+        const auto owner = static_cast<size_t>(std::max(above - bounds_.begin(), std::ptrdiff_t { 1 })) - 1;
+        return std::min(owner, transport_.ranks() - 1);
+    }
+
+    void clear_outgoing() {
+        outgoing_.resize(transport_.ranks());
+        for (auto& records : outgoing_) {
+            records.clear();
+        }
+    }
+
+    // Replaces the particles of the local simulation with the ones in staying_
+    void adopt_staying() {
+        const auto particles = staying_.size() / particle_doubles_;
+        const auto field = [&](const size_t offset) -> std::span<const double> {
+            column_.resize(particles);
+            for (size_t p { 0 }; p < particles; ++p) {
+                column_[p] = staying_[p * particle_doubles_ + offset];
+            }
+            return column_;
+        };
+        for_each_axis<dimensions>([&](const size_t axis) {
+            local_.set_coordinates(axis, field(1 + axis));
+            local_.set_speeds(axis, field(1 + dimensions + axis));
+        });
+        local_.set_masses(field(1 + 2 * dimensions));
+
+        // The setters start the local IDs over from the storage indices, which are the order of staying_
+        global_ids_.resize(particles);
+        for (size_t p { 0 }; p < particles; ++p) {
+            global_ids_[p] = static_cast<size_t>(staying_[p * particle_doubles_]);
+        }
+    }
+
+    // The engine and integrator that see the halo as the local particles do, see above
+    bool supported() const {
+        return local_.selected_engine() == engine::short_range &&
+               local_.selected_integrator() == integrator::semi_implicit_euler;
+    }
+
+    // Whether every rank is valid, so that all refuse together rather than leave the others in an exchange
+    bool all_valid() {
+        const std::array<double, 1> valid_here { valid() ? 1.0 : 0.0 };
+        if (!transport_.all_gather(valid_here, gathered_)) { return false; }
+        return std::ranges::all_of(gathered_, [](const double valid_there) { return valid_there == 1.0; });
+    }
+
+    // Force and integration time the local simulation measured so far
+    std::uint64_t measured_cost_ns() const {
+        const auto& metrics = local_.metrics();
+        return metrics.histogram(phase::force).total_ns() + metrics.histogram(phase::integration).total_ns();
+    }
+
+  public:
+    DomainDecomposition(Transport& transport, Simulation& local)
+        : transport_ { transport }, local_ { local }, supported_at_construction_ { supported() } {
+        bounds_.assign(transport_.ranks() + 1, infinity_);
+        bounds_[0] = -infinity_;
+    }
+
+    size_t rank() const { return transport_.rank(); }
+    // The local simulation runs short_range and semi_implicit_euler, and did when this was constructed
+    bool valid() const { return supported_at_construction_ && supported(); }
+    // Slab bounds along x of every rank, see owner_of
+    std::span<const double> bounds() const { return bounds_; }
+    // Global ID of the particle at storage index i of the local simulation, its index in distribute
+    size_t global_id(const size_t i) const { return global_ids_[local_.particle_ids()[i]]; }
+
+    // Moves the slab bounds to the measured step cost after every `every` steps, never when 0
+    void set_balancing(const size_t every) {
+        balance_every_ = every;
+        steps_since_balance_ = 0;
+        cost_ns_at_balance_ = measured_cost_ns();
+    }
+
+    /*
+    Splits the particles that rank 0 passes, as raw numbers of the local simulation's units, into slabs of
+    equal particle counts and hands every rank its own. The other ranks pass empty spans. Collective,
+    like every call below that exchanges. False on every rank when any of them is not valid.
+     */
+    bool distribute(const columns& coordinates, const columns& speeds, std::span<const double> masses) {
+        if (!all_valid()) { return false; }
+        const auto ranks = transport_.ranks();
+        const auto particles = masses.size();
+        std::vector<double> inner_bounds {};
+        if (transport_.rank() == 0) {
+            std::vector<double> x(coordinates[0].begin(), coordinates[0].end());
+            std::ranges::sort(x);
+            for (size_t r { 1 }; r < ranks; ++r) {
+                inner_bounds.push_back(particles > 0 ? x[particles * r / ranks] : 0.0);
+            }
+        }
+        // Only rank 0 contributes, so gathering broadcasts its bounds
+        if (!transport_.all_gather(inner_bounds, gathered_)) { return false; }
+        std::ranges::copy(gathered_, bounds_.begin() + 1);
+
+        clear_outgoing();
+        for (size_t i { 0 }; i < particles; ++i) {
+            append_particle(outgoing_[owner_of(coordinates[0][i])], double(i), coordinates, speeds, masses, i);
+        }
+        if (!transport_.exchange(outgoing_, incoming_)) { return false; }
+        staying_.clear();
+        for (const auto& records : incoming_) {
+            staying_.insert(staying_.end(), records.begin(), records.end());
+        }
+        adopt_staying();
+        return true;
+    }
+
+    // Sends the particles within the cutoff of the other slabs to their ranks and takes theirs as the halo
+    bool exchange_halo() {
+        const auto rank = transport_.rank();
+        const auto ranks = transport_.ranks();
+        const auto cutoff = local_.short_range_cutoff();
+        const auto coordinates = local_coordinates();
+        const auto masses = local_.masses_view();
+
+        clear_outgoing();
+        const auto append_halo = [&](std::vector<double>& records, const size_t i) {
+            for_each_axis<dimensions>([&](const size_t axis) { records.push_back(coordinates[axis][i]); });
+            records.push_back(masses[i]);
+        };
+        for (size_t i { 0 }; i < masses.size(); ++i) {
+            const auto x = coordinates[0][i];
+            // Slab r - 1 ends at bounds_[r] and slab r starts there
+            for (size_t r { rank }; r > 0 && x - bounds_[r] < cutoff; --r) {
+                append_halo(outgoing_[r - 1], i);
+            }
+            for (size_t r { rank + 1 }; r < ranks && bounds_[r] - x < cutoff; ++r) {
+                append_halo(outgoing_[r], i);
+            }
+        }
+        if (!transport_.exchange(outgoing_, incoming_)) { return false; }
+
+        for (auto& halo : halo_coordinates_) {
+            halo.clear();
+        }
+        halo_masses_.clear();
+        for (const auto& records : incoming_) {
+            for (size_t offset { 0 }; offset < records.size(); offset += halo_doubles_) {
+                for_each_axis<dimensions>([&](const size_t axis) {
+                    halo_coordinates_[axis].push_back(records[offset + axis]);
+                });
+                halo_masses_.push_back(records[offset + dimensions]);
+            }
+        }
+        columns halo;
+        for_each_axis<dimensions>([&](const size_t axis) { halo[axis] = halo_coordinates_[axis]; });
+        local_.set_halo(halo, halo_masses_);
+        return true;
+    }
+
+    // Hands the particles that left this rank's slab to their owners and takes in the ones that arrived
+    bool migrate() {
+        const auto rank = transport_.rank();
+        const auto coordinates = local_coordinates();
+        const auto speeds = local_speeds();
+        const auto masses = local_.masses_view();
+
+        clear_outgoing();
+        bool leaving { false };
+        for (size_t i { 0 }; i < masses.size(); ++i) {
+            const auto owner = owner_of(coordinates[0][i]);
+            if (owner == rank) { continue; }
+            append_particle(outgoing_[owner], double(global_id(i)), coordinates, speeds, masses, i);
+            leaving = true;
+        }
+        if (!transport_.exchange(outgoing_, incoming_)) { return false; }
+        const auto arriving = std::ranges::any_of(incoming_, [](const auto& records) { return !records.empty(); });
+        if (!leaving && !arriving) { return true; }
+
+        staying_.clear();
+        for (size_t i { 0 }; i < masses.size(); ++i) {
+            if (owner_of(coordinates[0][i]) == rank) {
+                append_particle(staying_, double(global_id(i)), coordinates, speeds, masses, i);
+            }
+        }
+        for (const auto& records : incoming_) {
+            staying_.insert(staying_.end(), records.begin(), records.end());
+        }
+        adopt_staying();
+        return true;
+    }
+
+    // Moves the slab bounds to equal shares of the cost measured since the last balancing, see above
+    bool balance() {
+        const auto ranks = transport_.ranks();
+        const auto x = local_.coordinates_view(0);
+        const auto cost_ns = measured_cost_ns();
+        // Metrics may have been reset in between
+        const auto cost = double(cost_ns >= cost_ns_at_balance_ ? cost_ns - cost_ns_at_balance_ : cost_ns);
+        cost_ns_at_balance_ = cost_ns;
+        steps_since_balance_ = 0;
+
+        // Extent along x of all particles, the minimum negated so that one gather finds both
+        std::array<double, 2> extent { -infinity_, -infinity_ };
+        for (const auto position : x) {
+            extent[0] = std::max(extent[0], -position);
+            extent[1] = std::max(extent[1], position);
+        }
+        if (!transport_.all_gather(extent, gathered_)) { return false; }
+        auto min = infinity_;
+        auto max = -infinity_;
+        for (size_t r { 0 }; r < ranks; ++r) {
+            min = std::min(min, -gathered_[2 * r]);
+            max = std::max(max, gathered_[2 * r + 1]);
+        }
+        if (!(max > min)) { return true; }
+
+        const auto bins = bins_per_rank_ * ranks;
+        const auto bin_width = (max - min) / double(bins);
+        const auto cost_per_particle = x.empty() ? 0.0 : cost / double(x.size());
+        cost_histogram_.assign(bins, 0.0);
+        for (const auto position : x) {
+            cost_histogram_[std::min(static_cast<size_t>((position - min) / bin_width), bins - 1)] += cost_per_particle;
+        }
+        if (!transport_.all_gather(cost_histogram_, gathered_)) { return false; }
+        // Every rank adds up the same numbers in the same order, so all of them agree on the bounds
+        std::ranges::fill(cost_histogram_, 0.0);
+        for (size_t r { 0 }; r < ranks; ++r) {
+            for (size_t bin { 0 }; bin < bins; ++bin) {
+                cost_histogram_[bin] += gathered_[r * bins + bin];
+            }
+        }
+        const auto total = std::accumulate(cost_histogram_.begin(), cost_histogram_.end(), 0.0);
+        if (!(total > 0.0)) { return true; }
+
+        // Bound r where the cumulative cost reaches r / ranks of the total, linear within a bin
+        size_t bin { 0 };
+        double below { 0.0 };
+        for (size_t r { 1 }; r < ranks; ++r) {
+            const auto target = total * double(r) / double(ranks);
+            while (bin + 1 < bins && below + cost_histogram_[bin] < target) {
+                below += cost_histogram_[bin++];
+            }
+            const auto fraction =
+                cost_histogram_[bin] > 0.0 ? std::clamp((target - below) / cost_histogram_[bin], 0.0, 1.0) : 0.0;
+            bounds_[r] = min + (double(bin) + fraction) * bin_width;
+        }
+        return true;
+    }
+
+    /*
+    One step of every local simulation at a time: the halo exchange, the step and the migration, and the
+    balancing with another migration when it is due. False on every rank when any of them is not valid,
+    as another engine or integrator would step with a halo that covers only the short range cutoff.
+     */
+    bool evolve_n_steps(const size_t steps) {
+        if (!all_valid()) { return false; }
+        for (size_t step { 0 }; step < steps; ++step) {
+            if (!exchange_halo()) { return false; }
+            local_.evolve_n_steps(1);
+            if (!migrate()) { return false; }
+            if (balance_every_ == 0 || ++steps_since_balance_ < balance_every_) { continue; }
+            if (!balance() || !migrate()) { return false; }
+        }
+        return true;
+    }
+
+    // Every particle on rank 0 by ascending global ID, nothing on the other ranks
+    bool gather(std::array<std::vector<double>, dimensions>& coordinates,
+                std::array<std::vector<double>, dimensions>& speeds, std::vector<double>& masses) {
+        const auto local_coordinates_columns = local_coordinates();
+        const auto local_speeds_columns = local_speeds();
+        const auto local_masses = local_.masses_view();
+        clear_outgoing();
+        for (size_t i { 0 }; i < local_masses.size(); ++i) {
+            append_particle(outgoing_[0], double(global_id(i)), local_coordinates_columns, local_speeds_columns,
+                            local_masses, i);
+        }
+        if (!transport_.exchange(outgoing_, incoming_)) { return false; }
+
+        staying_.clear();
+        for (const auto& records : incoming_) {
+            staying_.insert(staying_.end(), records.begin(), records.end());
+        }
+        const auto particles = staying_.size() / particle_doubles_;
+        std::vector<size_t> order(particles);
+        std::iota(order.begin(), order.end(), size_t { 0 });
+        std::ranges::sort(order, {}, [&](const size_t p) { return staying_[p * particle_doubles_]; });
+
+        for_each_axis<dimensions>([&](const size_t axis) {
+            coordinates[axis].resize(particles);
+            speeds[axis].resize(particles);
+        });
+        masses.resize(particles);
+        for (size_t p { 0 }; p < particles; ++p) {
+            const auto record = staying_.data() + order[p] * particle_doubles_;
+            for_each_axis<dimensions>([&](const size_t axis) {
+                coordinates[axis][p] = record[1 + axis];
+                speeds[axis][p] = record[1 + dimensions + axis];
+            });
+            masses[p] = record[1 + 2 * dimensions];
+        }
+        return true;
+    }
+};
+
+} // namespace nps
@@ -0,0 +1,429 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#include "Axes.hpp"
+#include "Orthtree.hpp"
+#include "PairwiseKernels.hpp"
+
+namespace nps {
+
+/*
+Fast multipole method over the cells of an Orthtree, with Cartesian expansions of 1/r up to a runtime order.
+
+Every cell gets a multipole expansion about its center of mass (P2M, M2M upwards). A dual tree walk
+then pairs cells: well separated pairs exchange their multipoles into each other's local expansions
+(M2L), touching leaves interact directly. The local expansions are finally shifted down to the leaves
+and evaluated at the particles (L2L, L2P). The error of a pair falls off as theta^(order + 1).
+
+Expansion coefficients are indexed by the multi-indices n with |n| <= order, ordered by degree:
+multipole M_n = sum m (x - z)^n / n! and local L_n = d^n phi(z), where phi = sum m / |x - x_j|
+and the acceleration without G is grad phi.
+ */
+template <size_t dimensions>
+class FastMultipole {
+  public:
+    using point = std::array<double, dimensions>;
+    using multi_index = std::array<std::uint8_t, dimensions>;
+
+  private:
+    static constexpr size_t none_ = ~size_t { 0 };
+
+    using Node = typename Orthtree<dimensions>::Node;
+
+    size_t order_ { 0 };
+    double theta_ { 0.5 };
+
+    // Multi-index tables of the current order
+    std::vector<multi_index> indices_ {};
+    std::vector<size_t> degrees_ {};
+    // Index of n - e_axis and n - 2 e_axis, none_ where a component would go negative
+    std::vector<std::array<size_t, dimensions>> lower_ {};
+    std::vector<std::array<size_t, dimensions>> lower2_ {};
+    // First axis with n_axis > 0, the step used by the recurrences
+    std::vector<size_t> step_axis_ {};
+    // (k + n) for M2M / L2L: shifted[k + n] gets coefficient[k] * powers[n] or the other way round
+    struct shift_term {
+        size_t sum, part, rest;
+    };
+    std::vector<shift_term> shift_terms_ {};
+    // L[k] += (-1)^|n| M[n] D[n + k]
+    struct m2l_term {
+        size_t local, multipole, derivative;
+        double multipole_sign, local_sign;
+    };
+    std::vector<m2l_term> m2l_terms_ {};
+    // a_axis += L[k + e_axis] y^k / k!
+    std::array<std::vector<std::array<size_t, 2>>, dimensions> gradient_terms_ {};
+
+    // Per node coefficients, [node][term]
+    std::vector<double> multipoles_ {};
+    std::vector<double> locals_ {};
+    std::vector<double> radii_ {};
+
+    // Scratch of the current operation
+    std::vector<double> powers_ {};
+    std::vector<double> derivatives_ {};
+
+    // Accelerations of the last evaluate, in tree order
+    std::array<std::vector<double>, dimensions> accelerations_ {};
+    // Particle pairs summed directly and cell pairs interacting through expansions in the last evaluate
+    size_t pair_interactions_ { 0 };
+    size_t cell_interactions_ { 0 };
+
+    const Orthtree<dimensions>* tree_ { nullptr };
+
+    size_t terms() const { return indices_.size(); }
+
+    void build_tables() {
+        indices_.clear();
+        for (size_t degree { 0 }; degree <= order_; ++degree) {
+            // Every n of this degree, the last axis counting fastest
+            multi_index n {};
+            const auto visit = [&](const auto& self, const size_t axis, const size_t left) -> void {
+                if (axis + 1 == dimensions) {
+                    n[axis] = static_cast<std::uint8_t>(left);
+                    indices_.push_back(n);
+                    return;
+                }
+                for (size_t value { left + 1 }; value-- > 0;) {
+                    n[axis] = static_cast<std::uint8_t>(value);
+                    self(self, axis + 1, left - value);
+                }
+            };
+            visit(visit, 0, degree);
+        }
+
+        const auto find = [&](const multi_index& n) {
+            return static_cast<size_t>(std::ranges::find(indices_, n) - indices_.begin());
+        };
+        const auto count = terms();
+
+        degrees_.assign(count, 0);
+        lower_.assign(count, {});
+        lower2_.assign(count, {});
+        step_axis_.assign(count, 0);
+        for (size_t t { 0 }; t < count; ++t) {
+            const auto& n = indices_[t];
+            for_each_axis<dimensions>([&](const size_t axis) { degrees_[t] += n[axis]; });
+            step_axis_[t] = dimensions;
+            for (size_t axis { dimensions }; axis-- > 0;) {
+                auto lower = n;
+                lower_[t][axis] = none_;
+                lower2_[t][axis] = none_;
+                if (n[axis] >= 1) {
+                    step_axis_[t] = axis;
+                    --lower[axis];
+                    lower_[t][axis] = find(lower);
+                }
+                if (n[axis] >= 2) {
+                    --lower[axis];
+                    lower2_[t][axis] = find(lower);
+                }
+            }
+        }
+
+        shift_terms_.clear();
+        m2l_terms_.clear();
+        for (auto& terms : gradient_terms_) {
+            terms.clear();
+        }
+        for (size_t k { 0 }; k < count; ++k) {
+            for (size_t n { 0 }; n < count; ++n) {
+                if (degrees_[k] + degrees_[n] > order_) { continue; }
+                multi_index sum;
+                for_each_axis<dimensions>([&](const size_t axis) {
+                    sum[axis] = static_cast<std::uint8_t>(indices_[k][axis] + indices_[n][axis]);
+                });
+                const auto s = find(sum);
+                shift_terms_.push_back({ s, k, n });
+                m2l_terms_.push_back({ k, n, s, degrees_[n] % 2 ? -1.0 : 1.0, degrees_[k] % 2 ? -1.0 : 1.0 });
+            }
+            if (degrees_[k] < order_) {
+                for_each_axis<dimensions>([&](const size_t axis) {
+                    auto raised = indices_[k];
+                    ++raised[axis];
+                    gradient_terms_[axis].push_back({ k, find(raised) });
+                });
+            }
+        }
+
+        powers_.resize(count);
+        derivatives_.resize(count);
+    }
+
+    // powers_[n] = s^n / n!
+    void compute_powers(const point& s) {
+        powers_[0] = 1.0;
+        for (size_t t { 1 }; t < terms(); ++t) {
+            const auto axis = step_axis_[t];
+            powers_[t] = powers_[lower_[t][axis]] * s[axis] / indices_[t][axis];
+        }
+    }
+
+    /*
+    derivatives_[n] = d^n (1 / |R|), from differentiating r^2 d_i (1/r) = -R_i / r n - e_i times:
+    r^2 T_n = -(R_i T_n' + n'_i T_(n' - e_i) + sum_j n'_j (2 R_j T_(n - e_j) + (n'_j - 1) T_(n - 2 e_j)))
+    with n' = n - e_i.
+     */
+    void compute_derivatives(const point& R) {
+        double r2 { 0.0 };
+        for_each_axis<dimensions>([&](const size_t axis) { r2 += R[axis] * R[axis]; });
+        const auto inv_r2 = 1.0 / r2;
+
+        derivatives_[0] = std::sqrt(inv_r2);
+        for (size_t t { 1 }; t < terms(); ++t) {
+            const auto i = step_axis_[t];
+            const auto lower = lower_[t][i];
+            double sum = R[i] * derivatives_[lower];
+            for (size_t j { 0 }; j < dimensions; ++j) {
+                const auto n_j = indices_[t][j] - (j == i ? 1 : 0);
+                if (n_j == 0) { continue; }
+                if (j == i) { sum += n_j * derivatives_[lower2_[t][i]]; }
+                sum += n_j * 2.0 * R[j] * derivatives_[lower_[t][j]];
+                if (n_j >= 2) { sum += n_j * (n_j - 1.0) * derivatives_[lower2_[t][j]]; }
+            }
+            derivatives_[t] = -sum * inv_r2;
+        }
+    }
+
+    double* multipole(const size_t node) { return multipoles_.data() + node * terms(); }
+    double* local(const size_t node) { return locals_.data() + node * terms(); }
+
+    void upward(const size_t node_index) {
+        const auto& nodes = tree_->nodes();
+        const auto& node = nodes[node_index];
+        const auto M = multipole(node_index);
+        std::fill(M, M + terms(), 0.0);
+
+        double offset2 { 0.0 };
+        for_each_axis<dimensions>([&](const size_t axis) {
+            const auto offset = node.center_of_mass[axis] - node.center[axis];
+            offset2 += offset * offset;
+        });
+        radii_[node_index] = std::sqrt(offset2) + node.half_width * std::sqrt(double(dimensions));
+
+        if (node.first_child == 0) {
+            const auto& coordinates = tree_->coordinates();
+            const auto& masses = tree_->masses();
+            for (size_t p { node.begin }; p < node.end; ++p) {
+                point s;
+                for_each_axis<dimensions>(
+                    [&](const size_t axis) { s[axis] = coordinates[axis][p] - node.center_of_mass[axis]; });
+                compute_powers(s);
+                for (size_t t { 0 }; t < terms(); ++t) {
+                    M[t] += masses[p] * powers_[t];
+                }
+            }
+            return;
+        }
+
+        for (size_t q { 0 }; q < Orthtree<dimensions>::children_per_node; ++q) {
+            const auto child_index = node.first_child + q;
+            const auto& child = nodes[child_index];
+            if (child.begin == child.end) { continue; }
+            upward(child_index);
+
+            point s;
+            for_each_axis<dimensions>(
+                [&](const size_t axis) { s[axis] = child.center_of_mass[axis] - node.center_of_mass[axis]; });
+            compute_powers(s);
+            const auto child_M = multipole(child_index);
+            for (const auto& term : shift_terms_) {
+                M[term.sum] += child_M[term.part] * powers_[term.rest];
+            }
+        }
+    }
+
+    // Direct interactions of the particles of two nodes, or of one node with itself
+    void particle_to_particle(const Node& a, const Node& b) {
+        const auto a_particles = a.end - a.begin;
+        pair_interactions_ += &a == &b ? a_particles * (a_particles - 1) / 2 : a_particles * (b.end - b.begin);
+
+        kernels::const_axes<dimensions> r;
+        kernels::axes<dimensions> acceleration;
+        for_each_axis<dimensions>([&](const size_t axis) {
+            r[axis] = tree_->coordinates()[axis].data();
+            acceleration[axis] = accelerations_[axis].data();
+        });
+        kernels::accumulate_tile_simd<dimensions>(r, tree_->masses().data(), a.begin, a.end, b.begin, b.end,
+                                                  acceleration);
+    }
+
+    // Both local expansions from both multipoles, sharing the derivatives
+    void multipole_to_local(const size_t a_index, const size_t b_index) {
+        ++cell_interactions_;
+        const auto& nodes = tree_->nodes();
+        point R;
+        for_each_axis<dimensions>([&](const size_t axis) {
+            R[axis] = nodes[b_index].center_of_mass[axis] - nodes[a_index].center_of_mass[axis];
+        });
+        compute_derivatives(R);
+
+        const auto M_a = multipole(a_index);
+        const auto M_b = multipole(b_index);
+        const auto L_a = local(a_index);
+        const auto L_b = local(b_index);
+        for (const auto& term : m2l_terms_) {
+            const auto D = derivatives_[term.derivative];
+            L_b[term.local] += term.multipole_sign * M_a[term.multipole] * D;
+            L_a[term.local] += term.local_sign * M_b[term.multipole] * D;
+        }
+    }
+
+    bool well_separated(const size_t a_index, const size_t b_index) const {
+        const auto& a = tree_->nodes()[a_index];
+        const auto& b = tree_->nodes()[b_index];
+        double d2 { 0.0 };
+        for_each_axis<dimensions>([&](const size_t axis) {
+            const auto d = b.center_of_mass[axis] - a.center_of_mass[axis];
+            d2 += d * d;
+        });
+        const auto radii = radii_[a_index] + radii_[b_index];
+        return radii * radii < theta_ * theta_ * d2;
+    }
+
+    void interact(const size_t a_index, const size_t b_index) {
+        const auto& nodes = tree_->nodes();
+        const auto& a = nodes[a_index];
+        const auto& b = nodes[b_index];
+        constexpr auto children = Orthtree<dimensions>::children_per_node;
+
+        if (a_index == b_index) {
+            if (a.first_child == 0) {
+                particle_to_particle(a, a);
+                return;
+            }
+            for (size_t q { 0 }; q < children; ++q) {
+                if (nodes[a.first_child + q].begin == nodes[a.first_child + q].end) { continue; }
+                for (size_t r { q }; r < children; ++r) {
+                    if (nodes[a.first_child + r].begin == nodes[a.first_child + r].end) { continue; }
+                    interact(a.first_child + q, a.first_child + r);
+                }
+            }
+            return;
+        }
+
+        if (well_separated(a_index, b_index)) {
+            multipole_to_local(a_index, b_index);
+            return;
+        }
+
+        if (a.first_child == 0 && b.first_child == 0) {
+            particle_to_particle(a, b);
+            return;
+        }
+
+        // Split the larger cell
+        const auto split_a = b.first_child == 0 || (a.first_child != 0 && a.half_width >= b.half_width);
+        const auto& split = split_a ? a : b;
+        for (size_t q { 0 }; q < children; ++q) {
+            const auto child_index = split.first_child + q;
+            if (nodes[child_index].begin == nodes[child_index].end) { continue; }
+            if (split_a) {
+                interact(child_index, b_index);
+            } else {
+                interact(a_index, child_index);
+            }
+        }
+    }
+
+    void downward(const size_t node_index) {
+        const auto& nodes = tree_->nodes();
+        const auto& node = nodes[node_index];
+        const auto L = local(node_index);
+
+        if (node.first_child == 0) {
+            const auto& coordinates = tree_->coordinates();
+            for (size_t p { node.begin }; p < node.end; ++p) {
+                point y;
+                for_each_axis<dimensions>(
+                    [&](const size_t axis) { y[axis] = coordinates[axis][p] - node.center_of_mass[axis]; });
+                compute_powers(y);
+                for_each_axis<dimensions>([&](const size_t axis) {
+                    double a { 0.0 };
+                    for (const auto& [k, raised] : gradient_terms_[axis]) {
+                        a += L[raised] * powers_[k];
+                    }
+                    accelerations_[axis][p] += a;
+                });
+            }
+            return;
+        }
+
+        for (size_t q { 0 }; q < Orthtree<dimensions>::children_per_node; ++q) {
+            const auto child_index = node.first_child + q;
+            const auto& child = nodes[child_index];
+            if (child.begin == child.end) { continue; }
+
+            point s;
+            for_each_axis<dimensions>(
+                [&](const size_t axis) { s[axis] = child.center_of_mass[axis] - node.center_of_mass[axis]; });
+            compute_powers(s);
+            const auto child_L = local(child_index);
+            for (const auto& term : shift_terms_) {
+                child_L[term.part] += L[term.sum] * powers_[term.rest];
+            }
+            downward(child_index);
+        }
+    }
+
+  public:
+    explicit FastMultipole(const size_t order = 4) { set_order(order); }
+
+    // Highest degree kept in the expansions, at least 1 since the accelerations are gradients
+    void set_order(const size_t order) {
+        assert(order >= 1 && order < 64);
+        if (order == order_) { return; }
+        order_ = order;
+        build_tables();
+    }
+    size_t order() const { return order_; }
+
+    // Cells A and B interact through their expansions when (radius A + radius B) < theta * distance
+    void set_theta(const double theta) { theta_ = theta; }
+    double theta() const { return theta_; }
+
+    // Accelerations without G of all particles of the tree, see acceleration_at
+    void evaluate(const Orthtree<dimensions>& tree) {
+        tree_ = &tree;
+        const auto& nodes = tree.nodes();
+        const auto particles = tree.masses().size();
+
+        for (auto& accelerations : accelerations_) {
+            accelerations.assign(particles, 0.0);
+        }
+        if (particles == 0) { return; }
+
+        // Sized after the node capacity of the tree, so that steady state evaluations do not allocate
+        multipoles_.reserve(nodes.capacity() * terms());
+        locals_.reserve(nodes.capacity() * terms());
+        radii_.reserve(nodes.capacity());
+        multipoles_.resize(nodes.size() * terms());
+        locals_.assign(nodes.size() * terms(), 0.0);
+        radii_.resize(nodes.size());
+
+        pair_interactions_ = 0;
+        cell_interactions_ = 0;
+        upward(0);
+        interact(0, 0);
+        downward(0);
+    }
+
+    size_t pair_interactions() const { return pair_interactions_; }
+    size_t cell_interactions() const { return cell_interactions_; }
+
+    // Acceleration of the particle at tree position p from the last evaluate
+    point acceleration_at(const size_t p) const {
+        point acceleration;
+        for_each_axis<dimensions>([&](const size_t axis) { acceleration[axis] = accelerations_[axis][p]; });
+        return acceleration;
+    }
+};
+
+} // namespace nps
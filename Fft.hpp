@@ -0,0 +1,74 @@
+#pragma once
+
+#include <cassert>
+#include <cmath>
+#include <complex>
+#include <numbers>
+#include <utility>
+#include <vector>
+
+namespace nps {
+
+/*
+In place radix-2 complex FFT of a fixed power of two size.
+Twiddle factors and the bit reversal permutation are computed once per size.
+The inverse transform is not normalized, it multiplies the round trip by size().
+ */
+class Fft {
+  private:
+    size_t size_ { 0 };
+    std::vector<std::complex<double>> twiddles_ {};
+    std::vector<size_t> bit_reversed_ {};
+
+  public:
+    explicit Fft(const size_t size = 1) { resize(size); }
+
+    size_t size() const { return size_; }
+
+    void resize(const size_t size) {
+        assert(size > 0 && (size & (size - 1)) == 0);
+        if (size == size_) { return; }
+        size_ = size;
+
+        twiddles_.resize(size / 2);
+        for (size_t k { 0 }; k < size / 2; ++k) {
+            const auto angle = -2.0 * std::numbers::pi * double(k) / double(size);
+            twiddles_[k] = { std::cos(angle), std::sin(angle) };
+        }
+
+        bit_reversed_.resize(size);
+        size_t bits { 0 };
+        while ((size_t { 1 } << bits) < size) {
+            ++bits;
+        }
+        for (size_t i { 0 }; i < size; ++i) {
+            size_t reversed { 0 };
+            for (size_t bit { 0 }; bit < bits; ++bit) {
+                reversed |= ((i >> bit) & 1) << (bits - 1 - bit);
+            }
+            bit_reversed_[i] = reversed;
+        }
+    }
+
+    void transform(std::complex<double>* data, const bool inverse) const {
+        for (size_t i { 0 }; i < size_; ++i) {
+            if (i < bit_reversed_[i]) { std::swap(data[i], data[bit_reversed_[i]]); }
+        }
+
+        for (size_t length { 2 }; length <= size_; length *= 2) {
+            const auto half = length / 2;
+            const auto stride = size_ / length;
+            for (size_t begin { 0 }; begin < size_; begin += length) {
+                for (size_t k { 0 }; k < half; ++k) {
+                    const auto w = inverse ? std::conj(twiddles_[k * stride]) : twiddles_[k * stride];
+                    const auto u = data[begin + k];
+                    const auto v = data[begin + k + half] * w;
+                    data[begin + k] = u + v;
+                    data[begin + k + half] = u - v;
+                }
+            }
+        }
+    }
+};
+
+} // namespace nps
@@ -0,0 +1,21 @@
+#pragma once
+
+#include <cstddef>
+
+#include <unistd.h>
+
+namespace nps {
+
+// write(2) until all of data is written, false on errors
+inline bool write_all(const int fd, const void* data, size_t size) {
+    auto bytes = static_cast<const std::byte*>(data);
+    while (size > 0) {
+        const auto written = ::write(fd, bytes, size);
+        if (written <= 0) { return false; }
+        bytes += written;
+        size -= static_cast<size_t>(written);
+    }
+    return true;
+}
+
+} // namespace nps
@@ -0,0 +1,173 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <limits>
+#include <span>
+#include <vector>
+
+#include "Axes.hpp"
+#include "ThreadPool.hpp"
+
+namespace nps {
+
+/*
+Z-order (Morton) sort of raw particle coordinates.
+
+Coordinates are quantized on the bounding box of the particles, 32 bits per axis in 2D and 21 in 3D,
+and their bits interleaved into a 64 bit key, so particles close in space are mostly close in the
+order. The keys are sorted by a stable least significant digit radix sort, eight bits a pass: every
+thread counts the digits of its chunk of the particles and then scatters the chunk to the offsets
+of its own counts. Passes on a digit that all keys share are skipped. Storage is reused between sorts.
+ */
+template <size_t dimensions>
+class MortonOrder {
+  private:
+    static constexpr size_t bits_per_axis_ = 64 / dimensions;
+    static constexpr size_t key_bits_ = bits_per_axis_ * dimensions;
+    static constexpr size_t digit_bits_ = 8;
+    static constexpr size_t radix_ = size_t { 1 } << digit_bits_;
+
+    std::vector<std::uint64_t> keys_ {};
+    std::vector<std::uint64_t> sorted_keys_ {};
+    // Sorted position -> particle index
+    std::vector<size_t> order_ {};
+    std::vector<size_t> sorted_order_ {};
+    // Digit counts and then scatter offsets of each thread: [thread][digit]
+    std::vector<size_t> histograms_ {};
+    // Bounding box of each thread's chunk: [thread][axis]
+    std::vector<std::array<double, dimensions>> thread_min_ {};
+    std::vector<std::array<double, dimensions>> thread_max_ {};
+
+    std::array<double, dimensions> min_ {};
+    std::array<double, dimensions> cells_per_unit_ {};
+
+    // Spreads the low bits_per_axis_ bits of x so that dimensions - 1 zero bits follow every bit
+    static std::uint64_t spread_bits(std::uint64_t x) {
+        if constexpr (dimensions == 2) {
+            x &= 0x00000000ffffffff;
+            x = (x | (x << 16)) & 0x0000ffff0000ffff;
+            x = (x | (x << 8)) & 0x00ff00ff00ff00ff;
+            x = (x | (x << 4)) & 0x0f0f0f0f0f0f0f0f;
+            x = (x | (x << 2)) & 0x3333333333333333;
+            x = (x | (x << 1)) & 0x5555555555555555;
+        } else {
+            x &= 0x00000000001fffff;
+            x = (x | (x << 32)) & 0x001f00000000ffff;
+            x = (x | (x << 16)) & 0x001f0000ff0000ff;
+            x = (x | (x << 8)) & 0x100f00f00f00f00f;
+            x = (x | (x << 4)) & 0x10c30c30c30c30c3;
+            x = (x | (x << 2)) & 0x1249249249249249;
+        }
+        return x;
+    }
+
+    std::uint64_t key_of(const std::array<std::span<const double>, dimensions>& coordinates, const size_t i) const {
+        constexpr auto max_cell = double((std::uint64_t { 1 } << bits_per_axis_) - 1);
+        std::uint64_t key { 0 };
+        for_each_axis<dimensions>([&](const size_t axis) {
+            const auto cell = std::clamp((coordinates[axis][i] - min_[axis]) * cells_per_unit_[axis], 0.0, max_cell);
+            key |= spread_bits(static_cast<std::uint64_t>(cell)) << axis;
+        });
+        return key;
+    }
+
+    void fit_bounds(const std::array<std::span<const double>, dimensions>& coordinates, const size_t particles,
+                    ThreadPool& pool) {
+        const auto threads = pool.size();
+        thread_min_.resize(threads);
+        thread_max_.resize(threads);
+        pool.run([&](const size_t t) {
+            thread_min_[t].fill(std::numeric_limits<double>::infinity());
+            thread_max_[t].fill(-std::numeric_limits<double>::infinity());
+            for (size_t i { particles * t / threads }; i < particles * (t + 1) / threads; ++i) {
+                for_each_axis<dimensions>([&](const size_t axis) {
+                    thread_min_[t][axis] = std::min(thread_min_[t][axis], coordinates[axis][i]);
+                    thread_max_[t][axis] = std::max(thread_max_[t][axis], coordinates[axis][i]);
+                });
+            }
+        });
+
+        for_each_axis<dimensions>([&](const size_t axis) {
+            auto max = -std::numeric_limits<double>::infinity();
+            min_[axis] = std::numeric_limits<double>::infinity();
+            for (size_t t { 0 }; t < threads; ++t) {
+                min_[axis] = std::min(min_[axis], thread_min_[t][axis]);
+                max = std::max(max, thread_max_[t][axis]);
+            }
+            const auto extent = max - min_[axis];
+            cells_per_unit_[axis] = extent > 0.0 ? double((std::uint64_t { 1 } << bits_per_axis_) - 1) / extent : 0.0;
+        });
+    }
+
+  public:
+    // Grows the storage up front so that later sorts of as many particles do not allocate
+    void reserve(const size_t particles) {
+        keys_.reserve(particles);
+        sorted_keys_.reserve(particles);
+        order_.reserve(particles);
+        sorted_order_.reserve(particles);
+    }
+
+    // Sorts the particles by Morton key with the threads of pool, see order()
+    void sort(const std::array<std::span<const double>, dimensions>& coordinates, ThreadPool& pool) {
+        const auto particles = coordinates[0].size();
+        const auto threads = pool.size();
+        keys_.resize(particles);
+        sorted_keys_.resize(particles);
+        order_.resize(particles);
+        sorted_order_.resize(particles);
+        histograms_.resize(threads * radix_);
+        if (particles == 0) { return; }
+
+        fit_bounds(coordinates, particles, pool);
+        pool.parallel_for(particles, [&](const size_t begin, const size_t end, size_t) {
+            for (size_t i { begin }; i < end; ++i) {
+                keys_[i] = key_of(coordinates, i);
+                order_[i] = i;
+            }
+        });
+
+        for (size_t shift { 0 }; shift < key_bits_; shift += digit_bits_) {
+            pool.run([&](const size_t t) {
+                const auto counts = histograms_.data() + t * radix_;
+                std::fill(counts, counts + radix_, 0);
+                for (size_t i { particles * t / threads }; i < particles * (t + 1) / threads; ++i) {
+                    ++counts[(keys_[i] >> shift) & (radix_ - 1)];
+                }
+            });
+
+            // Counts to offsets, digit major and thread minor, which keeps the scatter stable
+            size_t offset { 0 };
+            bool single_digit { false };
+            for (size_t digit { 0 }; digit < radix_; ++digit) {
+                size_t count_of_digit { 0 };
+                for (size_t t { 0 }; t < threads; ++t) {
+                    const auto count = histograms_[t * radix_ + digit];
+                    histograms_[t * radix_ + digit] = offset;
+                    offset += count;
+                    count_of_digit += count;
+                }
+                single_digit = single_digit || count_of_digit == particles;
+            }
+            if (single_digit) { continue; }
+
+            pool.run([&](const size_t t) {
+                const auto offsets = histograms_.data() + t * radix_;
+                for (size_t i { particles * t / threads }; i < particles * (t + 1) / threads; ++i) {
+                    const auto p = offsets[(keys_[i] >> shift) & (radix_ - 1)]++;
+                    sorted_keys_[p] = keys_[i];
+                    sorted_order_[p] = order_[i];
+                }
+            });
+            keys_.swap(sorted_keys_);
+            order_.swap(sorted_order_);
+        }
+    }
+
+    // Sorted position -> particle index of the last sort
+    const std::vector<size_t>& order() const { return order_; }
+};
+
+} // namespace nps
@@ -0,0 +1,346 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+#include "Axes.hpp"
+#include "PairwiseKernels.hpp"
+#include "ThreadPool.hpp"
+
+namespace nps {
+
+// Why a system of a NewtonPointEnsemble stopped, running while it has not
+enum class ensemble_outcome : std::uint8_t { running, end_time, escape, collision };
+
+/*
+Many small independent systems of the same particle count, stepped together, e.g. the realizations of a
+few-body Monte Carlo study. With a few particles per system a direct sum has too few pairs to fill SIMD
+lanes, so the lanes go across systems instead: systems are grouped into batches of one vector width and
+stored interleaved, system innermost, as [batch][axis][particle][system in batch]. One kernel then runs
+the pairs of a whole batch per vector operation, and the threads take whole batches.
+
+Numbers are raw, in any consistent units with the gravitational constant given to the constructor.
+Every system steps with kick-drift-kick leapfrog on its own timestep and clock. A system stops at its
+end time, when a particle escapes farther than the escape radius from the system's center of mass, or
+when a pair comes closer than the collision radius, whichever comes first, and keeps its state from
+then on. Systems of a batch that stopped still ride along in the kernel, batches where all did are skipped.
+ */
+template <size_t dimensions>
+    requires(dimensions == 2 || dimensions == 3)
+class NewtonPointEnsemble {
+  public:
+#ifdef NPS_HAS_SIMD
+    using lane_vector = kernels::simd_double;
+    static constexpr size_t lanes = lane_vector::size();
+#else
+    using lane_vector = double;
+    static constexpr size_t lanes = 1;
+#endif
+
+  private:
+    size_t systems_;
+    size_t particles_;
+    size_t batches_;
+    double G_;
+
+    // [batch][axis][particle][lane]
+    std::vector<double> coordinates_ {};
+    std::vector<double> speeds_ {};
+    // Without G, of the current coordinates once accelerations_valid_
+    std::vector<double> accelerations_ {};
+    // [batch][particle][lane], padding systems have zero masses
+    std::vector<double> masses_ {};
+    bool accelerations_valid_ { false };
+
+    // Per system, padded to whole batches
+    std::vector<double> timesteps_ {};
+    std::vector<double> times_ {};
+    std::vector<double> end_times_ {};
+    std::vector<ensemble_outcome> outcomes_ {};
+
+    double escape_radius_ { std::numeric_limits<double>::infinity() };
+    double collision_radius_ { 0.0 };
+
+    ThreadPool thread_pool_;
+
+    size_t vector_at(const size_t batch, const size_t axis, const size_t particle) const {
+        return ((batch * dimensions + axis) * particles_ + particle) * lanes;
+    }
+    size_t mass_at(const size_t batch, const size_t particle) const { return (batch * particles_ + particle) * lanes; }
+
+    static lane_vector load(const double* lane_values) {
+#ifdef NPS_HAS_SIMD
+        return lane_vector(lane_values, kernels::stdx::element_aligned);
+#else
+        return *lane_values;
+#endif
+    }
+
+    static void store(const lane_vector& vector, double* lane_values) {
+#ifdef NPS_HAS_SIMD
+        vector.copy_to(lane_values, kernels::stdx::element_aligned);
+#else
+        *lane_values = vector;
+#endif
+    }
+
+    static lane_vector lane_sqrt(const lane_vector& vector) {
+#ifdef NPS_HAS_SIMD
+        return kernels::stdx::sqrt(vector);
+#else
+        return std::sqrt(vector);
+#endif
+    }
+
+    static lane_vector lane_min(const lane_vector& a, const lane_vector& b) {
+#ifdef NPS_HAS_SIMD
+        return kernels::stdx::min(a, b);
+#else
+        return std::min(a, b);
+#endif
+    }
+
+    static lane_vector lane_max(const lane_vector& a, const lane_vector& b) {
+#ifdef NPS_HAS_SIMD
+        return kernels::stdx::max(a, b);
+#else
+        return std::max(a, b);
+#endif
+    }
+
+    // Direct sum of every system of the batch, one system per lane. Returns the smallest squared pair
+    // distance of each system.
+    lane_vector compute_accelerations(const size_t batch) {
+        std::array<double*, dimensions> r;
+        std::array<double*, dimensions> a;
+        for_each_axis<dimensions>([&](const size_t axis) {
+            r[axis] = coordinates_.data() + vector_at(batch, axis, 0);
+            a[axis] = accelerations_.data() + vector_at(batch, axis, 0);
+            std::fill(a[axis], a[axis] + particles_ * lanes, 0.0);
+        });
+        const auto m = masses_.data() + mass_at(batch, 0);
+
+        lane_vector min_d2 { std::numeric_limits<double>::infinity() };
+        for (size_t i { 0 }; i < particles_; ++i) {
+            std::array<lane_vector, dimensions> ri;
+            std::array<lane_vector, dimensions> ai;
+            for_each_axis<dimensions>([&](const size_t axis) {
+                ri[axis] = load(r[axis] + i * lanes);
+                ai[axis] = load(a[axis] + i * lanes);
+            });
+            const auto mi = load(m + i * lanes);
+
+            for (size_t j { i + 1 }; j < particles_; ++j) {
+                std::array<lane_vector, dimensions> d;
+                lane_vector d2 { 0.0 };
+                for_each_axis<dimensions>([&](const size_t axis) {
+                    d[axis] = load(r[axis] + j * lanes) - ri[axis];
+                    d2 += d[axis] * d[axis];
+                });
+                min_d2 = lane_min(min_d2, d2);
+                const auto inv_d3 = 1.0 / (d2 * lane_sqrt(d2));
+                const auto mj = load(m + j * lanes);
+
+                for_each_axis<dimensions>([&](const size_t axis) {
+                    ai[axis] += mj * inv_d3 * d[axis];
+                    store(load(a[axis] + j * lanes) - mi * inv_d3 * d[axis], a[axis] + j * lanes);
+                });
+            }
+
+            for_each_axis<dimensions>([&](const size_t axis) { store(ai[axis], a[axis] + i * lanes); });
+        }
+        return min_d2;
+    }
+
+    // Largest squared distance of a particle from its system's center of mass, per lane
+    lane_vector max_escape_distance2(const size_t batch) const {
+        const auto m = masses_.data() + mass_at(batch, 0);
+        std::array<lane_vector, dimensions> center {};
+        lane_vector mass { 0.0 };
+        for (size_t i { 0 }; i < particles_; ++i) {
+            const auto mi = load(m + i * lanes);
+            mass += mi;
+            for_each_axis<dimensions>([&](const size_t axis) {
+                center[axis] += mi * load(coordinates_.data() + vector_at(batch, axis, i));
+            });
+        }
+        for_each_axis<dimensions>([&](const size_t axis) { center[axis] /= mass; });
+
+        lane_vector max_d2 { 0.0 };
+        for (size_t i { 0 }; i < particles_; ++i) {
+            lane_vector d2 { 0.0 };
+            for_each_axis<dimensions>([&](const size_t axis) {
+                const auto d = load(coordinates_.data() + vector_at(batch, axis, i)) - center[axis];
+                d2 += d * d;
+            });
+            max_d2 = lane_max(max_d2, d2);
+        }
+        return max_d2;
+    }
+
+    // Up to `steps` leapfrog steps of every running system of the batch
+    void evolve_batch(const size_t batch, const size_t steps) {
+        const auto first_system = batch * lanes;
+        const auto running = [&](const size_t lane) {
+            return outcomes_[first_system + lane] == ensemble_outcome::running;
+        };
+
+        // Timestep and G times the half timestep of every lane, zero for systems that stopped
+        alignas(64) std::array<double, lanes> dt;
+        alignas(64) std::array<double, lanes> half_kick;
+        const auto set_timesteps = [&] {
+            for (size_t lane { 0 }; lane < lanes; ++lane) {
+                dt[lane] = running(lane) ? timesteps_[first_system + lane] : 0.0;
+                half_kick[lane] = 0.5 * G_ * dt[lane];
+            }
+        };
+        // Kept current for stopped systems too, in case they are resumed
+        if (!accelerations_valid_) { compute_accelerations(batch); }
+        set_timesteps();
+        if (std::ranges::all_of(dt, [](const double lane_dt) { return lane_dt == 0.0; })) { return; }
+
+        const auto kick = [&] {
+            const auto kick_lanes = load(half_kick.data());
+            for_each_axis<dimensions>([&](const size_t axis) {
+                for (size_t i { 0 }; i < particles_; ++i) {
+                    const auto at = vector_at(batch, axis, i);
+                    store(load(speeds_.data() + at) + kick_lanes * load(accelerations_.data() + at),
+                          speeds_.data() + at);
+                }
+            });
+        };
+
+        alignas(64) std::array<double, lanes> min_d2;
+        alignas(64) std::array<double, lanes> max_d2;
+        for (size_t step { 0 }; step < steps; ++step) {
+            kick();
+            const auto dt_lanes = load(dt.data());
+            for_each_axis<dimensions>([&](const size_t axis) {
+                for (size_t i { 0 }; i < particles_; ++i) {
+                    const auto at = vector_at(batch, axis, i);
+                    store(load(coordinates_.data() + at) + dt_lanes * load(speeds_.data() + at),
+                          coordinates_.data() + at);
+                }
+            });
+            store(compute_accelerations(batch), min_d2.data());
+            kick();
+
+            const auto escapes = std::isfinite(escape_radius_);
+            if (escapes) { store(max_escape_distance2(batch), max_d2.data()); }
+
+            bool stopped { false };
+            for (size_t lane { 0 }; lane < lanes; ++lane) {
+                if (!running(lane)) { continue; }
+                const auto system = first_system + lane;
+                times_[system] += dt[lane];
+                if (min_d2[lane] < collision_radius_ * collision_radius_) {
+                    outcomes_[system] = ensemble_outcome::collision;
+                } else if (escapes && max_d2[lane] > escape_radius_ * escape_radius_) {
+                    outcomes_[system] = ensemble_outcome::escape;
+                } else if (times_[system] >= end_times_[system]) {
+                    outcomes_[system] = ensemble_outcome::end_time;
+                }
+                stopped = stopped || !running(lane);
+            }
+            if (stopped) {
+                set_timesteps();
+                if (std::ranges::all_of(dt, [](const double lane_dt) { return lane_dt == 0.0; })) { return; }
+            }
+        }
+    }
+
+  public:
+    NewtonPointEnsemble(const size_t systems, const size_t particles, const double G = 1.0e-2,
+                        const size_t threads = 1)
+        : systems_(systems), particles_(particles), batches_((systems + lanes - 1) / lanes), G_(G),
+          coordinates_(batches_ * dimensions * particles * lanes, 0.0), speeds_(coordinates_.size(), 0.0),
+          accelerations_(coordinates_.size(), 0.0), masses_(batches_ * particles * lanes, 0.0),
+          timesteps_(batches_ * lanes, 1.0), times_(batches_ * lanes, 0.0),
+          end_times_(batches_ * lanes, std::numeric_limits<double>::infinity()),
+          outcomes_(batches_ * lanes, ensemble_outcome::running), thread_pool_(threads) {
+        // Padding systems never run, and their particles sit apart so that their pairs stay finite
+        for (auto system = systems_; system < batches_ * lanes; ++system) {
+            outcomes_[system] = ensemble_outcome::end_time;
+            for (size_t i { 0 }; i < particles_; ++i) {
+                coordinates_[vector_at(system / lanes, 0, i) + system % lanes] = double(i);
+            }
+        }
+    }
+
+    size_t systems() const { return systems_; }
+    size_t particles() const { return particles_; }
+
+    void set_particle(const size_t system, const size_t i, const std::array<double, dimensions>& coordinates,
+                      const std::array<double, dimensions>& speeds, const double mass) {
+        assert(system < systems_ && i < particles_);
+        const auto batch = system / lanes;
+        const auto lane = system % lanes;
+        for_each_axis<dimensions>([&](const size_t axis) {
+            coordinates_[vector_at(batch, axis, i) + lane] = coordinates[axis];
+            speeds_[vector_at(batch, axis, i) + lane] = speeds[axis];
+        });
+        masses_[mass_at(batch, i) + lane] = mass;
+        accelerations_valid_ = false;
+    }
+
+    std::array<double, dimensions> coordinates_of(const size_t system, const size_t i) const {
+        std::array<double, dimensions> coordinates;
+        for_each_axis<dimensions>([&](const size_t axis) {
+            coordinates[axis] = coordinates_[vector_at(system / lanes, axis, i) + system % lanes];
+        });
+        return coordinates;
+    }
+
+    std::array<double, dimensions> speeds_of(const size_t system, const size_t i) const {
+        std::array<double, dimensions> speeds;
+        for_each_axis<dimensions>([&](const size_t axis) {
+            speeds[axis] = speeds_[vector_at(system / lanes, axis, i) + system % lanes];
+        });
+        return speeds;
+    }
+
+    double mass_of(const size_t system, const size_t i) const {
+        return masses_[mass_at(system / lanes, i) + system % lanes];
+    }
+
+    void set_timestep(const size_t system, const double timestep) { timesteps_[system] = timestep; }
+    void set_end_time(const size_t system, const double end_time) { end_times_[system] = end_time; }
+    // Same timestep and end time for every system
+    void set_timestep(const double timestep) { std::fill(timesteps_.begin(), timesteps_.begin() + systems_, timestep); }
+    void set_end_time(const double end_time) { std::fill(end_times_.begin(), end_times_.begin() + systems_, end_time); }
+
+    // Infinity never stops a system for an escape, which also skips the check
+    void set_escape_radius(const double radius) { escape_radius_ = radius; }
+    void set_collision_radius(const double radius) { collision_radius_ = radius; }
+
+    // Lets a stopped system run again, e.g. after a later end time was set
+    void resume(const size_t system) {
+        assert(system < systems_);
+        outcomes_[system] = ensemble_outcome::running;
+    }
+
+    double time_of(const size_t system) const { return times_[system]; }
+    ensemble_outcome outcome_of(const size_t system) const { return outcomes_[system]; }
+
+    size_t running_systems() const {
+        return static_cast<size_t>(std::count(outcomes_.begin(), outcomes_.begin() + systems_,
+                                              ensemble_outcome::running));
+    }
+
+    // Up to `steps` steps of every running system, batches split between the threads
+    void evolve_n_steps(const size_t steps) {
+        thread_pool_.parallel_for(batches_, [&](const size_t begin, const size_t end, size_t) {
+            for (size_t batch { begin }; batch < end; ++batch) {
+                evolve_batch(batch, steps);
+            }
+        });
+        accelerations_valid_ = true;
+    }
+};
+
+} // namespace nps
@@ -11,36 +11,123 @@
 #include "units/quantity_io.h"
 #include <algorithm>
 #include <array>
+#include <atomic>
+#include <cassert>
 #include <chrono>
+#include <concepts>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
 #include <iostream>
+#include <limits>
+#include <numeric>
 #include <ranges>
+#include <span>
 #include <string>
+#include <type_traits>
+#include <utility>
 #include <vector>
 
-#include <ANSI.hpp>
+#include "Axes.hpp"
+#include "CellList.hpp"
+#include "Checkpoint.hpp"
+#include "FastMultipole.hpp"
+#include "MortonOrder.hpp"
+#include "Orthtree.hpp"
+#include "PairwiseKernels.hpp"
+#include "ParticleMesh.hpp"
+#include "RenderThread.hpp"
+#include "SpatialHash.hpp"
+#include "StepMetrics.hpp"
+#include "TerminalRenderer.hpp"
+#include "ThreadPool.hpp"
+#include "TrajectoryWriter.hpp"
 
 namespace nps {
 using namespace units;
 using namespace units::isq;
 
-template <typename T>
-int sign(T val) {
-    return (T(0) < val) - (val < T(0));
+// Quantities are standard layout wrappers around a single number,
+// so a vector of them can be handed to the raw numeric kernels as is.
+template <typename Q>
+std::span<const typename Q::rep> raw_span(const std::vector<Q>& quantities) {
+    static_assert(sizeof(Q) == sizeof(typename Q::rep) && std::is_standard_layout_v<Q>);
+    return { reinterpret_cast<const typename Q::rep*>(quantities.data()), quantities.size() };
 }
 
+template <typename Q>
+std::span<typename Q::rep> raw_span(std::vector<Q>& quantities) {
+    static_assert(sizeof(Q) == sizeof(typename Q::rep) && std::is_standard_layout_v<Q>);
+    return { reinterpret_cast<typename Q::rep*>(quantities.data()), quantities.size() };
+}
+
+// raw_span of every axis
+template <typename Q, size_t dimensions>
+auto raw_spans(const std::array<std::vector<Q>, dimensions>& quantities) {
+    std::array<std::span<const typename Q::rep>, dimensions> spans;
+    for_each_axis<dimensions>([&](const size_t axis) { spans[axis] = raw_span(quantities[axis]); });
+    return spans;
+}
+
+template <typename Q, size_t dimensions>
+auto raw_spans(std::array<std::vector<Q>, dimensions>& quantities) {
+    std::array<std::span<typename Q::rep>, dimensions> spans;
+    for_each_axis<dimensions>([&](const size_t axis) { spans[axis] = raw_span(quantities[axis]); });
+    return spans;
+}
+
+// Force calculation used by evolve_n_steps
+enum class engine { cpu_1, simd, cpu_threads, barnes_hut, fmm, particle_mesh, short_range };
+
+/*
+Time integration used by every evolve call.
+semi_implicit_euler: kick then drift, first order.
+leapfrog: kick-drift-kick, second order and symplectic. The accelerations of the closing
+          kick are kept for the opening kick of the next call, so a step costs one force evaluation.
+yoshida4: Yoshida's fourth order composition of leapfrog, three force evaluations per step.
+ */
+enum class integrator { semi_implicit_euler, leapfrog, yoshida4 };
+
+/*
+Conserved quantities of the particles after a step, energies in mass_unit * speed_unit^2 and momentum in
+mass_unit * speed_unit of the simulation. The potential energy belongs to the positions of the step's last
+force evaluation, which are its final positions with leapfrog, and is NaN for engines that do not sum it.
+ */
+template <size_t dimensions>
+struct diagnostics_report {
+    double simulation_time;
+    double kinetic_energy;
+    double potential_energy;
+    std::array<double, dimensions> momentum;
+
+    double total_energy() const { return kinetic_energy + potential_energy; }
+    // 2K / |W|, 1 in virial equilibrium. For the 1 / r potential the virial W of the pair forces is the
+    // potential energy itself.
+    double virial_ratio() const { return 2.0 * kinetic_energy / std::abs(potential_energy); }
+};
+
 /*
 Stores data as units from template arguments.
 Primitive data type is defnied in units.hpp
+
+Coordinates and speeds are stored per axis. The number of axes is a template argument,
+so 2D runs carry no storage or arithmetic for a third axis.
+
+force_real is the precision of the direct sum engines (simd, cpu_threads). With float their pair kernel
+reads float copies of the positions, relative to particle 0, and of the masses, and runs twice the lanes
+over half the bytes, see kernels::accumulate_tile_mixed. Accelerations are still summed in double across
+tiles and threads, and the particle state and integration stay double, since positions accumulate many
+small drifts. precision_error_against_double() reports what the float forces cost.
  */
 template <UnitOf<si::dim_length> coordinate_unit, UnitOf<si::dim_mass> mass_unit, UnitOf<si::dim_time> time_unit,
-          UnitOf<si::dim_speed> speed_unit, UnitOf<si::dim_acceleration> acceleration_unit>
+          UnitOf<si::dim_speed> speed_unit, UnitOf<si::dim_acceleration> acceleration_unit, size_t dimensions = 2,
+          std::floating_point force_real = double>
+    requires(dimensions == 2 || dimensions == 3)
 class NewtonPointSimulation {
 
   private:
-    std::vector<si::length<coordinate_unit>> x_coordinates_ {};
-    std::vector<si::length<coordinate_unit>> y_coordinates_ {};
-    std::vector<si::speed<speed_unit>> x_speeds_ {};
-    std::vector<si::speed<speed_unit>> y_speeds_ {};
+    std::array<std::vector<si::length<coordinate_unit>>, dimensions> coordinates_ {};
+    std::array<std::vector<si::speed<speed_unit>>, dimensions> speeds_ {};
     std::vector<si::mass<mass_unit>> masses_ {};
     si::time<time_unit> simulation_time_ { 0.0 };
 
@@ -50,186 +137,1474 @@ class NewtonPointSimulation {
                                      si::length<si::metre> { 1 } / si::mass<si::kilogram> { 1 } /
                                      si::time<si::second> { 1 } / si::time<si::second> { 1 };
     static constexpr dimensionless<one> G_dimensioless_ { 1.0e-2 }; // Real value: 6.6743e-11
+    // G as a raw number turning mass_unit / coordinate_unit^2 into acceleration_unit
+    static constexpr double G_raw_ =
+        si::acceleration<acceleration_unit>(G_dimensioless_ * G_units_ * si::mass<mass_unit> { 1.0 } /
+                                            (si::length<coordinate_unit> { 1.0 } * si::length<coordinate_unit> { 1.0 }))
+            .number();
 
-    using time_point = std::chrono::time_point<std::chrono::steady_clock>;
-    time_point timing_clock_;
+    static constexpr std::array<const char*, 3> axis_names_ { "x", "y", "z" };
 
-    std::array<std::chrono::milliseconds, 5> last_n_clocked_times_ {};
+    // Size in SI of coordinate_unit, mass_unit, time_unit, speed_unit and acceleration_unit, as in CheckpointHeader
+    static constexpr std::array<double, 5> units_in_si_ {
+        si::length<si::metre>(si::length<coordinate_unit> { 1.0 }).number(),
+        si::mass<si::kilogram>(si::mass<mass_unit> { 1.0 }).number(),
+        si::time<si::second>(si::time<time_unit> { 1.0 }).number(),
+        si::speed<si::metre_per_second>(si::speed<speed_unit> { 1.0 }).number(),
+        si::acceleration<si::metre_per_second_sq>(si::acceleration<acceleration_unit> { 1.0 }).number()
+    };
 
-  public:
-    void start_clock() { timing_clock_ = std::chrono::steady_clock::now(); }
+    Orthtree<dimensions> tree_ {};
+    FastMultipole<dimensions> fmm_ {};
+    ParticleMesh<dimensions> mesh_ {};
+    CellList<dimensions> cell_list_ {};
+
+    ThreadPool thread_pool_ {};
+    static constexpr size_t tile_size_ = 256;
+    static constexpr bool mixed_precision_ = !std::is_same_v<force_real, double>;
+
+    engine engine_ { engine::cpu_1 };
+    double barnes_hut_theta_ { 0.5 };
 
-    void stop_clock() {
-        const auto end_clock_time_ = std::chrono::steady_clock::now();
+    integrator integrator_ { integrator::semi_implicit_euler };
+    // Whether workspace_.accelerations belong to the current coordinates (leapfrog reuses them)
+    bool stored_accelerations_valid_ { false };
 
-        std::ranges::rotate(last_n_clocked_times_, last_n_clocked_times_.begin() + 1);
-        last_n_clocked_times_.back() =
-            std::chrono::duration_cast<std::chrono::milliseconds>(end_clock_time_ - timing_clock_);
+    // Block timesteps: particle i steps with timestep_ / 2^bin where bin <= block_levels_,
+    // see evolve_with_block_timesteps
+    size_t block_levels_ { 6 };
+    double block_accuracy_ { 0.02 };
+    // Whether the jerks and bins in the workspace belong to the current coordinates and speeds
+    bool block_state_valid_ { false };
+
+    // Particles are sorted by Morton key after every reorder_every_ steps, never when 0, see set_morton_reordering
+    MortonOrder<dimensions> morton_ {};
+    size_t reorder_every_ { 0 };
+    size_t steps_since_reorder_ { 0 };
+    // Storage index -> particle ID and back. IDs are the storage indices from when the particle count was
+    // last set, they follow the particles through reorderings and mergers. The ID of a particle that
+    // merged into another maps to the index of the merged body.
+    std::vector<size_t> particle_ids_ {};
+    std::vector<size_t> particle_indices_ {};
+    // Whether storage indices and IDs differ, and then the storage indices by ascending ID for trajectory frames
+    bool particles_reordered_ { false };
+    std::vector<size_t> indices_by_id_ {};
+
+    // Pairs closer than capture_radius_ merge after every step, never when 0, see set_mergers
+    SpatialHash<dimensions> capture_hash_ {};
+    double capture_radius_ { 0.0 };
+
+    // Raw particles of neighbouring domains that pull in the short_range engine but are not stepped, see set_halo
+    std::array<std::vector<double>, dimensions> halo_coordinates_ {};
+    std::vector<double> halo_masses_ {};
+
+    // A diagnostics_report is taken after every diagnostics_every_ steps, never when 0, see set_diagnostics
+    size_t diagnostics_every_ { 0 };
+    size_t steps_since_diagnostics_ { 0 };
+    std::vector<diagnostics_report<dimensions>> diagnostics_ {};
+    // Whether the direct sum engines also sum the potential energy, and the sum of their last force evaluation
+    bool sum_potential_ { false };
+    double potential_energy_ { 0.0 };
+
+    using acceleration_vector = std::vector<si::acceleration<acceleration_unit>>;
+
+    // Buffers reused by every step. They are sized in resize_workspace() when particles
+    // or threads are set, so the step loop itself does not allocate.
+    struct StepWorkspace {
+        std::array<acceleration_vector, dimensions> accelerations {};
+        // One buffer per thread and axis: [thread][axis][particle]
+        std::vector<double> thread_accelerations {};
+        // Block timesteps: jerk per axis, timestep bin per particle and the particles active in a sub-step
+        std::array<std::vector<double>, dimensions> jerks {};
+        std::vector<std::uint8_t> timestep_bins {};
+        std::vector<size_t> active_particles {};
+        // Direct sum inputs in force_real when that is not double, see convert_force_inputs
+        std::array<std::vector<force_real>, dimensions> force_coordinates {};
+        std::vector<force_real> force_masses {};
+        // Gather buffers of reorder_by_morton_key
+        std::vector<double> reordered_values {};
+        std::vector<std::uint8_t> reordered_bins {};
+        // Old storage index -> new one, of reorder_by_morton_key and merge_captured_pairs
+        std::vector<size_t> index_map {};
+        // Particle that absorbed each particle in merge_captured_pairs, or no_particle_
+        std::vector<size_t> absorbed_by {};
+        // Per thread sums of the potential energy of accumulate_tiles, and of the kinetic energy and the
+        // momentum of take_diagnostics: [thread][kinetic energy, momentum per axis]
+        std::vector<double> thread_potentials {};
+        std::vector<std::array<double, dimensions + 1>> thread_kinetics {};
+        // The particles followed by the halo, for the cell list of the short_range engine
+        std::array<std::vector<double>, dimensions> haloed_coordinates {};
+        std::vector<double> haloed_masses {};
+    };
+    StepWorkspace workspace_ {};
+
+    TerminalRenderer renderer_ {};
+    render_style render_style_ { render_style::points };
+
+    // Mutable so that the const checkpoint and trajectory calls can time themselves
+    mutable StepMetrics metrics_ {};
+
+    void resize_workspace(const size_t particles) {
+        for (auto& accelerations : workspace_.accelerations) {
+            accelerations.resize(particles);
+        }
+        workspace_.thread_accelerations.resize(dimensions * thread_pool_.size() * particles);
+        workspace_.thread_potentials.resize(thread_pool_.size());
+        workspace_.thread_kinetics.resize(thread_pool_.size());
+        for (auto& jerks : workspace_.jerks) {
+            jerks.resize(particles);
+        }
+        workspace_.timestep_bins.resize(particles);
+        workspace_.active_particles.reserve(particles);
+        if constexpr (mixed_precision_) {
+            for (auto& coordinates : workspace_.force_coordinates) {
+                coordinates.resize(particles);
+            }
+            workspace_.force_masses.resize(particles);
+        }
+        if (reorder_every_ > 0) {
+            morton_.reserve(particles);
+            workspace_.reordered_values.resize(particles);
+            workspace_.reordered_bins.resize(particles);
+            workspace_.index_map.resize(particles);
+        }
+        if (capture_radius_ > 0.0) {
+            capture_hash_.reserve(particles);
+            workspace_.index_map.resize(particles);
+            workspace_.absorbed_by.resize(particles);
+        }
+        tree_.reserve(particles);
+        cell_list_.reserve(particles);
+        invalidate_derived_state();
     }
 
-    std::chrono::milliseconds calculation_time_average_() {
-        std::chrono::milliseconds sum_of_clocked_times {};
+    void reset_particle_ids(const size_t particles) {
+        particle_ids_.resize(particles);
+        particle_indices_.resize(particles);
+        std::iota(particle_ids_.begin(), particle_ids_.end(), size_t { 0 });
+        std::iota(particle_indices_.begin(), particle_indices_.end(), size_t { 0 });
+        particles_reordered_ = false;
+        indices_by_id_.reserve(particles);
+    }
 
-        for (auto time : last_n_clocked_times_) {
-            sum_of_clocked_times += time;
+    // Points the IDs at the new storage indices once particle_ids_ has been moved along with the particles,
+    // the particle at old index i being at index_map[i] now
+    void remap_particle_indices(const std::vector<size_t>& index_map) {
+        for (auto& index : particle_indices_) {
+            index = index_map[index];
         }
 
-        const auto average_over_last_n_times_in_ms_ =
-            double(sum_of_clocked_times.count()) / double(last_n_clocked_times_.size());
+        indices_by_id_.clear();
+        for (size_t id { 0 }; id < particle_indices_.size(); ++id) {
+            if (particle_ids_[particle_indices_[id]] == id) { indices_by_id_.push_back(particle_indices_[id]); }
+        }
+        particles_reordered_ = true;
+    }
 
-        return std::chrono::milliseconds(size_t(average_over_last_n_times_in_ms_));
+    // values[p] = values[order[p]] for every storage index p, through scratch
+    template <typename T>
+    void permute(std::span<T> values, std::vector<T>& scratch, const std::vector<size_t>& order) {
+        scratch.resize(values.size());
+        thread_pool_.parallel_for(values.size(), [&](const size_t begin, const size_t end, size_t) {
+            for (size_t p { begin }; p < end; ++p) {
+                scratch[p] = values[order[p]];
+            }
+        });
+        thread_pool_.parallel_for(values.size(), [&](const size_t begin, const size_t end, size_t) {
+            std::copy(scratch.data() + begin, scratch.data() + end, values.data() + begin);
+        });
     }
 
-    void set_x_coordinates_from_doubles(const std::vector<double>& raw_x_coordniates) {
-        x_coordinates_.clear();
-        for (const auto x_raw : raw_x_coordniates) {
-            x_coordinates_.emplace_back(si::length<coordinate_unit>(x_raw));
+    // Counts steps towards the next reordering and reorders when it is due
+    void reorder_when_due(const size_t steps) {
+        if (reorder_every_ == 0) { return; }
+        steps_since_reorder_ += steps;
+        if (steps_since_reorder_ >= reorder_every_) { reorder_by_morton_key(); }
+    }
+
+    static constexpr size_t no_particle_ = static_cast<size_t>(-1);
+
+    // Keeps the entries of the particles that were not absorbed, in order, where index_map sends them
+    template <typename T>
+    void compact(std::span<T> values) const {
+        const auto& absorbed_by = workspace_.absorbed_by;
+        for (size_t i { 0 }; i < values.size(); ++i) {
+            if (absorbed_by[i] == no_particle_) { values[workspace_.index_map[i]] = values[i]; }
         }
     }
 
-    void set_y_coordinates_from_doubles(const std::vector<double>& raw_y_coordniates) {
-        y_coordinates_.clear();
-        for (const auto y_raw : raw_y_coordniates) {
-            y_coordinates_.emplace_back(si::length<coordinate_unit>(y_raw));
+    /*
+    Merges the pairs closer than capture_radius_ into single bodies at their center of mass, with their
+    summed mass and momentum. The pairs are found with capture_hash_ in O(N). A body may absorb several
+    particles in one pass, but a particle that was absorbed takes no further part until the next one.
+    The survivors are then compacted in place, in their order, and the particle count shrinks.
+     */
+    void merge_captured_pairs() {
+        if (capture_radius_ <= 0.0) { return; }
+        assert(consistent_sizes());
+        const auto timer = metrics_.time(phase::merge);
+        const auto particles = masses_.size();
+        auto& absorbed_by = workspace_.absorbed_by;
+        absorbed_by.assign(particles, no_particle_);
+
+        const auto r = raw_spans(coordinates_);
+        const auto v = raw_spans(speeds_);
+        const auto m = raw_span(masses_);
+        size_t mergers { 0 };
+        capture_hash_.build(raw_spans(std::as_const(coordinates_)), capture_radius_);
+        capture_hash_.for_each_pair_within(capture_radius_, [&](const size_t i, const size_t j) {
+            if (absorbed_by[i] != no_particle_ || absorbed_by[j] != no_particle_) { return; }
+            absorbed_by[j] = i;
+            const auto mass = m[i] + m[j];
+            for_each_axis<dimensions>([&](const size_t axis) {
+                r[axis][i] = (m[i] * r[axis][i] + m[j] * r[axis][j]) / mass;
+                v[axis][i] = (m[i] * v[axis][i] + m[j] * v[axis][j]) / mass;
+            });
+            m[i] = mass;
+            ++mergers;
+        });
+        if (mergers == 0) { return; }
+        metrics_.add(counter::mergers, mergers);
+
+        // Bodies only absorb particles of higher index, so the body of an absorbed particle, or the body
+        // that in turn absorbed it, has its new index by the time the particle is reached
+        auto& index_map = workspace_.index_map;
+        index_map.resize(particles);
+        size_t survivors { 0 };
+        for (size_t i { 0 }; i < particles; ++i) {
+            index_map[i] = absorbed_by[i] == no_particle_ ? survivors++ : index_map[absorbed_by[i]];
         }
+
+        for_each_axis<dimensions>([&](const size_t axis) {
+            compact(raw_span(coordinates_[axis]));
+            compact(raw_span(speeds_[axis]));
+            coordinates_[axis].resize(survivors);
+            speeds_[axis].resize(survivors);
+        });
+        compact(raw_span(masses_));
+        masses_.resize(survivors);
+        compact(std::span(particle_ids_));
+        particle_ids_.resize(survivors);
+        remap_particle_indices(index_map);
+        resize_workspace(survivors);
     }
 
-    void set_x_speeds_from_doubles(const std::vector<double>& raw_x_speeds) {
-        x_speeds_.clear();
-        for (const auto v_x_raw : raw_x_speeds) {
-            x_speeds_.emplace_back(si::speed<speed_unit>(v_x_raw));
+    // Forgets the accelerations and block timestep state that belong to the previous particle state
+    void invalidate_derived_state() {
+        stored_accelerations_valid_ = false;
+        block_state_valid_ = false;
+    }
+
+    bool consistent_sizes() const {
+        const auto particles = masses_.size();
+        return std::ranges::all_of(coordinates_, [&](const auto& axis) { return axis.size() == particles; }) &&
+               std::ranges::all_of(speeds_, [&](const auto& axis) { return axis.size() == particles; });
+    }
+
+    // v += kick * a * dt and then x += drift * v * dt for every particle,
+    // using the accelerations stored in the workspace
+    void kick_and_drift_with_stored_accelerations(const double kick, const double drift) {
+        const auto particles = masses_.size();
+
+        for (size_t i { 0 }; i < particles; ++i) {
+            for_each_axis<dimensions>([&](const size_t axis) {
+                // New velocity
+                if (kick != 0.0) { speeds_[axis][i] += kick * workspace_.accelerations[axis][i] * timestep_; }
+
+                // New position from new velocity
+                coordinates_[axis][i] += drift * speeds_[axis][i] * timestep_;
+            });
         }
     }
 
-    void set_y_speeds_from_doubles(const std::vector<double>& raw_y_speeds) {
-        y_speeds_.clear();
-        for (const auto v_y_raw : raw_y_speeds) {
-            y_speeds_.emplace_back(si::speed<speed_unit>(v_y_raw));
+    // Raw factors of the update v += kick * a and x += drift * v,
+    // where a is the acceleration without G as returned by the raw kernels
+    double kick_factor() const { return G_raw_ * acceleration_kick_factor(); }
+    // Same for a in acceleration_unit, as stored in workspace_.accelerations
+    double acceleration_kick_factor() const {
+        return si::speed<speed_unit>(si::acceleration<acceleration_unit> { 1.0 } * timestep_).number();
+    }
+    double drift_factor() const {
+        return si::length<coordinate_unit>(si::speed<speed_unit> { 1.0 } * timestep_).number();
+    }
+
+    // force_real copies of the coordinates, relative to particle 0 so that force_real resolves
+    // their differences, and of the masses of particles [begin, end)
+    void convert_force_inputs(const size_t begin, const size_t end) {
+        if (begin == end) { return; }
+        for_each_axis<dimensions>([&](const size_t axis) {
+            const auto r = raw_span(coordinates_[axis]);
+            const auto origin = r[0];
+            for (size_t i { begin }; i < end; ++i) {
+                workspace_.force_coordinates[axis][i] = static_cast<force_real>(r[i] - origin);
+            }
+        });
+        const auto m = raw_span(masses_);
+        for (size_t i { begin }; i < end; ++i) {
+            workspace_.force_masses[i] = static_cast<force_real>(m[i]);
         }
     }
 
-    void set_masses_from_doubles(const std::vector<double>& raw_mass) {
-        masses_.clear();
-        for (const auto mass_raw : raw_mass) {
-            masses_.emplace_back(si::mass<mass_unit>(mass_raw));
+    /*
+    Direct sum keeping the i < j symmetry, using the SIMD pair kernel.
+    The triangle of block pairs is cut into square tiles which threads take one at a time
+    from a shared counter, so the uneven rows of the triangle do not unbalance the threads.
+    Each thread accumulates into its own buffers, which are summed in reduce_kick_and_drift.
+    With a float force_real the inputs must have been converted first.
+     */
+    void accumulate_tiles(const size_t t, std::atomic<size_t>& next_tile) {
+        const auto particles = masses_.size();
+
+        kernels::const_axes<dimensions> r;
+        std::array<const force_real*, dimensions> force_r;
+        kernels::axes<dimensions> a;
+        assert(workspace_.thread_accelerations.size() >= dimensions * (t + 1) * particles);
+        for_each_axis<dimensions>([&](const size_t axis) {
+            r[axis] = raw_span(coordinates_[axis]).data();
+            force_r[axis] = workspace_.force_coordinates[axis].data();
+            a[axis] = workspace_.thread_accelerations.data() + (dimensions * t + axis) * particles;
+            std::fill(a[axis], a[axis] + particles, 0.0);
+        });
+        const auto m = raw_span(masses_).data();
+        const auto force_m = workspace_.force_masses.data();
+
+        const auto blocks = (particles + tile_size_ - 1) / tile_size_;
+        const auto tiles = blocks * (blocks + 1) / 2;
+        double potential { 0.0 };
+
+        for (auto tile = next_tile++; tile < tiles; tile = next_tile++) {
+            // Tiles are numbered column by column: (0,0), (0,1), (1,1), (0,2), ...
+            auto J = static_cast<size_t>((std::sqrt(8.0 * double(tile) + 1.0) - 1.0) / 2.0);
+            while (J * (J + 1) / 2 > tile) { --J; }
+            while ((J + 1) * (J + 2) / 2 <= tile) { ++J; }
+            const auto I = tile - J * (J + 1) / 2;
+
+            const auto i_begin = I * tile_size_;
+            const auto i_end = std::min(particles, (I + 1) * tile_size_);
+            const auto j_begin = J * tile_size_;
+            const auto j_end = std::min(particles, (J + 1) * tile_size_);
+            if constexpr (mixed_precision_) {
+                if (sum_potential_) {
+                    kernels::accumulate_tile_mixed<dimensions, force_real, true>(force_r, force_m, i_begin, i_end,
+                                                                                 j_begin, j_end, a, &potential);
+                } else {
+                    kernels::accumulate_tile_mixed<dimensions, force_real>(force_r, force_m, i_begin, i_end, j_begin,
+                                                                           j_end, a);
+                }
+            } else if (sum_potential_) {
+                kernels::accumulate_tile_simd<dimensions, true>(r, m, i_begin, i_end, j_begin, j_end, a, &potential);
+            } else {
+                kernels::accumulate_tile_simd<dimensions>(r, m, i_begin, i_end, j_begin, j_end, a);
+            }
+        }
+        workspace_.thread_potentials[t] = potential;
+    }
+
+    // Potential energy from the sums of accumulate_tiles of the first `threads` threads
+    double potential_from_tiles(const size_t threads) const {
+        double sum { 0.0 };
+        for (size_t t { 0 }; t < threads; ++t) {
+            sum += workspace_.thread_potentials[t];
+        }
+        // G m_i m_j / r is in mass_unit * acceleration_unit * coordinate_unit
+        const auto to_energy_unit = units_in_si_[4] * units_in_si_[0] / (units_in_si_[3] * units_in_si_[3]);
+        return -G_raw_ * sum * to_energy_unit;
+    }
+
+    // Sums the per-thread buffers of the first `threads` threads and does the scaling,
+    // kick and drift of particles [begin, end) in the same pass. See force_kick_drift.
+    void reduce_kick_and_drift(const size_t begin, const size_t end, const size_t threads, const double kick,
+                               const double drift, const bool store_accelerations) {
+        const auto particles = masses_.size();
+        const auto& thread_accelerations = workspace_.thread_accelerations;
+
+        const auto r = raw_spans(coordinates_);
+        const auto v = raw_spans(speeds_);
+        const auto kick_raw = kick * kick_factor();
+        const auto drift_raw = drift * drift_factor();
+
+        for (size_t i { begin }; i < end; ++i) {
+            for_each_axis<dimensions>([&](const size_t axis) {
+                double a { 0.0 };
+                for (size_t t { 0 }; t < threads; ++t) {
+                    a += thread_accelerations[(dimensions * t + axis) * particles + i];
+                }
+                if (store_accelerations) {
+                    workspace_.accelerations[axis][i] = si::acceleration<acceleration_unit> { G_raw_ * a };
+                }
+                v[axis][i] += kick_raw * a;
+                r[axis][i] += drift_raw * v[axis][i];
+            });
         }
     }
 
+    // Unit typed direct sum into workspace_.accelerations, the most basic implementation
+    void compute_accelerations_with_cpu_1() {
+        const auto particles = masses_.size();
+
+        auto& accelerations = workspace_.accelerations;
+        for (auto& axis_accelerations : accelerations) {
+            std::ranges::fill(axis_accelerations, si::acceleration<acceleration_unit> { 0.0 });
+        }
+        if (particles < 2) { return; }
+
+        for (size_t i { 0 }; i < particles - 1; ++i) {
+            for (size_t j { i + 1 }; j < particles; ++j) {
+                std::array<si::length<coordinate_unit>, dimensions> d;
+                for_each_axis<dimensions>(
+                    [&](const size_t axis) { d[axis] = coordinates_[axis][j] - coordinates_[axis][i]; });
+
+                auto d2 = d[0] * d[0];
+                for_each_axis<dimensions>([&](const size_t axis) {
+                    if (axis > 0) { d2 += d[axis] * d[axis]; }
+                });
+                // G units business feels little jank
+                // Units are restricting optimizations and even trying to do them
+                // (hoping that G_units_ * gets optimized away by compiler)
+                // we just go around the things that units were supposed to do.
+                const auto d3 = d2 * si::length<coordinate_unit> { std::sqrt(d2.number()) };
+                for_each_axis<dimensions>([&](const size_t axis) {
+                    accelerations[axis][i] += G_units_ * masses_[j] * d[axis] / d3;
+                    accelerations[axis][j] -= G_units_ * masses_[i] * d[axis] / d3;
+                });
+            }
+        }
+        for (auto& axis_accelerations : accelerations) {
+            for (auto& acceleration : axis_accelerations) {
+                acceleration *= G_dimensioless_;
+            }
+        }
+    }
+
+    /*
+    One integrator stage: accelerations at the current coordinates from the given engine,
+    followed by v += kick * a * dt and x += drift * v * dt in the same pass where the engine allows.
+    With store_accelerations the accelerations are also left in workspace_.accelerations.
+     */
+    void force_kick_drift(const engine used_engine, const double kick, const double drift,
+                          const bool store_accelerations) {
+        const auto particles = masses_.size();
+        metrics_.add(counter::force_evaluations);
+        // Only the direct sum engines sum it
+        if (sum_potential_) { potential_energy_ = std::numeric_limits<double>::quiet_NaN(); }
+
+        switch (used_engine) {
+        case engine::cpu_1: {
+            {
+                const auto timer = metrics_.time(phase::force);
+                compute_accelerations_with_cpu_1();
+            }
+            metrics_.add(counter::pair_interactions, direct_sum_pairs());
+            const auto timer = metrics_.time(phase::integration);
+            kick_and_drift_with_stored_accelerations(kick, drift);
+            break;
+        }
+        case engine::simd: {
+            {
+                const auto timer = metrics_.time(phase::force);
+                if constexpr (mixed_precision_) { convert_force_inputs(0, particles); }
+                std::atomic<size_t> next_tile { 0 };
+                accumulate_tiles(0, next_tile);
+                if (sum_potential_) { potential_energy_ = potential_from_tiles(1); }
+            }
+            metrics_.add(counter::pair_interactions, direct_sum_pairs());
+            const auto timer = metrics_.time(phase::integration);
+            reduce_kick_and_drift(0, particles, 1, kick, drift, store_accelerations);
+            break;
+        }
+        case engine::cpu_threads: {
+            const auto threads = thread_pool_.size();
+            {
+                const auto timer = metrics_.time(phase::force);
+                if constexpr (mixed_precision_) {
+                    thread_pool_.parallel_for(particles, [&](const size_t begin, const size_t end, size_t) {
+                        convert_force_inputs(begin, end);
+                    });
+                }
+                std::atomic<size_t> next_tile { 0 };
+                thread_pool_.run([&](const size_t t) { accumulate_tiles(t, next_tile); });
+                if (sum_potential_) { potential_energy_ = potential_from_tiles(threads); }
+            }
+            metrics_.add(counter::pair_interactions, direct_sum_pairs());
+            const auto timer = metrics_.time(phase::integration);
+            thread_pool_.parallel_for(particles, [&](const size_t begin, const size_t end, size_t) {
+                reduce_kick_and_drift(begin, end, threads, kick, drift, store_accelerations);
+            });
+            break;
+        }
+        case engine::barnes_hut: {
+            // The tree walk happens inside the kick and drift pass, so all of it counts as force
+            const auto timer = metrics_.time(phase::force);
+            tree_.build(raw_spans(std::as_const(coordinates_)), raw_span(masses_));
+            const auto interactions = kick_and_drift_in_order(
+                tree_.order(), kick, drift, store_accelerations, [&](const size_t p, size_t& chunk_interactions) {
+                    return tree_.acceleration_at(p, barnes_hut_theta_, chunk_interactions);
+                });
+            metrics_.add(counter::pair_interactions, interactions);
+            break;
+        }
+        case engine::fmm: {
+            {
+                const auto timer = metrics_.time(phase::force);
+                tree_.build(raw_spans(std::as_const(coordinates_)), raw_span(masses_));
+                fmm_.evaluate(tree_);
+            }
+            metrics_.add(counter::pair_interactions, fmm_.pair_interactions() + fmm_.cell_interactions());
+            const auto timer = metrics_.time(phase::integration);
+            kick_and_drift_in_order(tree_.order(), kick, drift, store_accelerations,
+                                    [&](const size_t p, size_t&) { return fmm_.acceleration_at(p); });
+            break;
+        }
+        case engine::short_range: {
+            {
+                const auto timer = metrics_.time(phase::force);
+                if (halo_masses_.empty()) {
+                    cell_list_.build(raw_spans(std::as_const(coordinates_)), raw_span(masses_));
+                } else {
+                    build_cell_list_with_halo();
+                }
+                cell_list_.evaluate(thread_pool_);
+            }
+            metrics_.add(counter::pair_interactions, cell_list_.pair_interactions());
+            const auto timer = metrics_.time(phase::integration);
+            kick_and_drift_in_order(cell_list_.order(), kick, drift, store_accelerations,
+                                    [&](const size_t p, size_t&) { return cell_list_.acceleration_at(p); });
+            break;
+        }
+        case engine::particle_mesh: {
+            {
+                const auto timer = metrics_.time(phase::force);
+                mesh_.evaluate(raw_spans(std::as_const(coordinates_)), raw_span(masses_), thread_pool_);
+            }
+
+            const auto timer = metrics_.time(phase::integration);
+            const auto r = raw_spans(coordinates_);
+            const auto v = raw_spans(speeds_);
+            const auto kick_raw = kick * kick_factor();
+            const auto drift_raw = drift * drift_factor();
+            thread_pool_.parallel_for(particles, [&](const size_t begin, const size_t end, size_t) {
+                for (size_t i { begin }; i < end; ++i) {
+                    const auto a = mesh_.acceleration_at(i);
+                    for_each_axis<dimensions>([&](const size_t axis) {
+                        if (store_accelerations) {
+                            workspace_.accelerations[axis][i] =
+                                si::acceleration<acceleration_unit> { G_raw_ * a[axis] };
+                        }
+                        v[axis][i] += kick_raw * a[axis];
+                        r[axis][i] += drift_raw * v[axis][i];
+                    });
+                }
+            });
+            break;
+        }
+        }
+    }
+
+    // Pairs of one direct sum force evaluation
+    std::uint64_t direct_sum_pairs() const {
+        const std::uint64_t particles = masses_.size();
+        return particles > 0 ? particles * (particles - 1) / 2 : 0;
+    }
+
+    // Appends the halo to a copy of the particles and builds the cell list over both
+    void build_cell_list_with_halo() {
+        const auto join = [](std::vector<double>& joined, std::span<const double> own, std::span<const double> halo) {
+            joined.resize(own.size() + halo.size());
+            std::ranges::copy(halo, std::ranges::copy(own, joined.begin()).out);
+        };
+        std::array<std::span<const double>, dimensions> coordinates;
+        for_each_axis<dimensions>([&](const size_t axis) {
+            join(workspace_.haloed_coordinates[axis], raw_span(coordinates_[axis]), halo_coordinates_[axis]);
+            coordinates[axis] = workspace_.haloed_coordinates[axis];
+        });
+        join(workspace_.haloed_masses, raw_span(masses_), halo_masses_);
+        cell_list_.build(coordinates, workspace_.haloed_masses);
+    }
+
+    /*
+    Trees and cell lists keep their own sorted copy of the coordinates, so particles are kicked and drifted
+    as soon as acceleration_at(sorted position, interactions) is known, which may add the pairs it took to
+    interactions; returns their sum. order maps sorted positions to particles, the positions of halo
+    particles, past the particles, are skipped. The sorted positions are split between the threads:
+    acceleration_at only reads the tree or cell list, and every position writes its own particle.
+     */
+    template <typename F>
+    size_t kick_and_drift_in_order(const std::vector<size_t>& order, const double kick, const double drift,
+                                   const bool store_accelerations, F&& acceleration_at) {
+        const auto r = raw_spans(coordinates_);
+        const auto v = raw_spans(speeds_);
+        const auto kick_raw = kick * kick_factor();
+        const auto drift_raw = drift * drift_factor();
+        const auto particles = masses_.size();
+        std::atomic<size_t> interactions { 0 };
+
+        thread_pool_.parallel_for(order.size(), [&](const size_t begin, const size_t end, size_t) {
+            size_t chunk_interactions { 0 };
+            for (size_t p { begin }; p < end; ++p) {
+                const auto i = order[p];
+                if (i >= particles) { continue; }
+                const auto a = acceleration_at(p, chunk_interactions);
+                for_each_axis<dimensions>([&](const size_t axis) {
+                    if (store_accelerations) {
+                        workspace_.accelerations[axis][i] =
+                            si::acceleration<acceleration_unit> { G_raw_ * a[axis] };
+                    }
+                    v[axis][i] += kick_raw * a[axis];
+                    r[axis][i] += drift_raw * v[axis][i];
+                });
+            }
+            interactions += chunk_interactions;
+        });
+        return interactions;
+    }
+
+    // Kick and drift done before the first force evaluation of an evolve call
+    struct opening_pass {
+        double kick;
+        double drift;
+    };
+
+    opening_pass opening_of_integrator() const {
+        switch (integrator_) {
+        case integrator::leapfrog: return { 0.5, 1.0 };
+        case integrator::yoshida4: return { 0.0, yoshida_c1_ };
+        case integrator::semi_implicit_euler: break;
+        }
+        return { 0.0, 0.0 };
+    }
+
+    // Yoshida 1990 coefficients for the drift-kick form of the fourth order integrator
+    static constexpr double yoshida_w1_ = 1.0 / (2.0 - 1.2599210498948732);
+    static constexpr double yoshida_w0_ = -1.2599210498948732 * yoshida_w1_;
+    static constexpr double yoshida_c1_ = yoshida_w1_ / 2.0;
+    static constexpr double yoshida_c2_ = (yoshida_w0_ + yoshida_w1_) / 2.0;
+
+    /*
+    Calls stage(kick, drift, store_accelerations) for every force evaluation of `steps` steps.
+    The drift of a stage is already merged with the next kick-free drift, e.g. the closing
+    half kick of a leapfrog step and the opening half kick of the next are one full kick.
+     */
+    template <typename F>
+    void for_each_stage(const size_t steps, F&& stage) const {
+        for (size_t step { 0 }; step < steps; ++step) {
+            const auto last = step + 1 == steps;
+            switch (integrator_) {
+            case integrator::semi_implicit_euler: stage(1.0, 1.0, false); break;
+            case integrator::leapfrog: stage(last ? 0.5 : 1.0, last ? 0.0 : 1.0, last); break;
+            case integrator::yoshida4:
+                stage(yoshida_w1_, yoshida_c2_, false);
+                stage(yoshida_w0_, yoshida_c2_, false);
+                stage(yoshida_w1_, yoshida_c1_ + (last ? 0.0 : yoshida_c1_), false);
+                break;
+            }
+        }
+    }
+
+    // Leapfrog opens with a kick from the accelerations of the current coordinates
+    void prepare_stored_accelerations(const engine used_engine) {
+        if (integrator_ == integrator::leapfrog && !stored_accelerations_valid_) {
+            force_kick_drift(used_engine, 0.0, 0.0, true);
+        }
+    }
+
+    // evolve_uninterrupted in runs that end where diagnostics, mergers or a Morton reordering are due
+    void evolve_steps(const engine used_engine, const size_t steps) {
+        if (reorder_every_ == 0 && capture_radius_ <= 0.0 && diagnostics_every_ == 0) {
+            evolve_uninterrupted(used_engine, steps);
+            return;
+        }
+        for (size_t done { 0 }; done < steps;) {
+            auto run = capture_radius_ > 0.0 ? size_t { 1 } : steps - done;
+            if (reorder_every_ > 0) { run = std::min(run, reorder_every_ - steps_since_reorder_); }
+            if (diagnostics_every_ > 0) { run = std::min(run, diagnostics_every_ - steps_since_diagnostics_); }
+
+            if (diagnostics_every_ > 0 && steps_since_diagnostics_ + run == diagnostics_every_) {
+                // Only the last step of the run sums the potential energy
+                evolve_uninterrupted(used_engine, run - 1);
+                sum_potential_ = true;
+                evolve_uninterrupted(used_engine, 1);
+                sum_potential_ = false;
+                take_diagnostics();
+            } else {
+                steps_since_diagnostics_ += diagnostics_every_ > 0 ? run : 0;
+                evolve_uninterrupted(used_engine, run);
+            }
+            merge_captured_pairs();
+            reorder_when_due(run);
+            done += run;
+        }
+    }
+
+    // Appends a diagnostics_report of the current speeds and the last summed potential energy
+    void take_diagnostics() {
+        steps_since_diagnostics_ = 0;
+        const auto v = raw_spans(std::as_const(speeds_));
+        const auto m = raw_span(masses_);
+        auto& sums = workspace_.thread_kinetics;
+        thread_pool_.run([&](const size_t t) {
+            const auto particles = masses_.size();
+            const auto threads = thread_pool_.size();
+            sums[t].fill(0.0);
+            for (size_t i { particles * t / threads }; i < particles * (t + 1) / threads; ++i) {
+                for_each_axis<dimensions>([&](const size_t axis) {
+                    const auto p = m[i] * v[axis][i];
+                    sums[t][0] += 0.5 * p * v[axis][i];
+                    sums[t][1 + axis] += p;
+                });
+            }
+        });
+
+        diagnostics_report<dimensions> report { simulation_time_.number(), 0.0, potential_energy_, {} };
+        for (const auto& sum : sums) {
+            report.kinetic_energy += sum[0];
+            for_each_axis<dimensions>([&](const size_t axis) { report.momentum[axis] += sum[1 + axis]; });
+        }
+        diagnostics_.push_back(report);
+    }
+
+    void evolve_uninterrupted(const engine used_engine, const size_t steps) {
+        assert(consistent_sizes());
+        if (steps == 0) { return; }
+
+        prepare_stored_accelerations(used_engine);
+        const auto opening = opening_of_integrator();
+        if (opening.kick != 0.0 || opening.drift != 0.0) {
+            const auto timer = metrics_.time(phase::integration);
+            kick_and_drift_with_stored_accelerations(opening.kick, opening.drift);
+        }
+
+        if (used_engine == engine::cpu_threads) {
+            evolve_n_steps_with_cpu_threads(steps);
+        } else {
+            for_each_stage(steps, [&](const double kick, const double drift, const bool store) {
+                force_kick_drift(used_engine, kick, drift, store);
+            });
+        }
+
+        stored_accelerations_valid_ = integrator_ == integrator::leapfrog;
+        block_state_valid_ = false;
+        simulation_time_ += double(steps) * timestep_;
+        metrics_.add(counter::steps, steps);
+    }
+
+    // Accelerations and jerks of the particles in workspace_.active_particles, from all particles
+    void compute_active_accelerations_and_jerks() {
+        const auto particles = masses_.size();
+        const auto& active = workspace_.active_particles;
+        const auto timer = metrics_.time(phase::force);
+        metrics_.add(counter::force_evaluations);
+        metrics_.add(counter::pair_interactions, active.size() * (particles - 1));
+
+        kernels::const_axes<dimensions> r;
+        kernels::const_axes<dimensions> v;
+        for_each_axis<dimensions>([&](const size_t axis) {
+            r[axis] = raw_span(coordinates_[axis]).data();
+            v[axis] = raw_span(speeds_[axis]).data();
+        });
+        const auto m = raw_span(masses_).data();
+        const auto a = raw_spans(workspace_.accelerations);
+
+        thread_pool_.parallel_for(active.size(), [&](const size_t begin, const size_t end, size_t) {
+            for (size_t k { begin }; k < end; ++k) {
+                const auto i = active[k];
+                std::array<double, dimensions> ai;
+                std::array<double, dimensions> jerk;
+                kernels::acceleration_and_jerk<dimensions>(r, v, m, particles, i, ai, jerk);
+                for_each_axis<dimensions>([&](const size_t axis) {
+                    a[axis][i] = G_raw_ * ai[axis];
+                    workspace_.jerks[axis][i] = G_raw_ * jerk[axis];
+                });
+            }
+        });
+    }
+
+    // Coarsest bin whose step timestep_ / 2^bin is within accuracy * |a| / |jerk| (Aarseth's criterion),
+    // capped at block_levels_
+    size_t desired_timestep_bin(const size_t i) const {
+        double a2 { 0.0 };
+        double jerk2 { 0.0 };
+        for_each_axis<dimensions>([&](const size_t axis) {
+            const auto a = workspace_.accelerations[axis][i].number();
+            a2 += a * a;
+            jerk2 += workspace_.jerks[axis][i] * workspace_.jerks[axis][i];
+        });
+        if (jerk2 == 0.0) { return 0; }
+
+        // |a| / |jerk| comes out in coordinate_unit / speed_unit
+        const auto time_raw = si::time<time_unit>(si::length<coordinate_unit> { 1.0 } / si::speed<speed_unit> { 1.0 });
+        const auto step = block_accuracy_ * std::sqrt(a2 / jerk2) * time_raw.number();
+        const auto ratio = timestep_.number() / step;
+        if (!(ratio > 1.0)) { return 0; }
+        return std::min(block_levels_, static_cast<size_t>(std::ceil(std::log2(ratio))));
+    }
+
+    // The stages of evolve_steps for cpu_threads: the workers stay inside one fork for all of the
+    // steps and only synchronize on a barrier between the force and update passes
+    void evolve_n_steps_with_cpu_threads(const size_t steps) {
+        const auto particles = masses_.size();
+        const auto threads = thread_pool_.size();
+
+        std::atomic<size_t> next_tile { 0 };
+        const auto sync = [&] { thread_pool_.arrive_and_wait([&] { next_tile.store(0); }); };
+
+        // Thread 0 times the passes, every thread has passed the barrier when it gets through
+        thread_pool_.run([&](const size_t t) {
+            for_each_stage(steps, [&](const double kick, const double drift, const bool store) {
+                const auto start = std::chrono::steady_clock::now();
+                if constexpr (mixed_precision_) {
+                    convert_force_inputs(particles * t / threads, particles * (t + 1) / threads);
+                    sync();
+                }
+                accumulate_tiles(t, next_tile);
+                sync();
+                // Read before the next barrier, past which the other threads write their sums of the next step
+                if (t == 0 && sum_potential_) { potential_energy_ = potential_from_tiles(threads); }
+                const auto forces_done = std::chrono::steady_clock::now();
+                reduce_kick_and_drift(particles * t / threads, particles * (t + 1) / threads, threads, kick, drift,
+                                      store);
+                sync();
+                if (t == 0) {
+                    metrics_.record(phase::force, forces_done - start);
+                    metrics_.record(phase::integration, std::chrono::steady_clock::now() - forces_done);
+                    metrics_.add(counter::force_evaluations);
+                    metrics_.add(counter::pair_interactions, direct_sum_pairs());
+                }
+            });
+        });
+    }
+
+  public:
+    /*
+    Phase timings and counters since construction or the last metrics().reset(), see StepMetrics.hpp.
+    Every force evaluation records a force and an integration sample, draw a render sample, and
+    checkpoints and trajectory frames an io sample. metrics().json() and metrics().prometheus() dump them.
+     */
+    StepMetrics& metrics() { return metrics_; }
+    const StepMetrics& metrics() const { return metrics_; }
+
+    /*
+    Bulk state access. The span setters copy straight into the storage, and the adopt_ calls take over
+    a caller's buffer by move without copying; such a buffer can be filled in place through raw_span().
+    The views expose the storage as raw numbers in the simulation units. Taking a mutable view forgets the
+    accelerations kept between evolve calls, so take it again after evolving rather than holding on to it.
+    The setters and adopt_ calls replace the particles, so the IDs of particle_ids() start over from the
+    storage indices even when the count stays the same.
+     */
+    size_t particles() const { return masses_.size(); }
+
+    // Resizes every array to `particles`, new particles are zero, to be filled through the mutable views
+    void set_particle_count(const size_t particles) {
+        for_each_axis<dimensions>([&](const size_t axis) {
+            coordinates_[axis].resize(particles);
+            speeds_[axis].resize(particles);
+        });
+        masses_.resize(particles);
+        resize_workspace(particles);
+        reset_particle_ids(particles);
+    }
+
+    void set_coordinates(const size_t axis, std::span<const double> raw_coordinates) {
+        assert(axis < dimensions);
+        coordinates_[axis].resize(raw_coordinates.size());
+        std::ranges::copy(raw_coordinates, raw_span(coordinates_[axis]).begin());
+        resize_workspace(raw_coordinates.size());
+        reset_particle_ids(raw_coordinates.size());
+    }
+
+    void set_speeds(const size_t axis, std::span<const double> raw_speeds) {
+        assert(axis < dimensions);
+        speeds_[axis].resize(raw_speeds.size());
+        std::ranges::copy(raw_speeds, raw_span(speeds_[axis]).begin());
+        resize_workspace(raw_speeds.size());
+        reset_particle_ids(raw_speeds.size());
+    }
+
+    void set_masses(std::span<const double> raw_masses) {
+        masses_.resize(raw_masses.size());
+        std::ranges::copy(raw_masses, raw_span(masses_).begin());
+        resize_workspace(raw_masses.size());
+        reset_particle_ids(raw_masses.size());
+    }
+
+    void adopt_coordinates(const size_t axis, std::vector<si::length<coordinate_unit>>&& coordinates) {
+        assert(axis < dimensions);
+        coordinates_[axis] = std::move(coordinates);
+        resize_workspace(coordinates_[axis].size());
+        reset_particle_ids(coordinates_[axis].size());
+    }
+
+    void adopt_speeds(const size_t axis, std::vector<si::speed<speed_unit>>&& speeds) {
+        assert(axis < dimensions);
+        speeds_[axis] = std::move(speeds);
+        resize_workspace(speeds_[axis].size());
+        reset_particle_ids(speeds_[axis].size());
+    }
+
+    void adopt_masses(std::vector<si::mass<mass_unit>>&& masses) {
+        masses_ = std::move(masses);
+        resize_workspace(masses_.size());
+        reset_particle_ids(masses_.size());
+    }
+
+    std::span<const double> coordinates_view(const size_t axis) const { return raw_span(coordinates_[axis]); }
+    std::span<const double> speeds_view(const size_t axis) const { return raw_span(speeds_[axis]); }
+    std::span<const double> masses_view() const { return raw_span(masses_); }
+
+    std::span<double> mutable_coordinates_view(const size_t axis) {
+        invalidate_derived_state();
+        return raw_span(coordinates_[axis]);
+    }
+    std::span<double> mutable_speeds_view(const size_t axis) {
+        invalidate_derived_state();
+        return raw_span(speeds_[axis]);
+    }
+    std::span<double> mutable_masses_view() {
+        invalidate_derived_state();
+        return raw_span(masses_);
+    }
+
+    void set_coordinates_from_doubles(const size_t axis, const std::vector<double>& raw_coordinates) {
+        set_coordinates(axis, raw_coordinates);
+    }
+
+    void set_speeds_from_doubles(const size_t axis, const std::vector<double>& raw_speeds) {
+        set_speeds(axis, raw_speeds);
+    }
+
+    void set_x_coordinates_from_doubles(const std::vector<double>& raw_x_coordniates) {
+        set_coordinates_from_doubles(0, raw_x_coordniates);
+    }
+
+    void set_y_coordinates_from_doubles(const std::vector<double>& raw_y_coordniates) {
+        set_coordinates_from_doubles(1, raw_y_coordniates);
+    }
+
+    void set_z_coordinates_from_doubles(const std::vector<double>& raw_z_coordniates)
+        requires(dimensions == 3)
+    {
+        set_coordinates_from_doubles(2, raw_z_coordniates);
+    }
+
+    void set_x_speeds_from_doubles(const std::vector<double>& raw_x_speeds) {
+        set_speeds_from_doubles(0, raw_x_speeds);
+    }
+
+    void set_y_speeds_from_doubles(const std::vector<double>& raw_y_speeds) {
+        set_speeds_from_doubles(1, raw_y_speeds);
+    }
+
+    void set_z_speeds_from_doubles(const std::vector<double>& raw_z_speeds)
+        requires(dimensions == 3)
+    {
+        set_speeds_from_doubles(2, raw_z_speeds);
+    }
+
+    void set_masses_from_doubles(const std::vector<double>& raw_mass) { set_masses(raw_mass); }
+
     void set_timestep_from_double(const double timestep) { timestep_ = si::time<time_unit> { timestep }; }
 
+    // Size in SI of the simulation's units, for the headers of checkpoints and trajectories
+    static constexpr const std::array<double, 5>& units_in_si() { return units_in_si_; }
+
+    // Versioned binary snapshot of the particles, timestep_ and simulation_time_, see Checkpoint.hpp
+    bool save_checkpoint(const std::string& path) const {
+        assert(consistent_sizes());
+        const auto timer = metrics_.time(phase::io);
+        CheckpointHeader header {};
+        header.magic = CheckpointHeader::expected_magic;
+        header.version = CheckpointHeader::current_version;
+        header.dimensions = dimensions;
+        header.particles = masses_.size();
+        header.units_in_si = units_in_si_;
+        header.timestep = timestep_.number();
+        header.simulation_time = simulation_time_.number();
+
+        std::array<std::span<const double>, 2 * dimensions + 1> columns;
+        for_each_axis<dimensions>([&](const size_t axis) {
+            columns[axis] = raw_span(coordinates_[axis]);
+            columns[dimensions + axis] = raw_span(speeds_[axis]);
+        });
+        columns[2 * dimensions] = raw_span(masses_);
+        return write_checkpoint(path, header, columns);
+    }
+
+    /*
+    Restores a save_checkpoint file through a memory mapping, the columns are copied straight into the
+    particle storage. Checkpoints written in other units are scaled on the way. Returns false and leaves
+    the simulation as it was when the file is missing, of another version or dimension count, of another size
+    than its particle count calls for, or has unit sizes that are not finite and positive.
+     */
+    bool load_checkpoint(const std::string& path) {
+        const auto timer = metrics_.time(phase::io);
+        const MappedFile file(path);
+        const auto bytes = file.bytes();
+        if (bytes.size() < sizeof(CheckpointHeader)) { return false; }
+
+        CheckpointHeader header;
+        std::memcpy(&header, bytes.data(), sizeof(header));
+        if (header.magic != CheckpointHeader::expected_magic || header.version != CheckpointHeader::current_version ||
+            header.dimensions != dimensions || !header.fits(bytes.size()) || !header.valid_units()) {
+            return false;
+        }
+
+        const auto particles = static_cast<size_t>(header.particles);
+        const auto column_bytes = particles * sizeof(double);
+        const auto column = [&](const size_t index) { return bytes.data() + sizeof(header) + index * column_bytes; };
+
+        // Copies a column, scaled by the ratio of the units when they differ
+        const auto restore = [&](auto& quantities, const size_t index, const size_t unit) {
+            quantities.resize(particles);
+            const auto raw = raw_span(quantities);
+            if (particles == 0) { return; }
+            std::memcpy(raw.data(), column(index), column_bytes);
+            const auto scale = header.units_in_si[unit] / units_in_si_[unit];
+            if (scale != 1.0) {
+                for (auto& value : raw) {
+                    value *= scale;
+                }
+            }
+        };
+        for_each_axis<dimensions>([&](const size_t axis) {
+            restore(coordinates_[axis], axis, 0);
+            restore(speeds_[axis], dimensions + axis, 3);
+        });
+        restore(masses_, 2 * dimensions, 1);
+
+        const auto time_scale = header.units_in_si[2] / units_in_si_[2];
+        timestep_ = si::time<time_unit> { header.timestep * time_scale };
+        simulation_time_ = si::time<time_unit> { header.simulation_time * time_scale };
+
+        resize_workspace(particles);
+        reset_particle_ids(particles);
+        return true;
+    }
+
+    // Number of threads used by the parallel engines, the calling thread included
+    void set_threads(const size_t threads) {
+        thread_pool_.resize(threads);
+        resize_workspace(masses_.size());
+    }
+    size_t threads() const { return thread_pool_.size(); }
+
     void print_info_of_particle(size_t i) {
         std::cout << "i: " << i << "\nmass: " << masses_[i] << "\n";
-        std::cout << "x: " << x_coordinates_[i] << " " << x_speeds_[i] << "\n";
-        std::cout << "y: " << y_coordinates_[i] << " " << y_speeds_[i] << "\n";
+        for (size_t axis { 0 }; axis < dimensions; ++axis) {
+            std::cout << axis_names_[axis] << ": " << coordinates_[axis][i] << " " << speeds_[axis][i] << "\n";
+        }
     }
 
+    // Draws the projection to the x-y plane through renderer_, which only writes what changed since the last draw
     void draw(si::length<coordinate_unit> x_min = si::length<coordinate_unit>(si::length<coordinate_unit> { -10.0 }),
               si::length<coordinate_unit> x_max = si::length<coordinate_unit>(si::length<coordinate_unit> { 10.0 }),
               si::length<coordinate_unit> y_min = si::length<coordinate_unit>(si::length<coordinate_unit> { -10.0 }),
               si::length<coordinate_unit> y_max = si::length<coordinate_unit>(si::length<coordinate_unit> { 10.0 })) {
-        // height / width
-        constexpr auto aspect_ratio = 2.0;
+        const auto timer = metrics_.time(phase::render);
+        renderer_.plot(raw_span(coordinates_[0]), raw_span(coordinates_[1]),
+                       { x_min.number(), x_max.number(), y_min.number(), y_max.number() }, render_style_, thread_pool_);
 
-        const auto width = x_max - x_min;
-        const auto height = y_max - y_min;
+        // Short enough for the 40 columns of the default view
+        const auto& force = metrics_.histogram(phase::force);
+        std::array<char, 128> status;
+        const auto written = fmt::format_to_n(status.data(), status.size(), "n: {}, force p50/p99: {:.2f}/{:.2f}ms",
+                                              masses_.size(), double(force.percentile_ns(0.5)) * 1e-6,
+                                              double(force.percentile_ns(0.99)) * 1e-6);
+        renderer_.set_status({ status.data(), std::min(written.size, status.size()) });
 
-        const auto width_in_pixels = aspect_ratio * width.number();
-        const auto height_in_pixels = height.number();
+        renderer_.present();
+    }
 
-        auto frame = std::vector<std::string>(width_in_pixels * height_in_pixels, " ");
+    // Style of draw(), the density style bins the particles with the threads of set_threads
+    void set_render_style(const render_style style) { render_style_ = style; }
 
-        const auto particles = x_coordinates_.size();
-        for (size_t i { 0 }; i < particles; ++i) {
-            const auto x_screen_pos = (x_coordinates_[i] - x_min) / width;
-            const auto y_screen_pos = (y_coordinates_[i] - y_min) / height;
-            if (x_screen_pos.number() > 0 && x_screen_pos.number() < 1 && y_screen_pos.number() > 0 &&
-                y_screen_pos.number() < 1) {
-                const auto x_index = int(width_in_pixels * x_screen_pos.number());
-                const auto y_index = int(height_in_pixels * y_screen_pos.number());
+    // Hands the x-y projection to a render thread, which draws it whenever its next frame is due
+    void publish_snapshot(RenderThread& render_thread) const {
+        auto& snapshot = render_thread.snapshot();
+        snapshot.x.assign(raw_span(coordinates_[0]).begin(), raw_span(coordinates_[0]).end());
+        snapshot.y.assign(raw_span(coordinates_[1]).begin(), raw_span(coordinates_[1]).end());
+        snapshot.simulation_time = simulation_time_.number();
+        render_thread.publish();
+    }
 
-                frame[x_index + width_in_pixels * y_index] = "X";
-            }
+    // The most basic implementation
+    void evolve_with_cpu_1() { evolve_steps(engine::cpu_1, 1); }
+
+    /*
+    Barnes-Hut approximation over a quadtree (octree in 3D) rebuilt every force evaluation.
+    Cells seen under an angle (width / distance) smaller than theta are replaced
+    by their center of mass. theta = 0 opens every cell and reproduces evolve_with_cpu_1.
+     */
+    void evolve_with_barnes_hut(const double theta = 0.5) {
+        barnes_hut_theta_ = theta;
+        evolve_steps(engine::barnes_hut, 1);
+    }
+
+    // Fast multipole method, see FastMultipole.hpp and set_fmm
+    void evolve_with_fmm() { evolve_steps(engine::fmm, 1); }
+
+    // Expansion order and opening angle of the fmm engine. The error falls off as theta^(order + 1).
+    void set_fmm(const size_t order, const double theta = 0.5) {
+        fmm_.set_order(order);
+        fmm_.set_theta(theta);
+    }
+
+    /*
+    Pairs closer than cutoff only, with optional softening, from a cell list. O(N) for softened or
+    locally dominated systems, and the short range half of a particle-particle / particle-mesh split.
+     */
+    void evolve_with_short_range() { evolve_steps(engine::short_range, 1); }
+
+    // Cutoff radius and softening of the short_range engine, both in coordinate units
+    void set_short_range(const double cutoff, const softening kind = softening::none, const double epsilon = 0.0) {
+        cell_list_.set_cutoff(cutoff);
+        cell_list_.set_softening(kind, epsilon);
+    }
+    double short_range_cutoff() const { return cell_list_.cutoff(); }
+
+    /*
+    Particles of neighbouring domains, see DomainDecomposition.hpp, as raw coordinates and masses. They pull on
+    the particles in the short_range engine but are not stepped themselves, and stay until the next set_halo.
+     */
+    void set_halo(const std::array<std::span<const double>, dimensions>& coordinates, std::span<const double> masses) {
+        for_each_axis<dimensions>([&](const size_t axis) {
+            assert(coordinates[axis].size() == masses.size());
+            halo_coordinates_[axis].assign(coordinates[axis].begin(), coordinates[axis].end());
+        });
+        halo_masses_.assign(masses.begin(), masses.end());
+    }
+
+    void clear_halo() {
+        for (auto& coordinates : halo_coordinates_) {
+            coordinates.clear();
         }
+        halo_masses_.clear();
+    }
 
-        for (size_t i { 0 }; i < height_in_pixels; ++i) {
-            for (size_t j { 0 }; j < width_in_pixels; ++j) {
-                fmt::print(frame[j + i * width_in_pixels]);
-            }
-            fmt::print("\n");
+    // Particle-mesh gravity for smooth distributions, see ParticleMesh.hpp and set_particle_mesh
+    void evolve_with_particle_mesh() { evolve_steps(engine::particle_mesh, 1); }
+
+    // Cells per axis (a power of two, at least 16) and the mass assignment scheme of the particle_mesh engine
+    void set_particle_mesh(const size_t cells, const mesh_assignment assignment = mesh_assignment::cic) {
+        mesh_.set_grid(cells);
+        mesh_.set_assignment(assignment);
+    }
+
+    struct accuracy_report {
+        // Of |a - a_direct| / |a_direct| over the particles
+        double rms_relative_error;
+        double max_relative_error;
+    };
+
+  private:
+    // accuracy_report of acceleration_of(i) against reference[axis][i]
+    template <typename F>
+    accuracy_report relative_errors(const kernels::axes<dimensions>& reference, F&& acceleration_of) const {
+        const auto particles = masses_.size();
+        accuracy_report report { 0.0, 0.0 };
+        for (size_t i { 0 }; i < particles; ++i) {
+            const auto a = acceleration_of(i);
+            double error2 { 0.0 };
+            double norm2 { 0.0 };
+            for_each_axis<dimensions>([&](const size_t axis) {
+                const auto error = a[axis] - reference[axis][i];
+                error2 += error * error;
+                norm2 += reference[axis][i] * reference[axis][i];
+            });
+            const auto relative2 = norm2 > 0.0 ? error2 / norm2 : 0.0;
+            report.rms_relative_error += relative2;
+            report.max_relative_error = std::max(report.max_relative_error, std::sqrt(relative2));
         }
+        report.rms_relative_error = particles > 0 ? std::sqrt(report.rms_relative_error / double(particles)) : 0.0;
+        return report;
+    }
+
+  public:
+
+    /*
+    Accelerations of the fmm engine at the current coordinates compared with direct summation.
+    O(N^2) and does not move the particles, meant for picking order and theta for a run.
+     */
+    accuracy_report fmm_error_against_direct_sum() {
+        assert(consistent_sizes());
+        const auto particles = masses_.size();
 
-        fmt::print("{}\r", ansi::str(ansi::clrline()));
+        tree_.build(raw_spans(std::as_const(coordinates_)), raw_span(masses_));
+        fmm_.evaluate(tree_);
 
-        // Formatting ms is native in c++20 but gcc does not support std::format yet ;(
-        fmt::print("n: {}, T: {}ms", particles, calculation_time_average_().count());
+        kernels::const_axes<dimensions> r;
+        kernels::axes<dimensions> direct;
+        for_each_axis<dimensions>([&](const size_t axis) {
+            r[axis] = raw_span(coordinates_[axis]).data();
+            direct[axis] = workspace_.thread_accelerations.data() + axis * particles;
+            std::fill(direct[axis], direct[axis] + particles, 0.0);
+        });
+        kernels::accumulate_tile_simd<dimensions>(r, raw_span(masses_).data(), 0, particles, 0, particles, direct);
 
-        fmt::print("{}{}", ansi::str(ansi::cursorhoriz(0)),  ansi::str(ansi::cursorup(height_in_pixels)));
+        const auto& order = tree_.order();
+        std::vector<size_t> position_of(particles);
+        for (size_t p { 0 }; p < particles; ++p) {
+            position_of[order[p]] = p;
+        }
+        return relative_errors(direct, [&](const size_t i) { return fmm_.acceleration_at(position_of[i]); });
     }
 
-    // The most basic implementation
-    void evolve_with_cpu_1() {
-        /*
-                std::cout << x_coordinates_.size() << "  " << y_coordinates_.size() << "  " << x_speeds_.size() << "  "
-                          << y_speeds_.size() << "  " << masses_.size() << "\n";
-         */
-        assert(x_coordinates_.size() == y_coordinates_.size() && x_coordinates_.size() == x_speeds_.size() &&
-               x_coordinates_.size() == y_speeds_.size() && x_coordinates_.size() == masses_.size());
+    /*
+    Accelerations of the direct sum engines in force_real at the current coordinates compared with
+    an all double direct sum, zero errors when force_real is double. O(N^2) and does not move the particles.
+     */
+    accuracy_report precision_error_against_double() {
+        assert(consistent_sizes());
+        const auto particles = masses_.size();
 
-        const auto particles = x_coordinates_.size();
+        // A diagnostic, so it is fine to allocate the two sets of accelerations here
+        std::vector<double> accelerations(2 * dimensions * particles, 0.0);
+        kernels::const_axes<dimensions> r;
+        std::array<const force_real*, dimensions> force_r;
+        kernels::axes<dimensions> direct;
+        kernels::axes<dimensions> mixed;
+        for_each_axis<dimensions>([&](const size_t axis) {
+            r[axis] = raw_span(coordinates_[axis]).data();
+            force_r[axis] = workspace_.force_coordinates[axis].data();
+            direct[axis] = accelerations.data() + axis * particles;
+            mixed[axis] = accelerations.data() + (dimensions + axis) * particles;
+        });
+        kernels::accumulate_tile_simd<dimensions>(r, raw_span(masses_).data(), 0, particles, 0, particles, direct);
+        if constexpr (mixed_precision_) {
+            convert_force_inputs(0, particles);
+            kernels::accumulate_tile_mixed<dimensions, force_real>(force_r, workspace_.force_masses.data(), 0,
+                                                                   particles, 0, particles, mixed);
+        } else {
+            mixed = direct;
+        }
 
-        auto x_accelerations =
-            std::vector<si::acceleration<acceleration_unit>>(particles, si::acceleration<acceleration_unit> { 0.0 });
-        auto y_accelerations =
-            std::vector<si::acceleration<acceleration_unit>>(particles, si::acceleration<acceleration_unit> { 0.0 });
+        return relative_errors(direct, [&](const size_t i) {
+            std::array<double, dimensions> a;
+            for_each_axis<dimensions>([&](const size_t axis) { a[axis] = mixed[axis][i]; });
+            return a;
+        });
+    }
 
-        for (size_t i { 0 }; i < particles - 1; ++i) {
-            for (size_t j { i + 1 }; j < particles; ++j) {
-                const Length auto d_x = x_coordinates_[j] - x_coordinates_[i];
-                const Length auto d_y = y_coordinates_[j] - y_coordinates_[i];
-                const auto d2 = d_x * d_x + d_y * d_y;
-                // G units business feels little jank
-                // Units are restricting optimizations and even trying to do them
-                // (hoping that G_units_ * gets optimized away by compiler)
-                // we just go around the things that units were supposed to do.
+    // Single threaded direct sum with the explicitly vectorized pair kernel
+    void evolve_with_simd() { evolve_steps(engine::simd, 1); }
 
-                // This is also evading the purpose of units library
-                if (true || d2.number() > 0.2) {
+    // Multithreaded direct sum, see accumulate_tiles
+    void evolve_with_cpu_threads() { evolve_steps(engine::cpu_threads, 1); }
 
-                    const auto d_x_hat = sign(d_x.number());
-                    const auto d_y_hat = sign(d_y.number());
-                    x_accelerations[i] += d_x_hat * G_units_ * masses_[j] / d2;
-                    y_accelerations[i] += d_y_hat * G_units_ * masses_[i] / d2;
-                    x_accelerations[j] -= d_x_hat * G_units_ * masses_[j] / d2;
-                    y_accelerations[j] -= d_y_hat * G_units_ * masses_[i] / d2;
-                }
+    /*
+    Advances timestep_ per step with hierarchical block timesteps. Particle i takes steps of
+    timestep_ / 2^bin with its own kick-drift-kick leapfrog, the bin chosen from its acceleration and jerk.
+    All particles are drifted together on the finest sub-step, but forces are only recomputed for the
+    particles whose own step ends there, so quiet particles cost one force evaluation per timestep_.
+    A particle may move to a coarser bin only where the coarser steps line up. Forces are a threaded
+    direct sum regardless of set_engine.
+     */
+    void evolve_with_block_timesteps(const size_t steps = 1) {
+        assert(consistent_sizes());
+        if (steps == 0) { return; }
+        if (capture_radius_ > 0.0 && steps > 1) {
+            for (size_t step { 0 }; step < steps; ++step) {
+                evolve_with_block_timesteps(1);
             }
+            return;
         }
-        for (size_t i { 0 }; i < particles; ++i) {
-            x_accelerations[i] *= G_dimensioless_;
-            y_accelerations[i] *= G_dimensioless_;
-        }
 
-        // New velocity                     // Feels jank
-        auto calculate_speed_deltas = [&](decltype(x_accelerations)& acceleration) {
-            std::vector<si::speed<speed_unit>> speed_deltas(particles);
+        const auto particles = masses_.size();
+        const auto substeps = size_t { 1 } << block_levels_;
+        auto& bins = workspace_.timestep_bins;
+        auto& active = workspace_.active_particles;
+
+        if (!block_state_valid_) {
+            active.resize(particles);
+            std::iota(active.begin(), active.end(), size_t { 0 });
+            compute_active_accelerations_and_jerks();
             for (size_t i { 0 }; i < particles; ++i) {
-                speed_deltas[i] = acceleration[i] * timestep_;
+                bins[i] = static_cast<std::uint8_t>(desired_timestep_bin(i));
             }
-            return speed_deltas;
+        }
+
+        const auto r = raw_spans(coordinates_);
+        const auto v = raw_spans(speeds_);
+        const auto a = raw_spans(std::as_const(workspace_.accelerations));
+        const auto drift_raw = drift_factor() / double(substeps);
+        const auto half_kick_raw = 0.5 * acceleration_kick_factor();
+
+        // Particles of bin k start and end their steps on the sub-steps that are multiples of substeps / 2^k
+        const auto half_kick = [&](const size_t i) {
+            const auto kick_raw = half_kick_raw / double(size_t { 1 } << bins[i]);
+            for_each_axis<dimensions>([&](const size_t axis) { v[axis][i] += kick_raw * a[axis][i]; });
         };
 
-        const auto x_speed_deltas = calculate_speed_deltas(x_accelerations);
-        const auto y_speed_deltas = calculate_speed_deltas(y_accelerations);
+        // Integration is timed per sub-step around the force evaluation
+        for (size_t step { 0 }; step < steps; ++step) {
+            for (size_t s { 0 }; s < substeps; ++s) {
+                const auto start = std::chrono::steady_clock::now();
+                for (size_t i { 0 }; i < particles; ++i) {
+                    if (s % (substeps >> bins[i]) == 0) { half_kick(i); }
+                }
 
-        for (size_t i { 0 }; i < particles; ++i) {
-            x_speeds_[i] += x_speed_deltas[i];
-            y_speeds_[i] += y_speed_deltas[i];
+                for_each_axis<dimensions>([&](const size_t axis) {
+                    for (size_t i { 0 }; i < particles; ++i) {
+                        r[axis][i] += drift_raw * v[axis][i];
+                    }
+                });
+
+                active.clear();
+                for (size_t i { 0 }; i < particles; ++i) {
+                    if ((s + 1) % (substeps >> bins[i]) == 0) { active.push_back(i); }
+                }
+                const auto forces_start = std::chrono::steady_clock::now();
+                compute_active_accelerations_and_jerks();
+                const auto forces_end = std::chrono::steady_clock::now();
+
+                for (const auto i : active) {
+                    half_kick(i);
+                    auto bin = desired_timestep_bin(i);
+                    while ((s + 1) % (substeps >> bin) != 0) {
+                        ++bin;
+                    }
+                    bins[i] = static_cast<std::uint8_t>(bin);
+                }
+                metrics_.record(phase::integration,
+                                (forces_start - start) + (std::chrono::steady_clock::now() - forces_end));
+            }
+        }
+
+        // Every particle ended its step on the last sub-step, so all accelerations are current
+        stored_accelerations_valid_ = true;
+        block_state_valid_ = true;
+        simulation_time_ += double(steps) * timestep_;
+        metrics_.add(counter::steps, steps);
+        if (diagnostics_every_ > 0 && (steps_since_diagnostics_ += steps) >= diagnostics_every_) {
+            potential_energy_ = std::numeric_limits<double>::quiet_NaN();
+            take_diagnostics();
+        }
+        merge_captured_pairs();
+        reorder_when_due(steps);
+    }
+
+    /*
+    Sorts the particles in storage by the Morton key of their coordinates, so that particles close in space
+    are close in memory and the trees, cell lists and mesh assignment walk them in cache order. Coordinates,
+    speeds and masses are permuted, as are the accelerations and block timestep state kept between evolve
+    calls, so the next step is the same as without the reordering. The storage indices change but the IDs
+    of particle_ids() do not. Runs on the threads of set_threads and is timed as the reorder phase.
+     */
+    void reorder_by_morton_key() {
+        assert(consistent_sizes());
+        const auto timer = metrics_.time(phase::reorder);
+        steps_since_reorder_ = 0;
+        const auto particles = masses_.size();
+        if (particles == 0) { return; }
+
+        morton_.sort(raw_spans(std::as_const(coordinates_)), thread_pool_);
+        const auto& order = morton_.order();
+        auto& scratch = workspace_.reordered_values;
+        for_each_axis<dimensions>([&](const size_t axis) {
+            permute(raw_span(coordinates_[axis]), scratch, order);
+            permute(raw_span(speeds_[axis]), scratch, order);
+            if (stored_accelerations_valid_ || block_state_valid_) {
+                permute(raw_span(workspace_.accelerations[axis]), scratch, order);
+            }
+            if (block_state_valid_) { permute(std::span(workspace_.jerks[axis]), scratch, order); }
+        });
+        permute(raw_span(masses_), scratch, order);
+        if (block_state_valid_) { permute(std::span(workspace_.timestep_bins), workspace_.reordered_bins, order); }
+
+        // The particle now at p was at order[p]
+        auto& index_map = workspace_.index_map;
+        permute(std::span(particle_ids_), index_map, order);
+        thread_pool_.parallel_for(particles, [&](const size_t begin, const size_t end, size_t) {
+            for (size_t p { begin }; p < end; ++p) {
+                index_map[order[p]] = p;
+            }
+        });
+        remap_particle_indices(index_map);
+    }
+
+    // Reorders by Morton key after every `every` steps of the evolve calls, 0 turns it off
+    void set_morton_reordering(const size_t every) {
+        reorder_every_ = every;
+        steps_since_reorder_ = 0;
+        resize_workspace(masses_.size());
+    }
+
+    /*
+    Merges every pair of particles closer than capture_radius, in coordinate units, into one body after
+    each step, conserving mass and momentum, 0 turns it off. Close encounters then no longer need tiny
+    timesteps, and the particle count shrinks, so later steps get cheaper. Bodies do not grow a radius,
+    the capture radius stays the same for all of them.
+     */
+    void set_mergers(const double capture_radius) {
+        capture_radius_ = capture_radius;
+        resize_workspace(masses_.size());
+    }
+
+    /*
+    Takes a diagnostics_report after every `every` steps of the evolve calls, 0 turns it off. The direct sum
+    engines (simd, cpu_threads) sum the potential energy in the force evaluation of that step, for about one
+    multiply-add more per pair, and the kinetic energy and momentum are an O(N) pass over the speeds.
+    evolve_with_block_timesteps reports after its calls, without the potential energy.
+     */
+    void set_diagnostics(const size_t every) {
+        diagnostics_every_ = every;
+        steps_since_diagnostics_ = 0;
+    }
+
+    // Reports since construction or the last clear_diagnostics, oldest first
+    std::span<const diagnostics_report<dimensions>> diagnostics() const { return diagnostics_; }
+    void clear_diagnostics() { diagnostics_.clear(); }
+
+    // Particle ID of every storage index, see reorder_by_morton_key and set_mergers
+    std::span<const size_t> particle_ids() const { return particle_ids_; }
+    // Storage index of a particle ID, where the views hold that particle now, or the body it merged into
+    size_t index_of_particle(const size_t id) const { return particle_indices_[id]; }
+
+    // Finest bin is timestep_ / 2^levels, accuracy is the factor of Aarseth's criterion
+    void set_block_timesteps(const size_t levels, const double accuracy = 0.02) {
+        assert(levels < 32);
+        block_levels_ = levels;
+        block_accuracy_ = accuracy;
+        block_state_valid_ = false;
+    }
+
+    // Timestep bin of every particle after the last evolve_with_block_timesteps
+    const std::vector<std::uint8_t>& timestep_bins() const { return workspace_.timestep_bins; }
+
+    void set_engine(const engine new_engine) { engine_ = new_engine; }
+    engine selected_engine() const { return engine_; }
+    void set_barnes_hut_theta(const double theta) { barnes_hut_theta_ = theta; }
+    integrator selected_integrator() const { return integrator_; }
+    void set_integrator(const integrator new_integrator) {
+        integrator_ = new_integrator;
+        stored_accelerations_valid_ = false;
+    }
+
+    /*
+    Runs steps back to back with the engine chosen by set_engine, meant for headless runs.
+    The engines do the scaling, kick and drift of a force evaluation in a single pass
+    (evolve_with_cpu_1 aside) and consecutive steps share their merged kicks and drifts.
+     */
+    void evolve_n_steps(const size_t steps) { evolve_steps(engine_, steps); }
+
+    // Hands the current coordinates, speeds, masses and IDs to writer, which only copies them before returning.
+    // The io sample is the time the stepping thread spends on that, waits for a free slot included.
+    void record_frame(TrajectoryWriter<dimensions>& writer) const {
+        const auto timer = metrics_.time(phase::io);
+        // Frames list the particles by ID, so they line up across reorderings
+        std::span<const size_t> order {};
+        if (particles_reordered_) { order = indices_by_id_; }
+        writer.write_frame(simulation_time_.number(), raw_spans(coordinates_), raw_spans(speeds_), raw_span(masses_),
+                           particle_ids_, order);
+        metrics_.add(counter::frames_recorded);
+    }
 
-            // New position from new velocity
-            x_coordinates_[i] += x_speeds_[i] * timestep_;
-            y_coordinates_[i] += y_speeds_[i] * timestep_;
+    // evolve_n_steps, recording a frame to writer after every `every` steps
+    void evolve_n_steps(const size_t steps, TrajectoryWriter<dimensions>& writer, const size_t every) {
+        assert(every > 0);
+        for (size_t done { 0 }; done < steps; done += every) {
+            evolve_steps(engine_, std::min(every, steps - done));
+            record_frame(writer);
         }
     }
 };
 
-} // namespace nps
\ No newline at end of file
+} // namespace nps
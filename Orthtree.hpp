@@ -0,0 +1,246 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <span>
+#include <vector>
+
+#include "Axes.hpp"
+
+namespace nps {
+
+/*
+Quadtree (2D) or octree (3D) over raw particle coordinates used for the Barnes-Hut approximation.
+
+Particles are reordered into tree order so that every node owns a contiguous
+range of them. Coordinates and masses are copied into that order on build,
+which keeps the traversal cache friendly. Storage is reused between builds.
+ */
+template <size_t dimensions>
+class Orthtree {
+  public:
+    static constexpr size_t children_per_node = size_t { 1 } << dimensions;
+
+    using point = std::array<double, dimensions>;
+
+    struct Node {
+        // Cell geometry
+        point center;
+        double half_width;
+        // Monopole of the particles inside the cell
+        double mass;
+        point center_of_mass;
+        // Range of particles in tree order
+        size_t begin, end;
+        // Index of the first of the consecutive children, 0 for leaves (root is never a child)
+        size_t first_child;
+    };
+
+  private:
+    static constexpr size_t max_depth_ = 48;
+
+    size_t leaf_capacity_;
+
+    std::vector<Node> nodes_ {};
+    // tree position -> particle index
+    std::vector<size_t> order_ {};
+    std::array<std::vector<double>, dimensions> coordinates_ {};
+    std::vector<double> masses_ {};
+
+    void subdivide(const size_t node_index, const size_t depth,
+                   const std::array<std::span<const double>, dimensions>& coordinates) {
+        const auto begin = nodes_[node_index].begin;
+        const auto end = nodes_[node_index].end;
+
+        if (end - begin <= leaf_capacity_ || depth == max_depth_) { return; }
+
+        const auto center = nodes_[node_index].center;
+        const auto quarter = nodes_[node_index].half_width / 2.0;
+
+        // Child q holds the particles whose coordinate on axis k is above the center when bit k of q is set.
+        // Splitting on the highest axis first leaves the ranges in the order of q.
+        std::array<size_t, children_per_node + 1> bounds {};
+        bounds[0] = begin;
+        bounds[1] = end;
+        size_t segments { 1 };
+        for (size_t axis { dimensions }; axis-- > 0;) {
+            for (size_t segment { segments }; segment-- > 0;) {
+                const auto first = order_.begin() + static_cast<std::ptrdiff_t>(bounds[segment]);
+                const auto last = order_.begin() + static_cast<std::ptrdiff_t>(bounds[segment + 1]);
+                const auto middle = std::partition(
+                    first, last, [&](const size_t i) { return coordinates[axis][i] < center[axis]; });
+                bounds[2 * segment + 2] = bounds[segment + 1];
+                bounds[2 * segment + 1] = static_cast<size_t>(middle - order_.begin());
+                bounds[2 * segment] = bounds[segment];
+            }
+            segments *= 2;
+        }
+
+        const auto first_child = nodes_.size();
+        nodes_[node_index].first_child = first_child;
+        for (size_t q { 0 }; q < children_per_node; ++q) {
+            auto child_center = center;
+            for_each_axis<dimensions>([&](const size_t axis) {
+                child_center[axis] += ((q >> axis) & 1) ? quarter : -quarter;
+            });
+            nodes_.push_back(Node { child_center, quarter, 0.0, child_center, bounds[q], bounds[q + 1], 0 });
+        }
+        for (size_t q { 0 }; q < children_per_node; ++q) {
+            subdivide(first_child + q, depth + 1, coordinates);
+        }
+    }
+
+    void compute_monopoles(const size_t node_index) {
+        auto& node = nodes_[node_index];
+        double mass { 0.0 };
+        point moment {};
+        if (node.first_child == 0) {
+            for (size_t p { node.begin }; p < node.end; ++p) {
+                mass += masses_[p];
+                for_each_axis<dimensions>(
+                    [&](const size_t axis) { moment[axis] += masses_[p] * coordinates_[axis][p]; });
+            }
+        } else {
+            for (size_t q { 0 }; q < children_per_node; ++q) {
+                compute_monopoles(node.first_child + q);
+                const auto& child = nodes_[node.first_child + q];
+                mass += child.mass;
+                for_each_axis<dimensions>(
+                    [&](const size_t axis) { moment[axis] += child.mass * child.center_of_mass[axis]; });
+            }
+        }
+        node.mass = mass;
+        for_each_axis<dimensions>([&](const size_t axis) {
+            node.center_of_mass[axis] = mass > 0.0 ? moment[axis] / mass : node.center[axis];
+        });
+    }
+
+  public:
+    explicit Orthtree(const size_t leaf_capacity = 8) : leaf_capacity_ { std::max<size_t>(leaf_capacity, 1) } {}
+
+    // Grows the storage up front so that steady state builds do not allocate.
+    // The node count depends on clustering, so nodes_ may still grow to its high water mark.
+    void reserve(const size_t particles) {
+        order_.reserve(particles);
+        for (auto& coordinate : coordinates_) {
+            coordinate.reserve(particles);
+        }
+        masses_.reserve(particles);
+        nodes_.reserve(children_per_node * (particles / leaf_capacity_ + 1));
+    }
+
+    void build(const std::array<std::span<const double>, dimensions>& coordinates, std::span<const double> masses) {
+        const auto particles = masses.size();
+
+        nodes_.clear();
+        order_.resize(particles);
+        for (size_t i { 0 }; i < particles; ++i) {
+            order_[i] = i;
+        }
+
+        if (particles == 0) { return; }
+
+        // A cube of the largest extent, which holds the bounding box of every other axis too
+        const auto bounds = bounding_box<dimensions>(coordinates);
+        const auto half_width = 0.5 * std::max(1e-300, std::ranges::max(bounds.extent));
+        point center {};
+        for_each_axis<dimensions>(
+            [&](const size_t axis) { center[axis] = bounds.min[axis] + 0.5 * bounds.extent[axis]; });
+
+        nodes_.push_back(Node { center, half_width, 0.0, center, 0, particles, 0 });
+        subdivide(0, 0, coordinates);
+
+        for_each_axis<dimensions>([&](const size_t axis) {
+            coordinates_[axis].resize(particles);
+            for (size_t p { 0 }; p < particles; ++p) {
+                coordinates_[axis][p] = coordinates[axis][order_[p]];
+            }
+        });
+        masses_.resize(particles);
+        for (size_t p { 0 }; p < particles; ++p) {
+            masses_[p] = masses[order_[p]];
+        }
+
+        compute_monopoles(0);
+    }
+
+    // Tree position -> particle index of the last build
+    const std::vector<size_t>& order() const { return order_; }
+
+    // Nodes of the last build, the root first, and the particles copied into tree order
+    const std::vector<Node>& nodes() const { return nodes_; }
+    const std::array<std::vector<double>, dimensions>& coordinates() const { return coordinates_; }
+    const std::vector<double>& masses() const { return masses_; }
+
+    /*
+    Acceleration on the particle at tree position p, without the gravitational constant.
+    A cell is approximated by its center of mass when the particle lies outside of it and
+    cell width / distance < theta. With theta = 0 every cell is opened, which is direct summation.
+     */
+    point acceleration_at(const size_t p, const double theta) const {
+        size_t interactions { 0 };
+        return acceleration_at(p, theta, interactions);
+    }
+
+    // Same, adding the particles and cells the particle interacted with to interactions
+    point acceleration_at(const size_t p, const double theta, size_t& interactions) const {
+        point position {};
+        for_each_axis<dimensions>([&](const size_t axis) { position[axis] = coordinates_[axis][p]; });
+        const auto theta2 = theta * theta;
+
+        point acceleration {};
+
+        std::array<size_t, (children_per_node - 1) * max_depth_ + 1> stack;
+        size_t stack_size { 0 };
+        stack[stack_size++] = 0;
+
+        while (stack_size > 0) {
+            const auto& node = nodes_[stack[--stack_size]];
+            if (node.begin == node.end) { continue; }
+
+            if (node.first_child == 0) {
+                interactions += node.end - node.begin;
+                for (size_t q { node.begin }; q < node.end; ++q) {
+                    if (q == p) { continue; }
+                    point d {};
+                    double d2 { 0.0 };
+                    for_each_axis<dimensions>([&](const size_t axis) {
+                        d[axis] = coordinates_[axis][q] - position[axis];
+                        d2 += d[axis] * d[axis];
+                    });
+                    const auto m_over_d3 = masses_[q] / (d2 * std::sqrt(d2));
+                    for_each_axis<dimensions>([&](const size_t axis) { acceleration[axis] += m_over_d3 * d[axis]; });
+                }
+                continue;
+            }
+
+            point d {};
+            double d2 { 0.0 };
+            bool outside { false };
+            for_each_axis<dimensions>([&](const size_t axis) {
+                d[axis] = node.center_of_mass[axis] - position[axis];
+                d2 += d[axis] * d[axis];
+                outside = outside || std::abs(position[axis] - node.center[axis]) > node.half_width;
+            });
+            const auto width = 2.0 * node.half_width;
+
+            if (outside && width * width < theta2 * d2) {
+                ++interactions;
+                const auto m_over_d3 = node.mass / (d2 * std::sqrt(d2));
+                for_each_axis<dimensions>([&](const size_t axis) { acceleration[axis] += m_over_d3 * d[axis]; });
+            } else {
+                for (size_t q { 0 }; q < children_per_node; ++q) {
+                    stack[stack_size++] = node.first_child + q;
+                }
+            }
+        }
+
+        return acceleration;
+    }
+};
+
+using QuadTree = Orthtree<2>;
+using Octree = Orthtree<3>;
+
+} // namespace nps
@@ -0,0 +1,284 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstddef>
+
+#if __has_include(<experimental/simd>)
+// The AVX-512 reductions in GCC 12 trip a false positive
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#include <experimental/simd>
+#pragma GCC diagnostic pop
+#define NPS_HAS_SIMD 1
+#endif
+
+#include "Axes.hpp"
+
+namespace nps::kernels {
+
+/*
+Raw pairwise gravity kernels. Positions and masses are plain arrays in the simulation
+units, one array per axis, and the resulting accelerations are without the gravitational constant.
+
+The symmetric kernels take a with_potential flag, with which they also add the sum of m_i m_j / |r_j - r_i|
+over their pairs to *potential, the negative potential energy without G, from the 1 / |r_j - r_i| they
+already have. Without it they compile to the acceleration sums alone.
+ */
+
+template <size_t dimensions>
+using const_axes = std::array<const double*, dimensions>;
+
+template <size_t dimensions>
+using axes = std::array<double*, dimensions>;
+
+// Symmetric interactions of particles [i_begin, i_end) with [j_begin, j_end).
+// For a tile on the diagonal (same ranges) only the pairs i < j are visited.
+template <size_t dimensions, bool with_potential = false>
+void accumulate_tile(const const_axes<dimensions>& r, const double* m, const size_t i_begin, const size_t i_end,
+                     const size_t j_begin, const size_t j_end, const axes<dimensions>& a,
+                     double* potential = nullptr) {
+    const auto diagonal = i_begin == j_begin;
+
+    for (size_t i { i_begin }; i < i_end; ++i) {
+        std::array<double, dimensions> ri;
+        std::array<double, dimensions> ai {};
+        double mj_over_d { 0.0 };
+        for_each_axis<dimensions>([&](const size_t axis) { ri[axis] = r[axis][i]; });
+        const auto mi = m[i];
+
+        for (size_t j { diagonal ? i + 1 : j_begin }; j < j_end; ++j) {
+            std::array<double, dimensions> d;
+            double d2 { 0.0 };
+            for_each_axis<dimensions>([&](const size_t axis) {
+                d[axis] = r[axis][j] - ri[axis];
+                d2 += d[axis] * d[axis];
+            });
+            const auto inv_d3 = 1.0 / (d2 * std::sqrt(d2));
+            if constexpr (with_potential) { mj_over_d += m[j] * d2 * inv_d3; }
+
+            for_each_axis<dimensions>([&](const size_t axis) {
+                ai[axis] += m[j] * inv_d3 * d[axis];
+                a[axis][j] -= mi * inv_d3 * d[axis];
+            });
+        }
+
+        for_each_axis<dimensions>([&](const size_t axis) { a[axis][i] += ai[axis]; });
+        if constexpr (with_potential) { *potential += mi * mj_over_d; }
+    }
+}
+
+/*
+Acceleration and jerk (time derivative of the acceleration) of particle i from all the other particles.
+Not symmetric, for when only a few particles need new forces, e.g. the active ones of a block timestep.
+ */
+template <size_t dimensions>
+void acceleration_and_jerk(const const_axes<dimensions>& r, const const_axes<dimensions>& v, const double* m,
+                           const size_t particles, const size_t i, std::array<double, dimensions>& a,
+                           std::array<double, dimensions>& jerk) {
+    std::array<double, dimensions> ri;
+    std::array<double, dimensions> vi;
+    for_each_axis<dimensions>([&](const size_t axis) {
+        ri[axis] = r[axis][i];
+        vi[axis] = v[axis][i];
+        a[axis] = 0.0;
+        jerk[axis] = 0.0;
+    });
+
+    for (size_t j { 0 }; j < particles; ++j) {
+        if (j == i) { continue; }
+        std::array<double, dimensions> d;
+        std::array<double, dimensions> w;
+        double d2 { 0.0 };
+        double dw { 0.0 };
+        for_each_axis<dimensions>([&](const size_t axis) {
+            d[axis] = r[axis][j] - ri[axis];
+            w[axis] = v[axis][j] - vi[axis];
+            d2 += d[axis] * d[axis];
+            dw += d[axis] * w[axis];
+        });
+        const auto m_over_d3 = m[j] / (d2 * std::sqrt(d2));
+        const auto radial = 3.0 * dw / d2;
+
+        for_each_axis<dimensions>([&](const size_t axis) {
+            a[axis] += m_over_d3 * d[axis];
+            jerk[axis] += m_over_d3 * (w[axis] - radial * d[axis]);
+        });
+    }
+}
+
+#ifdef NPS_HAS_SIMD
+namespace stdx = std::experimental;
+
+// Widest vector of doubles for the target, e.g. 4 lanes with AVX2 and 8 with AVX-512
+using simd_double = stdx::native_simd<double>;
+
+// Same as accumulate_tile, but the j loop handles simd_double::size() particles at a time
+template <size_t dimensions, bool with_potential = false>
+void accumulate_tile_simd(const const_axes<dimensions>& r, const double* m, const size_t i_begin, const size_t i_end,
+                          const size_t j_begin, const size_t j_end, const axes<dimensions>& a,
+                          double* potential = nullptr) {
+    constexpr auto lanes = simd_double::size();
+    const auto diagonal = i_begin == j_begin;
+
+    for (size_t i { i_begin }; i < i_end; ++i) {
+        std::array<double, dimensions> ri;
+        std::array<simd_double, dimensions> ai_lanes;
+        simd_double mj_over_d_lanes { 0.0 };
+        for_each_axis<dimensions>([&](const size_t axis) {
+            ri[axis] = r[axis][i];
+            ai_lanes[axis] = 0.0;
+        });
+        const auto mi = m[i];
+
+        auto j = diagonal ? i + 1 : j_begin;
+        for (; j + lanes <= j_end; j += lanes) {
+            std::array<simd_double, dimensions> d;
+            simd_double d2 { 0.0 };
+            for_each_axis<dimensions>([&](const size_t axis) {
+                d[axis] = simd_double(r[axis] + j, stdx::element_aligned) - ri[axis];
+                d2 += d[axis] * d[axis];
+            });
+            const auto inv_d3 = 1.0 / (d2 * stdx::sqrt(d2));
+            const auto mj = simd_double(m + j, stdx::element_aligned);
+            if constexpr (with_potential) { mj_over_d_lanes += mj * d2 * inv_d3; }
+
+            for_each_axis<dimensions>([&](const size_t axis) {
+                ai_lanes[axis] += mj * inv_d3 * d[axis];
+
+                auto aj = simd_double(a[axis] + j, stdx::element_aligned);
+                aj -= mi * inv_d3 * d[axis];
+                aj.copy_to(a[axis] + j, stdx::element_aligned);
+            });
+        }
+
+        std::array<double, dimensions> ai;
+        for_each_axis<dimensions>([&](const size_t axis) { ai[axis] = stdx::reduce(ai_lanes[axis]); });
+        auto mj_over_d = stdx::reduce(mj_over_d_lanes);
+
+        for (; j < j_end; ++j) {
+            std::array<double, dimensions> d;
+            double d2 { 0.0 };
+            for_each_axis<dimensions>([&](const size_t axis) {
+                d[axis] = r[axis][j] - ri[axis];
+                d2 += d[axis] * d[axis];
+            });
+            const auto inv_d3 = 1.0 / (d2 * std::sqrt(d2));
+            if constexpr (with_potential) { mj_over_d += m[j] * d2 * inv_d3; }
+
+            for_each_axis<dimensions>([&](const size_t axis) {
+                ai[axis] += m[j] * inv_d3 * d[axis];
+                a[axis][j] -= mi * inv_d3 * d[axis];
+            });
+        }
+
+        for_each_axis<dimensions>([&](const size_t axis) { a[axis][i] += ai[axis]; });
+        if constexpr (with_potential) { *potential += mi * mj_over_d; }
+    }
+}
+#endif
+
+/*
+Mixed precision accumulate_tile_simd: positions and masses come in real, e.g. float for twice the lanes
+and half the memory traffic, while a stays double. The j range is cut into chunks whose interactions are
+summed in real, on both sides of the pairs, and every chunk sum is added to a in double, so no sum in real
+runs over more than chunk terms. Positions should be relative to a nearby origin for real to resolve
+their differences.
+ */
+template <size_t dimensions, typename real, bool with_potential = false>
+void accumulate_tile_mixed(const std::array<const real*, dimensions>& r, const real* m, const size_t i_begin,
+                           const size_t i_end, const size_t j_begin, const size_t j_end, const axes<dimensions>& a,
+                           double* potential = nullptr) {
+    constexpr size_t chunk = 256;
+    const auto diagonal = i_begin == j_begin;
+
+    // Sums of the chunk's j particles in real
+    alignas(64) std::array<std::array<real, chunk>, dimensions> aj;
+
+    for (size_t chunk_begin { j_begin }; chunk_begin < j_end; chunk_begin += chunk) {
+        const auto chunk_end = std::min(j_end, chunk_begin + chunk);
+        for (auto& axis : aj) {
+            std::fill(axis.begin(), axis.begin() + (chunk_end - chunk_begin), real { 0 });
+        }
+
+        for (size_t i { i_begin }; i < i_end; ++i) {
+            auto j = diagonal ? std::max(i + 1, chunk_begin) : chunk_begin;
+            if (j >= chunk_end) { continue; }
+
+            std::array<real, dimensions> ri;
+            std::array<real, dimensions> ai {};
+            real mj_over_d { 0 };
+            for_each_axis<dimensions>([&](const size_t axis) { ri[axis] = r[axis][i]; });
+            const auto mi = m[i];
+
+#ifdef NPS_HAS_SIMD
+            using simd_real = stdx::native_simd<real>;
+            constexpr auto lanes = simd_real::size();
+
+            std::array<simd_real, dimensions> ai_lanes;
+            simd_real mj_over_d_lanes { real { 0 } };
+            for_each_axis<dimensions>([&](const size_t axis) { ai_lanes[axis] = real { 0 }; });
+            for (; j + lanes <= chunk_end; j += lanes) {
+                std::array<simd_real, dimensions> d;
+                simd_real d2 { real { 0 } };
+                for_each_axis<dimensions>([&](const size_t axis) {
+                    d[axis] = simd_real(r[axis] + j, stdx::element_aligned) - ri[axis];
+                    d2 += d[axis] * d[axis];
+                });
+                const auto inv_d3 = real { 1 } / (d2 * stdx::sqrt(d2));
+                const auto mj = simd_real(m + j, stdx::element_aligned);
+                if constexpr (with_potential) { mj_over_d_lanes += mj * d2 * inv_d3; }
+
+                for_each_axis<dimensions>([&](const size_t axis) {
+                    ai_lanes[axis] += mj * inv_d3 * d[axis];
+
+                    const auto aj_at = aj[axis].data() + (j - chunk_begin);
+                    auto aj_lanes = simd_real(aj_at, stdx::element_aligned);
+                    aj_lanes -= mi * inv_d3 * d[axis];
+                    aj_lanes.copy_to(aj_at, stdx::element_aligned);
+                });
+            }
+            for_each_axis<dimensions>([&](const size_t axis) { ai[axis] = stdx::reduce(ai_lanes[axis]); });
+            mj_over_d = stdx::reduce(mj_over_d_lanes);
+#endif
+
+            for (; j < chunk_end; ++j) {
+                std::array<real, dimensions> d;
+                real d2 { 0 };
+                for_each_axis<dimensions>([&](const size_t axis) {
+                    d[axis] = r[axis][j] - ri[axis];
+                    d2 += d[axis] * d[axis];
+                });
+                const auto inv_d3 = real { 1 } / (d2 * std::sqrt(d2));
+                if constexpr (with_potential) { mj_over_d += m[j] * d2 * inv_d3; }
+
+                for_each_axis<dimensions>([&](const size_t axis) {
+                    ai[axis] += m[j] * inv_d3 * d[axis];
+                    aj[axis][j - chunk_begin] -= mi * inv_d3 * d[axis];
+                });
+            }
+
+            for_each_axis<dimensions>([&](const size_t axis) { a[axis][i] += double(ai[axis]); });
+            if constexpr (with_potential) { *potential += double(mi) * double(mj_over_d); }
+        }
+
+        for_each_axis<dimensions>([&](const size_t axis) {
+            for (size_t j { chunk_begin }; j < chunk_end; ++j) {
+                a[axis][j] += double(aj[axis][j - chunk_begin]);
+            }
+        });
+    }
+}
+
+#ifndef NPS_HAS_SIMD
+// Without <experimental/simd> the scalar kernel is left to the auto vectorizer
+template <size_t dimensions, bool with_potential = false>
+void accumulate_tile_simd(const const_axes<dimensions>& r, const double* m, const size_t i_begin, const size_t i_end,
+                          const size_t j_begin, const size_t j_end, const axes<dimensions>& a,
+                          double* potential = nullptr) {
+    accumulate_tile<dimensions, with_potential>(r, m, i_begin, i_end, j_begin, j_end, a, potential);
+}
+#endif
+
+} // namespace nps::kernels
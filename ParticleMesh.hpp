@@ -0,0 +1,323 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <cmath>
+#include <complex>
+#include <span>
+#include <vector>
+
+#include "Axes.hpp"
+#include "Fft.hpp"
+#include "ThreadPool.hpp"
+
+namespace nps {
+
+// Mass assignment (and interpolation) scheme of the particle mesh: cloud-in-cell or triangular-shaped-cloud
+enum class mesh_assignment { cic, tsc };
+
+/*
+Particle-mesh gravity over a cubic grid that is fitted around the particles every evaluation.
+
+Masses are assigned to the grid, convolved with 1/r through FFTs on a grid of twice the size per axis
+(zero padding, so the boundaries are isolated rather than periodic), and the potential is differenced
+with four point stencils. The accelerations are interpolated back to the particles with the same scheme
+that assigned the masses, which keeps the self force zero. O(N + G log G) for G grid cells, but
+interactions closer than a few cells are smoothed out.
+ */
+template <size_t dimensions>
+class ParticleMesh {
+  public:
+    using point = std::array<double, dimensions>;
+
+  private:
+    // Empty cells between the particles and the grid edges, enough for the stencils and the differences
+    static constexpr size_t margin_ = 4;
+
+    size_t cells_ { 64 };
+    mesh_assignment assignment_ { mesh_assignment::cic };
+
+    Fft fft_ {};
+    // Grid size the kernel was transformed for, 0 before the first evaluation
+    size_t kernel_cells_ { 0 };
+    // Transform of 1/|d| in cell units over the padded grid, real since the kernel is even
+    std::vector<double> kernel_hat_ {};
+
+    // (2 * cells_)^dimensions, axis 0 fastest
+    std::vector<std::complex<double>> padded_ {};
+    // One FFT line per thread
+    std::vector<std::complex<double>> line_scratch_ {};
+    // Assigned masses per thread: [thread][cell]
+    std::vector<double> thread_masses_ {};
+    std::vector<double> potential_ {};
+    std::array<std::vector<double>, dimensions> field_ {};
+
+    // Accelerations of the last evaluation, by particle
+    std::array<std::vector<double>, dimensions> accelerations_ {};
+
+    point origin_ {};
+    double cell_width_ { 1.0 };
+
+    struct axis_stencil {
+        size_t first;
+        std::array<double, 3> weights;
+    };
+
+    size_t stencil_width() const { return assignment_ == mesh_assignment::cic ? 2 : 3; }
+
+    size_t grid_cells() const {
+        size_t cells { 1 };
+        for (size_t axis { 0 }; axis < dimensions; ++axis) {
+            cells *= cells_;
+        }
+        return cells;
+    }
+
+    size_t padded_cells() const { return grid_cells() << dimensions; }
+
+    size_t padded_index(size_t cell) const {
+        size_t index { 0 };
+        size_t stride { 1 };
+        for (size_t axis { 0 }; axis < dimensions; ++axis) {
+            index += (cell % cells_) * stride;
+            cell /= cells_;
+            stride *= 2 * cells_;
+        }
+        return index;
+    }
+
+    // Cells touched along one axis by a particle at raw coordinate x, cell centers are at (c + 0.5) cells
+    axis_stencil stencil_of(const double x, const size_t axis) const {
+        const auto u = (x - origin_[axis]) / cell_width_ - 0.5;
+        if (assignment_ == mesh_assignment::cic) {
+            const auto cell = std::floor(u);
+            const auto f = u - cell;
+            return { static_cast<size_t>(cell), { 1.0 - f, f, 0.0 } };
+        }
+        const auto cell = std::round(u);
+        const auto f = u - cell;
+        return { static_cast<size_t>(cell) - 1,
+                 { 0.5 * (0.5 - f) * (0.5 - f), 0.75 - f * f, 0.5 * (0.5 + f) * (0.5 + f) } };
+    }
+
+    // f(grid cell, weight) for every cell of the product of the per axis stencils
+    template <typename F>
+    void for_each_stencil_cell(const std::array<axis_stencil, dimensions>& stencils, F&& f) const {
+        const auto width = stencil_width();
+        size_t combinations { 1 };
+        for (size_t axis { 0 }; axis < dimensions; ++axis) {
+            combinations *= width;
+        }
+
+        for (size_t combination { 0 }; combination < combinations; ++combination) {
+            size_t cell { 0 };
+            size_t stride { 1 };
+            size_t rest { combination };
+            double weight { 1.0 };
+            for_each_axis<dimensions>([&](const size_t axis) {
+                const auto offset = rest % width;
+                rest /= width;
+                cell += (stencils[axis].first + offset) * stride;
+                stride *= cells_;
+                weight *= stencils[axis].weights[offset];
+            });
+            f(cell, weight);
+        }
+    }
+
+    /*
+    FFT of padded_ along every axis, the lines split between the threads.
+    With prune, the forward transform skips the lines that are still all padding, and the inverse
+    transform skips the lines that only feed the padding of the result.
+     */
+    void transform_padded(const bool inverse, const bool prune, ThreadPool& pool) {
+        const auto n = 2 * cells_;
+        const auto lines = padded_cells() / n;
+
+        size_t stride { 1 };
+        for (size_t axis { 0 }; axis < dimensions; ++axis) {
+            pool.parallel_for(lines, [&](const size_t begin, const size_t end, const size_t t) {
+                const auto line = line_scratch_.data() + t * n;
+                for (size_t l { begin }; l < end; ++l) {
+                    // l enumerates the coordinates on the other axes, the lowest axis fastest
+                    size_t base { 0 };
+                    size_t rest { l };
+                    size_t other_stride { 1 };
+                    bool skip { false };
+                    for (size_t other { 0 }; other < dimensions; ++other) {
+                        if (other != axis) {
+                            const auto c = rest % n;
+                            rest /= n;
+                            base += c * other_stride;
+                            skip = skip || (c >= cells_ && (inverse ? other < axis : other > axis));
+                        }
+                        other_stride *= n;
+                    }
+                    if (prune && skip) { continue; }
+
+                    for (size_t k { 0 }; k < n; ++k) {
+                        line[k] = padded_[base + k * stride];
+                    }
+                    fft_.transform(line, inverse);
+                    for (size_t k { 0 }; k < n; ++k) {
+                        padded_[base + k * stride] = line[k];
+                    }
+                }
+            });
+            stride *= n;
+        }
+    }
+
+    void compute_kernel(ThreadPool& pool) {
+        const auto n = 2 * cells_;
+        // Mean of 1 / r over the cell around the origin, for the mass in a particle's own cell
+        constexpr auto self = dimensions == 2 ? 3.525494348078172 : 2.380077363979563;
+
+        for (size_t index { 0 }; index < padded_cells(); ++index) {
+            double d2 { 0.0 };
+            size_t rest { index };
+            for (size_t axis { 0 }; axis < dimensions; ++axis) {
+                const auto c = rest % n;
+                rest /= n;
+                // Offsets past the middle wrap around to negative ones
+                const auto d = c < cells_ ? double(c) : double(c) - double(n);
+                d2 += d * d;
+            }
+            padded_[index] = d2 > 0.0 ? 1.0 / std::sqrt(d2) : self;
+        }
+        transform_padded(false, false, pool);
+
+        kernel_hat_.resize(padded_cells());
+        for (size_t index { 0 }; index < padded_cells(); ++index) {
+            kernel_hat_[index] = padded_[index].real();
+        }
+        kernel_cells_ = cells_;
+    }
+
+    void fit_grid(const std::array<std::span<const double>, dimensions>& coordinates) {
+        // Square cells over the largest extent, a margin of them around the particles
+        const auto bounds = bounding_box<dimensions>(coordinates);
+        cell_width_ = std::max(1e-300, std::ranges::max(bounds.extent)) / double(cells_ - 2 * margin_);
+        for_each_axis<dimensions>(
+            [&](const size_t axis) { origin_[axis] = bounds.min[axis] - margin_ * cell_width_; });
+    }
+
+  public:
+    // Cells per axis, a power of two
+    void set_grid(const size_t cells) {
+        assert(cells >= 4 * margin_ && (cells & (cells - 1)) == 0);
+        cells_ = cells;
+    }
+    size_t grid() const { return cells_; }
+
+    void set_assignment(const mesh_assignment assignment) { assignment_ = assignment; }
+    mesh_assignment assignment() const { return assignment_; }
+
+    // Accelerations without G of all particles, see acceleration_at
+    void evaluate(const std::array<std::span<const double>, dimensions>& coordinates, std::span<const double> masses,
+                  ThreadPool& pool) {
+        const auto particles = masses.size();
+        const auto threads = pool.size();
+        const auto grid = grid_cells();
+
+        for (auto& accelerations : accelerations_) {
+            accelerations.assign(particles, 0.0);
+        }
+        if (particles == 0) { return; }
+
+        fft_.resize(2 * cells_);
+        padded_.resize(padded_cells());
+        line_scratch_.resize(threads * 2 * cells_);
+        thread_masses_.resize(threads * grid);
+        potential_.resize(grid);
+        for (auto& field : field_) {
+            field.resize(grid);
+        }
+        if (kernel_cells_ != cells_) { compute_kernel(pool); }
+
+        fit_grid(coordinates);
+
+        // Each thread assigns its share of the particles to its own grid
+        pool.run([&](const size_t t) {
+            const auto masses_t = thread_masses_.data() + t * grid;
+            std::fill(masses_t, masses_t + grid, 0.0);
+            for (size_t i { particles * t / threads }; i < particles * (t + 1) / threads; ++i) {
+                std::array<axis_stencil, dimensions> stencils;
+                for_each_axis<dimensions>(
+                    [&](const size_t axis) { stencils[axis] = stencil_of(coordinates[axis][i], axis); });
+                for_each_stencil_cell(stencils, [&](const size_t cell, const double weight) {
+                    masses_t[cell] += masses[i] * weight;
+                });
+            }
+        });
+
+        std::ranges::fill(padded_, std::complex<double> { 0.0 });
+        pool.parallel_for(grid, [&](const size_t begin, const size_t end, size_t) {
+            for (size_t cell { begin }; cell < end; ++cell) {
+                double mass { 0.0 };
+                for (size_t t { 0 }; t < threads; ++t) {
+                    mass += thread_masses_[t * grid + cell];
+                }
+                padded_[padded_index(cell)] = mass;
+            }
+        });
+
+        transform_padded(false, true, pool);
+        pool.parallel_for(padded_cells(), [&](const size_t begin, const size_t end, size_t) {
+            for (size_t index { begin }; index < end; ++index) {
+                padded_[index] *= kernel_hat_[index];
+            }
+        });
+        transform_padded(true, true, pool);
+
+        // sum m / r, the negative of the potential, so the acceleration is its gradient
+        const auto scale = 1.0 / (cell_width_ * double(padded_cells()));
+        pool.parallel_for(grid, [&](const size_t begin, const size_t end, size_t) {
+            for (size_t cell { begin }; cell < end; ++cell) {
+                potential_[cell] = padded_[padded_index(cell)].real() * scale;
+            }
+        });
+
+        pool.parallel_for(grid, [&](const size_t begin, const size_t end, size_t) {
+            for (size_t cell { begin }; cell < end; ++cell) {
+                size_t stride { 1 };
+                size_t rest { cell };
+                for_each_axis<dimensions>([&](const size_t axis) {
+                    const auto c = rest % cells_;
+                    rest /= cells_;
+                    if (c >= 2 && c + 2 < cells_) {
+                        const auto& p = potential_;
+                        field_[axis][cell] = (8.0 * (p[cell + stride] - p[cell - stride]) -
+                                              (p[cell + 2 * stride] - p[cell - 2 * stride])) /
+                                             (12.0 * cell_width_);
+                    } else {
+                        field_[axis][cell] = 0.0;
+                    }
+                    stride *= cells_;
+                });
+            }
+        });
+
+        pool.parallel_for(particles, [&](const size_t begin, const size_t end, size_t) {
+            for (size_t i { begin }; i < end; ++i) {
+                std::array<axis_stencil, dimensions> stencils;
+                for_each_axis<dimensions>(
+                    [&](const size_t axis) { stencils[axis] = stencil_of(coordinates[axis][i], axis); });
+                for_each_stencil_cell(stencils, [&](const size_t cell, const double weight) {
+                    for_each_axis<dimensions>(
+                        [&](const size_t axis) { accelerations_[axis][i] += weight * field_[axis][cell]; });
+                });
+            }
+        });
+    }
+
+    // Acceleration of particle i from the last evaluate
+    point acceleration_at(const size_t i) const {
+        point acceleration;
+        for_each_axis<dimensions>([&](const size_t axis) { acceleration[axis] = accelerations_[axis][i]; });
+        return acceleration;
+    }
+};
+
+} // namespace nps
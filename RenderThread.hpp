@@ -0,0 +1,94 @@
+#pragma once
+#define FMT_HEADER_ONLY
+
+#include "fmt/format.h"
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include "StepMetrics.hpp"
+#include "TerminalRenderer.hpp"
+#include "ThreadPool.hpp"
+#include "TripleBuffer.hpp"
+
+namespace nps {
+
+// x-y projection of the particles at one moment, in raw coordinate units
+struct PositionSnapshot {
+    std::vector<double> x {};
+    std::vector<double> y {};
+    double simulation_time { 0.0 };
+};
+
+/*
+Draws published position snapshots to the terminal from its own thread, at most max_fps times a second.
+
+The stepping thread fills snapshot() and calls publish(), which never waits for the render thread,
+the snapshots go through a TripleBuffer and frames that are not drawn in time are skipped. Render times
+are recorded into the metrics as the render phase, from this thread, which is fine for StepMetrics.
+The last published snapshot is drawn once more when the thread stops.
+ */
+class RenderThread {
+  private:
+    TripleBuffer<PositionSnapshot> snapshots_ {};
+    TerminalRenderer renderer_ {};
+    StepMetrics& metrics_;
+    view_box view_;
+    render_style style_;
+    // Bins the density style, separate from the stepping threads
+    ThreadPool pool_;
+    std::chrono::nanoseconds frame_period_;
+
+    std::atomic<bool> stopping_ { false };
+    std::thread thread_ {};
+
+    void draw_latest() {
+        if (!snapshots_.acquire()) { return; }
+        const auto timer = metrics_.time(phase::render);
+        const auto& snapshot = snapshots_.front();
+        renderer_.plot(snapshot.x, snapshot.y, view_, style_, pool_);
+
+        std::array<char, 128> status;
+        const auto written = fmt::format_to_n(status.data(), status.size(), "n: {}, t: {:.2f}, steps: {}",
+                                              snapshot.x.size(), snapshot.simulation_time,
+                                              metrics_.count(counter::steps));
+        renderer_.set_status({ status.data(), std::min(written.size, status.size()) });
+        renderer_.present();
+    }
+
+    void render_loop() {
+        auto next_frame = std::chrono::steady_clock::now();
+        while (!stopping_.load(std::memory_order_acquire)) {
+            draw_latest();
+            // A frame that overran its period does not make the next ones hurry
+            next_frame = std::max(next_frame + frame_period_, std::chrono::steady_clock::now());
+            std::this_thread::sleep_until(next_frame);
+        }
+        draw_latest();
+    }
+
+  public:
+    RenderThread(StepMetrics& metrics, const view_box& view, const double max_fps = 30.0,
+                 const render_style style = render_style::points, const size_t threads = 1)
+        : metrics_(metrics), view_(view), style_(style), pool_(threads),
+          frame_period_(std::chrono::nanoseconds(static_cast<long long>(1e9 / std::max(max_fps, 1e-3)))) {
+        thread_ = std::thread([this] { render_loop(); });
+    }
+
+    RenderThread(const RenderThread&) = delete;
+    RenderThread& operator=(const RenderThread&) = delete;
+
+    ~RenderThread() {
+        stopping_.store(true, std::memory_order_release);
+        thread_.join();
+    }
+
+    // Stepping thread side: fill, then publish. Reusing the buffers keeps a steady particle count allocation free.
+    PositionSnapshot& snapshot() { return snapshots_.back(); }
+    void publish() { snapshots_.publish(); }
+};
+
+} // namespace nps
@@ -0,0 +1,132 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cmath>
+#include <cstdint>
+#include <span>
+#include <vector>
+
+#include "Axes.hpp"
+#include "CountingSort.hpp"
+
+namespace nps {
+
+/*
+Spatial hash of raw particle coordinates for finding the pairs closer than a small radius.
+
+Space is cut into cubic cells of the radius and every cell is hashed into one of at least twice as
+many buckets as there are particles. As in CellList, particles are counting sorted by bucket and
+their coordinates copied into that order, see sort_by_key. Unlike CellList the buckets do not depend on the extent of
+the particles, so a few escapers far from the rest cost nothing, and a pair search is O(N) for any
+distribution whose cells hold a bounded number of particles. Storage is reused between builds.
+ */
+template <size_t dimensions>
+class SpatialHash {
+  private:
+    double cell_width_ { 1.0 };
+    // Buckets are the top bucket_bits_ bits of a cell's hash
+    size_t bucket_bits_ { 1 };
+
+    // Sorted position -> particle index, and the first sorted position of every bucket (plus the end)
+    std::vector<size_t> order_ {};
+    std::vector<size_t> bucket_starts_ {};
+    std::vector<size_t> bucket_of_ {};
+    std::array<std::vector<double>, dimensions> coordinates_ {};
+
+    using cell = std::array<std::int64_t, dimensions>;
+
+    cell cell_at(const std::array<double, dimensions>& point) const {
+        cell c;
+        for_each_axis<dimensions>([&](const size_t axis) {
+            c[axis] = static_cast<std::int64_t>(std::floor(point[axis] / cell_width_));
+        });
+        return c;
+    }
+
+    // Large primes of Teschner et al. 2003 per axis, then Fibonacci hashing into the buckets
+    size_t bucket_of(const cell& c) const {
+        constexpr std::array<std::uint64_t, 3> primes { 73856093, 19349663, 83492791 };
+        std::uint64_t hash { 0 };
+        for_each_axis<dimensions>([&](const size_t axis) {
+            hash ^= static_cast<std::uint64_t>(c[axis]) * primes[axis];
+        });
+        return static_cast<size_t>((hash * 0x9e3779b97f4a7c15) >> (64 - bucket_bits_));
+    }
+
+  public:
+    // Grows the storage up front so that later builds of as many particles do not allocate
+    void reserve(const size_t particles) {
+        order_.reserve(particles);
+        bucket_of_.reserve(particles);
+        bucket_starts_.reserve(std::bit_ceil(2 * particles + 2) + 1);
+        for (auto& coordinate : coordinates_) {
+            coordinate.reserve(particles);
+        }
+    }
+
+    void build(const std::array<std::span<const double>, dimensions>& coordinates, const double cell_width) {
+        const auto particles = coordinates[0].size();
+        cell_width_ = cell_width;
+        bucket_bits_ = static_cast<size_t>(std::bit_width(2 * particles + 1));
+        const auto buckets = size_t { 1 } << bucket_bits_;
+
+        bucket_of_.resize(particles);
+        for (size_t i { 0 }; i < particles; ++i) {
+            std::array<double, dimensions> point;
+            for_each_axis<dimensions>([&](const size_t axis) { point[axis] = coordinates[axis][i]; });
+            bucket_of_[i] = bucket_of(cell_at(point));
+        }
+        sort_by_key<dimensions>(bucket_of_, buckets, coordinates, order_, bucket_starts_, coordinates_);
+    }
+
+    /*
+    Calls f(i, j) once for every pair of particles i < j of the last build closer than radius, which
+    may not be more than the cell width. The candidates are the particles of the buckets of the 3^dimensions
+    cells around a particle, each bucket visited once even where two of the cells share it.
+     */
+    template <typename F>
+    void for_each_pair_within(const double radius, F&& f) const {
+        constexpr auto neighbours = dimensions == 2 ? 9 : 27;
+        const auto radius2 = radius * radius;
+        const auto particles = order_.size();
+
+        for (size_t p { 0 }; p < particles; ++p) {
+            const auto i = order_[p];
+            std::array<double, dimensions> point;
+            for_each_axis<dimensions>([&](const size_t axis) { point[axis] = coordinates_[axis][p]; });
+            const auto c = cell_at(point);
+
+            std::array<size_t, neighbours> buckets;
+            size_t distinct { 0 };
+            for (size_t neighbour { 0 }; neighbour < neighbours; ++neighbour) {
+                cell other;
+                size_t offsets { neighbour };
+                for_each_axis<dimensions>([&](const size_t axis) {
+                    other[axis] = c[axis] + static_cast<std::int64_t>(offsets % 3) - 1;
+                    offsets /= 3;
+                });
+                const auto bucket = bucket_of(other);
+                if (std::find(buckets.begin(), buckets.begin() + distinct, bucket) == buckets.begin() + distinct) {
+                    buckets[distinct++] = bucket;
+                }
+            }
+
+            for (size_t b { 0 }; b < distinct; ++b) {
+                for (size_t q { bucket_starts_[buckets[b]] }; q < bucket_starts_[buckets[b] + 1]; ++q) {
+                    const auto j = order_[q];
+                    if (j <= i) { continue; }
+                    double d2 { 0.0 };
+                    for_each_axis<dimensions>([&](const size_t axis) {
+                        const auto d = coordinates_[axis][q] - point[axis];
+                        d2 += d * d;
+                    });
+                    if (d2 < radius2) { f(i, j); }
+                }
+            }
+        }
+    }
+};
+
+} // namespace nps
@@ -0,0 +1,221 @@
+#pragma once
+#define FMT_HEADER_ONLY
+
+#include "fmt/format.h"
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <string>
+
+namespace nps {
+
+// Timed phases of a run. force and integration are sampled per force evaluation, render per draw,
+// io per checkpoint or trajectory frame, reorder per Morton reordering of the particles and merge
+// per search for captured pairs.
+enum class phase { force, integration, render, io, reorder, merge };
+
+enum class counter { steps, force_evaluations, pair_interactions, frames_recorded, mergers };
+
+/*
+Lock-free histogram of durations in nanoseconds.
+
+Buckets are log-linear, eight per power of two, so a percentile is known to within 1/8 of its value
+over the whole range of 64 bit nanoseconds. Recording is a few relaxed atomic adds, any thread may
+record while another one reads.
+ */
+class LatencyHistogram {
+  private:
+    static constexpr size_t sub_buckets_ = 8;
+    static constexpr size_t buckets_ = (64 - 2) * sub_buckets_;
+
+    std::array<std::atomic<std::uint64_t>, buckets_> counts_ {};
+    std::atomic<std::uint64_t> samples_ { 0 };
+    std::atomic<std::uint64_t> total_ns_ { 0 };
+    std::atomic<std::uint64_t> max_ns_ { 0 };
+
+    // Values below 8 get a bucket each, above that 3 bits of mantissa per exponent
+    static size_t bucket_of(const std::uint64_t ns) {
+        if (ns < sub_buckets_) { return static_cast<size_t>(ns); }
+        const auto exponent = static_cast<size_t>(std::bit_width(ns)) - 1;
+        const auto mantissa = static_cast<size_t>(ns >> (exponent - 3)) & (sub_buckets_ - 1);
+        return (exponent - 2) * sub_buckets_ + mantissa;
+    }
+
+    // Largest value that falls into bucket
+    static std::uint64_t bucket_upper_bound(const size_t bucket) {
+        if (bucket < sub_buckets_) { return bucket; }
+        const auto exponent = bucket / sub_buckets_ + 2;
+        const auto mantissa = bucket % sub_buckets_;
+        const auto width = std::uint64_t { 1 } << (exponent - 3);
+        return ((sub_buckets_ + mantissa) << (exponent - 3)) + (width - 1);
+    }
+
+  public:
+    LatencyHistogram() = default;
+
+    // Copies are snapshots, exact while no other thread records
+    LatencyHistogram(const LatencyHistogram& other) { *this = other; }
+
+    LatencyHistogram& operator=(const LatencyHistogram& other) {
+        for (size_t bucket { 0 }; bucket < buckets_; ++bucket) {
+            counts_[bucket].store(other.counts_[bucket].load(std::memory_order_relaxed), std::memory_order_relaxed);
+        }
+        samples_.store(other.samples(), std::memory_order_relaxed);
+        total_ns_.store(other.total_ns(), std::memory_order_relaxed);
+        max_ns_.store(other.max_ns(), std::memory_order_relaxed);
+        return *this;
+    }
+
+    void record(const std::uint64_t ns) {
+        counts_[bucket_of(ns)].fetch_add(1, std::memory_order_relaxed);
+        samples_.fetch_add(1, std::memory_order_relaxed);
+        total_ns_.fetch_add(ns, std::memory_order_relaxed);
+        auto max = max_ns_.load(std::memory_order_relaxed);
+        while (ns > max && !max_ns_.compare_exchange_weak(max, ns, std::memory_order_relaxed)) {}
+    }
+
+    std::uint64_t samples() const { return samples_.load(std::memory_order_relaxed); }
+    std::uint64_t total_ns() const { return total_ns_.load(std::memory_order_relaxed); }
+    std::uint64_t max_ns() const { return max_ns_.load(std::memory_order_relaxed); }
+
+    // Upper bound of the bucket holding the q-quantile, 0 <= q <= 1, and 0 without samples
+    std::uint64_t percentile_ns(const double q) const {
+        const auto samples = this->samples();
+        if (samples == 0) { return 0; }
+        const auto rank = std::max<std::uint64_t>(1, static_cast<std::uint64_t>(std::ceil(q * double(samples))));
+
+        std::uint64_t seen { 0 };
+        for (size_t bucket { 0 }; bucket < buckets_; ++bucket) {
+            seen += counts_[bucket].load(std::memory_order_relaxed);
+            if (seen >= rank) { return std::min(bucket_upper_bound(bucket), max_ns()); }
+        }
+        return max_ns();
+    }
+
+    void reset() {
+        for (auto& count : counts_) {
+            count.store(0, std::memory_order_relaxed);
+        }
+        samples_.store(0, std::memory_order_relaxed);
+        total_ns_.store(0, std::memory_order_relaxed);
+        max_ns_.store(0, std::memory_order_relaxed);
+    }
+};
+
+/*
+Per phase duration histograms and event counters of a simulation.
+
+Phases are timed with the steady clock at nanosecond resolution, see ScopedPhase. json() and
+prometheus() format a snapshot on demand and are the only calls that allocate.
+ */
+class StepMetrics {
+  public:
+    static constexpr std::array<const char*, 6> phase_names { "force", "integration", "render",
+                                                              "io", "reorder", "merge" };
+    static constexpr std::array<const char*, 5> counter_names { "steps", "force_evaluations", "pair_interactions",
+                                                                "frames_recorded", "mergers" };
+
+  private:
+    std::array<LatencyHistogram, phase_names.size()> phases_ {};
+    std::array<std::atomic<std::uint64_t>, counter_names.size()> counters_ {};
+
+  public:
+    // Records the time from construction to destruction into a phase
+    class ScopedPhase {
+      private:
+        StepMetrics& metrics_;
+        phase phase_;
+        std::chrono::steady_clock::time_point start_;
+
+      public:
+        ScopedPhase(StepMetrics& metrics, const phase timed_phase)
+            : metrics_(metrics), phase_(timed_phase), start_(std::chrono::steady_clock::now()) {}
+        ScopedPhase(const ScopedPhase&) = delete;
+        ScopedPhase& operator=(const ScopedPhase&) = delete;
+        ~ScopedPhase() { metrics_.record(phase_, std::chrono::steady_clock::now() - start_); }
+    };
+
+    StepMetrics() = default;
+
+    StepMetrics(const StepMetrics& other) { *this = other; }
+
+    StepMetrics& operator=(const StepMetrics& other) {
+        phases_ = other.phases_;
+        for (size_t c { 0 }; c < counters_.size(); ++c) {
+            counters_[c].store(other.counters_[c].load(std::memory_order_relaxed), std::memory_order_relaxed);
+        }
+        return *this;
+    }
+
+    ScopedPhase time(const phase timed_phase) { return { *this, timed_phase }; }
+
+    void record(const phase timed_phase, const std::chrono::nanoseconds duration) {
+        const auto ns = std::max(duration.count(), std::chrono::nanoseconds::rep { 0 });
+        phases_[static_cast<size_t>(timed_phase)].record(static_cast<std::uint64_t>(ns));
+    }
+
+    void add(const counter event, const std::uint64_t n = 1) {
+        counters_[static_cast<size_t>(event)].fetch_add(n, std::memory_order_relaxed);
+    }
+
+    const LatencyHistogram& histogram(const phase timed_phase) const {
+        return phases_[static_cast<size_t>(timed_phase)];
+    }
+
+    std::uint64_t count(const counter event) const {
+        return counters_[static_cast<size_t>(event)].load(std::memory_order_relaxed);
+    }
+
+    void reset() {
+        for (auto& histogram : phases_) {
+            histogram.reset();
+        }
+        for (auto& count : counters_) {
+            count.store(0, std::memory_order_relaxed);
+        }
+    }
+
+    // { "phases": { "force": { "samples", "total_ns", "p50_ns", "p99_ns", "max_ns" }, ... }, "counters": { ... } }
+    std::string json() const {
+        std::string out = "{\"phases\":{";
+        for (size_t p { 0 }; p < phases_.size(); ++p) {
+            const auto& histogram = phases_[p];
+            out += fmt::format("{}\"{}\":{{\"samples\":{},\"total_ns\":{},\"p50_ns\":{},\"p99_ns\":{},\"max_ns\":{}}}",
+                               p == 0 ? "" : ",", phase_names[p], histogram.samples(), histogram.total_ns(),
+                               histogram.percentile_ns(0.5), histogram.percentile_ns(0.99), histogram.max_ns());
+        }
+        out += "},\"counters\":{";
+        for (size_t c { 0 }; c < counters_.size(); ++c) {
+            out += fmt::format("{}\"{}\":{}", c == 0 ? "" : ",", counter_names[c],
+                               counters_[c].load(std::memory_order_relaxed));
+        }
+        out += "}}";
+        return out;
+    }
+
+    // Prometheus text exposition format, phases as summaries in seconds and counters as counters
+    std::string prometheus() const {
+        std::string out = "# TYPE nps_phase_seconds summary\n";
+        for (size_t p { 0 }; p < phases_.size(); ++p) {
+            const auto& histogram = phases_[p];
+            for (const auto q : { 0.5, 0.99, 1.0 }) {
+                out += fmt::format("nps_phase_seconds{{phase=\"{}\",quantile=\"{}\"}} {:.9f}\n", phase_names[p], q,
+                                   double(q < 1.0 ? histogram.percentile_ns(q) : histogram.max_ns()) * 1e-9);
+            }
+            out += fmt::format("nps_phase_seconds_sum{{phase=\"{}\"}} {:.9f}\n", phase_names[p],
+                               double(histogram.total_ns()) * 1e-9);
+            out += fmt::format("nps_phase_seconds_count{{phase=\"{}\"}} {}\n", phase_names[p], histogram.samples());
+        }
+        for (size_t c { 0 }; c < counters_.size(); ++c) {
+            out += fmt::format("# TYPE nps_{}_total counter\nnps_{}_total {}\n", counter_names[c], counter_names[c],
+                               counters_[c].load(std::memory_order_relaxed));
+        }
+        return out;
+    }
+};
+
+} // namespace nps
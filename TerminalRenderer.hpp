@@ -0,0 +1,284 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <charconv>
+#include <cmath>
+#include <cstdint>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <unistd.h>
+
+#include "ANSI.hpp"
+#include "FileIO.hpp"
+#include "ThreadPool.hpp"
+
+namespace nps {
+
+// Region of the x-y plane shown in the terminal, in raw coordinate units
+struct view_box {
+    double x_min;
+    double x_max;
+    double y_min;
+    double y_max;
+};
+
+/*
+How particles are drawn.
+points: an X in every cell that holds at least one particle.
+density: particle counts per cell on a log scale, as a character and ANSI-256 color ramp.
+ */
+enum class render_style { points, density };
+
+/*
+Character framebuffer that is drawn to a terminal by difference.
+
+A frame is drawn into the buffer with clear, plot and set_status, and present compares it with the
+frame presented before and writes only the cells that changed, each run of them behind a cursor
+position escape, with a single write(2). The first frame after a resize clears the screen and draws
+everything. The buffers are reused, so once their sizes have settled frames do not allocate.
+ */
+class TerminalRenderer {
+  private:
+    // Runs of changed cells at most this far apart are joined, rewriting the unchanged cells
+    // between them is cheaper than a cursor position escape
+    static constexpr size_t max_joined_gap_ = 6;
+
+    // Density levels 1.. as glyph and ANSI-256 color, dark blue through cyan and yellow to red
+    static constexpr std::string_view density_glyphs_ { ".:-=+*#%@" };
+    static constexpr std::array<std::uint8_t, 9> density_colors_ { 17, 19, 27, 33, 45, 118, 226, 208, 196 };
+
+    size_t width_ { 0 };
+    // Rows of the plot, the status line is one more row below them
+    size_t height_ { 0 };
+    std::vector<char> current_ {};
+    std::vector<char> previous_ {};
+    // ANSI-256 foreground color per cell, 0 for the terminal's default
+    std::vector<std::uint8_t> current_colors_ {};
+    std::vector<std::uint8_t> previous_colors_ {};
+    bool full_redraw_ { true };
+    std::string output_ {};
+
+    // Escape of every color, index 0 restoring the default
+    std::array<std::string, 256> color_escapes_ {};
+
+    // Particles per plot cell for plot_density: [thread][cell]
+    std::vector<std::uint32_t> thread_counts_ {};
+    std::vector<std::uint32_t> counts_ {};
+
+    size_t rows() const { return height_ + 1; }
+
+    void append_number(const size_t value) {
+        char digits[20];
+        const auto end = std::to_chars(digits, digits + sizeof(digits), value).ptr;
+        output_.append(digits, end);
+    }
+
+    // 1-based row and column, as the escape wants them
+    void append_cursor_position(const size_t row, const size_t column) {
+        output_ += "\033[";
+        append_number(row + 1);
+        output_ += ';';
+        append_number(column + 1);
+        output_ += 'H';
+    }
+
+    // View origin and cells per coordinate unit, so that binning a point takes no divisions
+    struct projection {
+        double x_min;
+        double y_min;
+        double x_cells_per_unit;
+        double y_cells_per_unit;
+    };
+
+    projection projection_of(const view_box& view) const {
+        return { view.x_min, view.y_min, double(width_) / (view.x_max - view.x_min),
+                 double(height_) / (view.y_max - view.y_min) };
+    }
+
+    // Cell of the plot a point falls into, false for points not strictly inside of the view
+    bool cell_of(const double x, const double y, const projection& to_cells, size_t& cell) const {
+        const auto column = (x - to_cells.x_min) * to_cells.x_cells_per_unit;
+        const auto row = (y - to_cells.y_min) * to_cells.y_cells_per_unit;
+        if (!(column > 0 && column < double(width_) && row > 0 && row < double(height_))) { return false; }
+        cell = static_cast<size_t>(row) * width_ + static_cast<size_t>(column);
+        return true;
+    }
+
+    // Two columns per coordinate unit since cells are about twice as high as wide
+    void resize_to(const view_box& view) {
+        resize(static_cast<size_t>(2.0 * (view.x_max - view.x_min)), static_cast<size_t>(view.y_max - view.y_min));
+    }
+
+  public:
+    TerminalRenderer() {
+        color_escapes_[0] = ansi::str(ansi::fg_default<char, std::char_traits<char>>);
+        for (int n { 1 }; n < 256; ++n) {
+            color_escapes_[static_cast<size_t>(n)] = ansi::str(ansi::fg_color(n));
+        }
+    }
+
+    // Plot size in cells, plus a status line of the same width below it
+    void resize(const size_t width, const size_t height) {
+        if (width == width_ && height == height_) { return; }
+        width_ = width;
+        height_ = height;
+        current_.assign(width_ * rows(), ' ');
+        previous_.assign(width_ * rows(), ' ');
+        current_colors_.assign(width_ * rows(), 0);
+        previous_colors_.assign(width_ * rows(), 0);
+        // Worst case of a full redraw: a color escape in front of every cell and every row behind its own escape
+        output_.reserve(16 * width_ * rows() + rows() * 16 + 32);
+        full_redraw_ = true;
+    }
+
+    size_t width() const { return width_; }
+    size_t height() const { return height_; }
+
+    void clear() {
+        std::fill(current_.begin(), current_.begin() + width_ * height_, ' ');
+        std::fill(current_colors_.begin(), current_colors_.begin() + width_ * height_, 0);
+    }
+
+    // Column x and row y of the plot, row 0 at the top, color 0 for the default
+    void plot(const size_t x, const size_t y, const char glyph, const std::uint8_t color = 0) {
+        current_[y * width_ + x] = glyph;
+        current_colors_[y * width_ + x] = color;
+    }
+
+    // Resizes to the view and replaces the plot with an X for every point strictly inside of it
+    void plot_points(std::span<const double> x, std::span<const double> y, const view_box& view) {
+        resize_to(view);
+        clear();
+        const auto to_cells = projection_of(view);
+        size_t cell;
+        for (size_t i { 0 }; i < x.size(); ++i) {
+            if (cell_of(x[i], y[i], to_cells, cell)) { current_[cell] = 'X'; }
+        }
+    }
+
+    /*
+    Resizes to the view and replaces the plot with the particle density. Every thread of pool counts its
+    share of the points into its own bins, which are then summed per cell. Counts are shaded on a log scale
+    between one particle and the densest cell of the frame, so the ramp adapts from hundreds to millions.
+     */
+    void plot_density(std::span<const double> x, std::span<const double> y, const view_box& view,
+                      ThreadPool& pool) {
+        resize_to(view);
+        clear();
+        const auto points = x.size();
+        const auto cells = width_ * height_;
+        const auto threads = pool.size();
+        const auto to_cells = projection_of(view);
+        thread_counts_.resize(threads * cells);
+        counts_.resize(cells);
+
+        pool.run([&](const size_t t) {
+            const auto counts_t = thread_counts_.data() + t * cells;
+            std::fill(counts_t, counts_t + cells, 0);
+            size_t cell;
+            for (size_t i { points * t / threads }; i < points * (t + 1) / threads; ++i) {
+                if (cell_of(x[i], y[i], to_cells, cell)) { ++counts_t[cell]; }
+            }
+        });
+
+        std::uint32_t max_count { 0 };
+        for (size_t cell { 0 }; cell < cells; ++cell) {
+            std::uint32_t count { 0 };
+            for (size_t t { 0 }; t < threads; ++t) {
+                count += thread_counts_[t * cells + cell];
+            }
+            counts_[cell] = count;
+            max_count = std::max(max_count, count);
+        }
+        if (max_count == 0) { return; }
+
+        // A single particle gets the first level and the densest cell the last
+        const auto levels = density_glyphs_.size();
+        const auto scale = max_count > 1 ? double(levels - 1) / std::log(double(max_count)) : 0.0;
+        for (size_t cell { 0 }; cell < cells; ++cell) {
+            if (counts_[cell] == 0) { continue; }
+            const auto level = std::min(levels - 1, static_cast<size_t>(std::log(double(counts_[cell])) * scale + 0.5));
+            current_[cell] = density_glyphs_[level];
+            current_colors_[cell] = density_colors_[level];
+        }
+    }
+
+    void plot(std::span<const double> x, std::span<const double> y, const view_box& view, const render_style style,
+              ThreadPool& pool) {
+        if (style == render_style::density) {
+            plot_density(x, y, view, pool);
+        } else {
+            plot_points(x, y, view);
+        }
+    }
+
+    // Replaces the status line, cut or padded to the width
+    void set_status(const std::string_view text) {
+        const auto status = current_.begin() + width_ * height_;
+        const auto length = std::min(text.size(), width_);
+        std::copy_n(text.begin(), length, status);
+        std::fill(status + length, status + width_, ' ');
+    }
+
+    // Writes the changed cells to fd, false when the write failed
+    bool present(const int fd = STDOUT_FILENO) {
+        output_.clear();
+        if (full_redraw_) {
+            // Clear the screen, the whole frame is different from it
+            output_ += "\033[2J";
+            std::fill(previous_.begin(), previous_.end(), '\0');
+            full_redraw_ = false;
+        }
+
+        // Color the terminal is writing with, unknown at first
+        int color { -1 };
+        const auto changed = [&](const size_t cell) {
+            return current_[cell] != previous_[cell] || current_colors_[cell] != previous_colors_[cell];
+        };
+
+        for (size_t row { 0 }; row < rows(); ++row) {
+            const auto line = row * width_;
+            size_t column { 0 };
+            while (column < width_) {
+                if (!changed(line + column)) {
+                    ++column;
+                    continue;
+                }
+
+                // A run of changed cells, extended over short unchanged gaps
+                auto end = column + 1;
+                size_t last_changed { column };
+                while (end < width_ && end - last_changed <= max_joined_gap_) {
+                    if (changed(line + end)) { last_changed = end; }
+                    ++end;
+                }
+
+                append_cursor_position(row, column);
+                for (auto cell = line + column; cell <= line + last_changed; ++cell) {
+                    if (current_colors_[cell] != color) {
+                        color = current_colors_[cell];
+                        output_ += color_escapes_[current_colors_[cell]];
+                    }
+                    output_ += current_[cell];
+                }
+                column = last_changed + 1;
+            }
+        }
+        if (color > 0) { output_ += color_escapes_[0]; }
+        // Park the cursor below the frame
+        append_cursor_position(rows(), 0);
+
+        std::copy(current_.begin(), current_.end(), previous_.begin());
+        std::copy(current_colors_.begin(), current_colors_.end(), previous_colors_.begin());
+        return write_all(fd, output_.data(), output_.size());
+    }
+
+    // Draws everything again on the next present, e.g. after something else wrote to the terminal
+    void invalidate() { full_redraw_ = true; }
+};
+
+} // namespace nps
@@ -0,0 +1,161 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+namespace nps {
+
+/*
+Fork-join pool of persistent worker threads.
+
+run(f) calls f(thread_index) once on every thread, the calling thread included as
+thread 0, and returns when all of them have finished. The task is passed by address,
+so dispatching does not allocate.
+ */
+class ThreadPool {
+  private:
+    std::vector<std::thread> workers_ {};
+
+    std::mutex mutex_ {};
+    std::condition_variable start_condition_ {};
+    std::condition_variable done_condition_ {};
+
+    void (*task_)(void*, size_t) { nullptr };
+    void* task_context_ { nullptr };
+    size_t generation_ { 0 };
+    size_t running_ { 0 };
+    bool stopping_ { false };
+
+    // State of arrive_and_wait
+    std::atomic<size_t> arrived_ { 0 };
+    std::atomic<size_t> barrier_phase_ { 0 };
+
+    void worker_loop(const size_t thread_index, size_t seen_generation) {
+        std::unique_lock lock(mutex_);
+        while (true) {
+            start_condition_.wait(lock, [&] { return stopping_ || generation_ != seen_generation; });
+            if (stopping_) { return; }
+            seen_generation = generation_;
+
+            const auto task = task_;
+            const auto context = task_context_;
+            lock.unlock();
+            task(context, thread_index);
+            lock.lock();
+
+            if (--running_ == 0) { done_condition_.notify_one(); }
+        }
+    }
+
+    void start_workers(const size_t threads) {
+        for (size_t t { 1 }; t < threads; ++t) {
+            workers_.emplace_back([this, t, generation = generation_] { worker_loop(t, generation); });
+        }
+    }
+
+    void stop_workers() {
+        {
+            std::lock_guard lock(mutex_);
+            stopping_ = true;
+        }
+        start_condition_.notify_all();
+        for (auto& worker : workers_) {
+            worker.join();
+        }
+        workers_.clear();
+        stopping_ = false;
+    }
+
+  public:
+    static size_t default_threads() { return std::max(1u, std::thread::hardware_concurrency()); }
+
+    // Only the calling thread until resize asks for more, so that owning a pool costs nothing
+    explicit ThreadPool(const size_t threads = 1) { start_workers(threads); }
+
+    // Copies and moves take over the number of threads, every pool keeps workers of its own
+    ThreadPool(const ThreadPool& other) : ThreadPool(other.size()) {}
+    ThreadPool(ThreadPool&& other) : ThreadPool(other.size()) { other.resize(1); }
+
+    ThreadPool& operator=(const ThreadPool& other) {
+        resize(other.size());
+        return *this;
+    }
+
+    ThreadPool& operator=(ThreadPool&& other) {
+        if (this == &other) { return *this; }
+        resize(other.size());
+        other.resize(1);
+        return *this;
+    }
+
+    ~ThreadPool() { stop_workers(); }
+
+    size_t size() const { return workers_.size() + 1; }
+
+    void resize(const size_t threads) {
+        if (std::max<size_t>(threads, 1) == size()) { return; }
+        stop_workers();
+        start_workers(threads);
+    }
+
+    template <typename F>
+    void run(F&& f) {
+        if (workers_.empty()) {
+            f(size_t { 0 });
+            return;
+        }
+
+        {
+            std::lock_guard lock(mutex_);
+            task_ = [](void* context, size_t thread_index) {
+                (*static_cast<std::remove_reference_t<F>*>(context))(thread_index);
+            };
+            task_context_ = const_cast<void*>(static_cast<const void*>(std::addressof(f)));
+            running_ = workers_.size();
+            ++generation_;
+        }
+        start_condition_.notify_all();
+
+        f(size_t { 0 });
+
+        std::unique_lock lock(mutex_);
+        done_condition_.wait(lock, [&] { return running_ == 0; });
+    }
+
+    /*
+    Barrier of the threads inside run(): returns once all size() of them have called it, after the last one
+    to arrive has called completion(). It is reused from call to call, so unlike std::barrier it does not
+    allocate. Calling it outside of run(), or from only some of the threads, blocks forever.
+     */
+    template <typename F>
+    void arrive_and_wait(F&& completion) {
+        const auto phase = barrier_phase_.load(std::memory_order_acquire);
+        if (arrived_.fetch_add(1, std::memory_order_acq_rel) + 1 < size()) {
+            barrier_phase_.wait(phase, std::memory_order_acquire);
+            return;
+        }
+        completion();
+        arrived_.store(0, std::memory_order_relaxed);
+        barrier_phase_.fetch_add(1, std::memory_order_release);
+        barrier_phase_.notify_all();
+    }
+
+    // Splits [0, n) into one contiguous chunk per thread and calls f(begin, end, thread_index)
+    template <typename F>
+    void parallel_for(const size_t n, F&& f) {
+        const auto threads = size();
+        run([&](const size_t t) {
+            const auto begin = n * t / threads;
+            const auto end = n * (t + 1) / threads;
+            if (begin < end) { f(begin, end, t); }
+        });
+    }
+};
+
+} // namespace nps
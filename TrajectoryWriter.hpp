@@ -0,0 +1,205 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <span>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "Axes.hpp"
+#include "FileIO.hpp"
+
+namespace nps {
+
+/*
+Trajectory file layout, version 2, in the byte order of the machine that wrote it:
+
+    TrajectoryHeader                              64 bytes
+    then one chunk per frame:
+        TrajectoryFrameHeader                     32 bytes
+        coordinates, one column per axis          particles doubles each
+        speeds, one column per axis               particles doubles each
+        masses                                    particles doubles
+        particle IDs                              particles uint64s
+
+Every chunk carries its own particle count, so a reader can walk the file chunk by chunk
+and a run cut short leaves at most a truncated last chunk. Rows are matched across frames by
+their IDs, as mergers drop particles and change the masses of the bodies that absorbed them.
+Version 1 frames had neither masses nor IDs.
+ */
+struct TrajectoryHeader {
+    static constexpr std::array<char, 8> expected_magic { 'N', 'P', 'S', 'T', 'R', 'A', 'J', '\0' };
+    static constexpr std::uint32_t current_version = 2;
+
+    std::array<char, 8> magic;
+    std::uint32_t version;
+    std::uint32_t dimensions;
+    // Size in SI of the coordinate, mass, time, speed and acceleration units, as in CheckpointHeader
+    std::array<double, 5> units_in_si;
+    std::uint64_t reserved;
+};
+static_assert(sizeof(TrajectoryHeader) == 64 && std::is_trivially_copyable_v<TrajectoryHeader>);
+
+struct TrajectoryFrameHeader {
+    static constexpr std::array<char, 8> expected_magic { 'N', 'P', 'S', 'F', 'R', 'A', 'M', 'E' };
+
+    std::array<char, 8> magic;
+    std::uint64_t frame;
+    std::uint64_t particles;
+    // In the time unit
+    double simulation_time;
+};
+static_assert(sizeof(TrajectoryFrameHeader) == 32 && std::is_trivially_copyable_v<TrajectoryFrameHeader>);
+
+/*
+Appends frames to a trajectory file from a dedicated I/O thread.
+
+write_frame copies the coordinates, speeds, masses and IDs into the next free slot of a ring and returns,
+the I/O thread writes the slots out in order. When every slot still waits for the disk, write_frame
+blocks until one is free, which is the backpressure that keeps memory bounded when the disk falls
+behind. Slots keep their buffers, so frames of an unchanged particle count do not allocate.
+ */
+template <size_t dimensions>
+class TrajectoryWriter {
+  private:
+    struct Slot {
+        TrajectoryFrameHeader header;
+        // [column][particle], coordinates, speeds and then masses
+        std::vector<double> columns;
+        std::vector<std::uint64_t> ids;
+    };
+
+    int fd_ { -1 };
+    bool failed_ { false };
+    std::uint64_t frames_ { 0 };
+
+    std::vector<Slot> slots_;
+    // Slots [first_full_, first_full_ + full_) wait for the I/O thread
+    size_t first_full_ { 0 };
+    size_t full_ { 0 };
+    bool stopping_ { false };
+
+    std::mutex mutex_ {};
+    std::condition_variable full_condition_ {};
+    std::condition_variable free_condition_ {};
+    std::thread io_thread_ {};
+
+    void io_loop() {
+        std::unique_lock lock(mutex_);
+        while (true) {
+            full_condition_.wait(lock, [&] { return stopping_ || full_ > 0; });
+            if (full_ == 0) { return; }
+
+            // The stepping thread does not touch full slots, so the write happens without the lock
+            auto& slot = slots_[first_full_];
+            const auto failed = failed_;
+            lock.unlock();
+            const auto ok = failed || (write_all(fd_, &slot.header, sizeof(slot.header)) &&
+                                       write_all(fd_, slot.columns.data(), slot.columns.size() * sizeof(double)) &&
+                                       write_all(fd_, slot.ids.data(), slot.ids.size() * sizeof(std::uint64_t)));
+            lock.lock();
+
+            failed_ = failed_ || !ok;
+            first_full_ = (first_full_ + 1) % slots_.size();
+            --full_;
+            free_condition_.notify_all();
+        }
+    }
+
+  public:
+    TrajectoryWriter(const std::string& path, const std::array<double, 5>& units_in_si, const size_t slots = 4)
+        : slots_(std::max<size_t>(slots, 1)) {
+        fd_ = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        TrajectoryHeader header {};
+        header.magic = TrajectoryHeader::expected_magic;
+        header.version = TrajectoryHeader::current_version;
+        header.dimensions = dimensions;
+        header.units_in_si = units_in_si;
+        failed_ = fd_ < 0 || !write_all(fd_, &header, sizeof(header));
+
+        io_thread_ = std::thread([this] { io_loop(); });
+    }
+
+    TrajectoryWriter(const TrajectoryWriter&) = delete;
+    TrajectoryWriter& operator=(const TrajectoryWriter&) = delete;
+
+    // Writes out the frames still in the ring before closing the file
+    ~TrajectoryWriter() {
+        {
+            std::lock_guard lock(mutex_);
+            stopping_ = true;
+        }
+        full_condition_.notify_one();
+        io_thread_.join();
+        if (fd_ >= 0) { ::close(fd_); }
+    }
+
+    // ids holds the ID of every particle of the columns. Particle k of the frame is particle order[k] of the
+    // columns when order is given, e.g. to keep a stable particle order in the file while the simulation
+    // reorders its storage, and the frame then has as many particles as order
+    void write_frame(const double simulation_time, const std::array<std::span<const double>, dimensions>& coordinates,
+                     const std::array<std::span<const double>, dimensions>& speeds, std::span<const double> masses,
+                     std::span<const size_t> ids, std::span<const size_t> order = {}) {
+        const auto particles = order.empty() ? coordinates[0].size() : order.size();
+
+        std::unique_lock lock(mutex_);
+        free_condition_.wait(lock, [&] { return full_ < slots_.size(); });
+        auto& slot = slots_[(first_full_ + full_) % slots_.size()];
+        lock.unlock();
+
+        slot.header = { TrajectoryFrameHeader::expected_magic, frames_++, particles, simulation_time };
+        slot.columns.resize((2 * dimensions + 1) * particles);
+        slot.ids.resize(particles);
+        const auto mass_column = slot.columns.data() + 2 * dimensions * particles;
+        if (order.empty()) {
+            std::ranges::copy(masses, mass_column);
+            std::ranges::copy(ids, slot.ids.begin());
+        } else {
+            for (size_t k { 0 }; k < particles; ++k) {
+                mass_column[k] = masses[order[k]];
+                slot.ids[k] = ids[order[k]];
+            }
+        }
+        for_each_axis<dimensions>([&](const size_t axis) {
+            const auto coordinate_column = slot.columns.data() + axis * particles;
+            const auto speed_column = slot.columns.data() + (dimensions + axis) * particles;
+            if (order.empty()) {
+                std::ranges::copy(coordinates[axis], coordinate_column);
+                std::ranges::copy(speeds[axis], speed_column);
+                return;
+            }
+            for (size_t k { 0 }; k < particles; ++k) {
+                coordinate_column[k] = coordinates[axis][order[k]];
+                speed_column[k] = speeds[axis][order[k]];
+            }
+        });
+
+        lock.lock();
+        ++full_;
+        full_condition_.notify_one();
+    }
+
+    // Blocks until every frame handed to write_frame is written
+    void flush() {
+        std::unique_lock lock(mutex_);
+        free_condition_.wait(lock, [&] { return full_ == 0; });
+    }
+
+    // False once opening the file or any write failed, later frames are then dropped
+    bool good() {
+        std::lock_guard lock(mutex_);
+        return !failed_;
+    }
+
+    std::uint64_t frames() const { return frames_; }
+};
+
+} // namespace nps
@@ -0,0 +1,350 @@
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <ctime>
+#include <span>
+#include <vector>
+
+#include <pthread.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+namespace nps {
+
+/*
+Message passing between the ranks of a distributed run, see DomainDecomposition.hpp.
+
+The one primitive is a collective all-to-all exchange of double arrays of any length, called by every
+rank in the same order. Over MPI that is an MPI_Alltoall of the lengths followed by an MPI_Alltoallv
+of the values, so an MPI transport only has to implement exchange. Calls return false when the
+transport failed, after which the run cannot go on.
+ */
+class Transport {
+  private:
+    std::vector<std::vector<double>> gather_outgoing_ {};
+    std::vector<std::vector<double>> gather_incoming_ {};
+
+  public:
+    virtual ~Transport() = default;
+
+    virtual size_t rank() const = 0;
+    virtual size_t ranks() const = 0;
+
+    // Sends outgoing[r] to every rank r and receives incoming[r] from every rank r, this one included
+    virtual bool exchange(const std::vector<std::vector<double>>& outgoing,
+                          std::vector<std::vector<double>>& incoming) = 0;
+
+    // The values of every rank one after the other in rank order, into all
+    bool all_gather(std::span<const double> values, std::vector<double>& all) {
+        gather_outgoing_.resize(ranks());
+        for (auto& outgoing : gather_outgoing_) {
+            outgoing.assign(values.begin(), values.end());
+        }
+        if (!exchange(gather_outgoing_, gather_incoming_)) { return false; }
+        all.clear();
+        for (const auto& incoming : gather_incoming_) {
+            all.insert(all.end(), incoming.begin(), incoming.end());
+        }
+        return true;
+    }
+};
+
+/*
+Transport between the processes of one machine, forked from a common parent by run_ranks.
+
+Every rank owns an outbox, a memfd that only it writes and the others map. An exchange writes the
+lengths and then all outgoing arrays into the own outbox, growing it when they do not fit, waits on a
+process shared barrier, copies its arrays out of every outbox and waits again before any outbox is
+reused. The outboxes and the barrier exist before the fork, so the ranks find them without names and
+nothing is left behind in /dev/shm by a rank that dies.
+
+The outbox header also holds whether the rank could write its arrays and whether it could read the
+others', and every rank ANDs these words after the barriers, so an exchange fails on all ranks or on
+none. Ranks waiting on the barrier check every poll_ns_ that the others still run, rank 0 by polling
+its children and the children by their parent, and a rank that finds one dead aborts the barrier,
+after which every exchange of every rank fails instead of waiting forever.
+ */
+class SharedMemoryTransport final : public Transport {
+  private:
+    struct outbox {
+        int fd { -1 };
+        // This process's mapping of the outbox
+        void* data { MAP_FAILED };
+        size_t size { 0 };
+    };
+
+    // Barrier of all ranks in memory shared across the fork, the mutex robust against a rank dying with it
+    struct barrier {
+        pthread_mutex_t mutex;
+        pthread_cond_t condition;
+        std::uint64_t arrived;
+        std::uint64_t generation;
+        bool aborted;
+    };
+
+    // The status words that precede the lengths in an outbox header, nonzero when the rank could write
+    // its arrays and when it could read its arrays from every outbox
+    static constexpr size_t wrote_word_ = 0;
+    static constexpr size_t read_word_ = 1;
+    static constexpr size_t status_words_ = 2;
+    static constexpr long poll_ns_ = 100'000'000;
+
+    size_t ranks_;
+    size_t rank_ { 0 };
+    std::vector<outbox> outboxes_ {};
+    barrier* barrier_ { static_cast<barrier*>(MAP_FAILED) };
+    // Whether this process created the transport, and so tears down the barrier
+    pid_t owner_ { ::getpid() };
+    // The ranks forked by run_ranks, only known to rank 0
+    std::vector<pid_t> children_ {};
+
+    // The status words and the lengths of the arrays for every rank precede the arrays themselves
+    size_t header_bytes() const { return (status_words_ + ranks_) * sizeof(std::uint64_t); }
+
+    std::uint64_t* status_in(const size_t from) const { return static_cast<std::uint64_t*>(outboxes_[from].data); }
+
+    const std::uint64_t* lengths_in(const size_t from) const { return status_in(from) + status_words_; }
+
+    double* values_in(const size_t from) const {
+        return reinterpret_cast<double*>(static_cast<std::byte*>(outboxes_[from].data) + header_bytes());
+    }
+
+    // Maps at least bytes of the outbox of rank from, as far as its file currently reaches
+    bool map_outbox(const size_t from, const size_t bytes) {
+        auto& box = outboxes_[from];
+        if (box.data != MAP_FAILED && box.size >= bytes) { return true; }
+        struct stat status;
+        if (::fstat(box.fd, &status) != 0 || static_cast<size_t>(status.st_size) < bytes) { return false; }
+        const auto size = static_cast<size_t>(status.st_size);
+        const auto data = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, box.fd, 0);
+        if (data == MAP_FAILED) { return false; }
+        if (box.data != MAP_FAILED) { ::munmap(box.data, box.size); }
+        box.data = data;
+        box.size = size;
+        return true;
+    }
+
+    // Grows the own outbox to hold bytes, at least doubling it so that growing stays rare
+    bool reserve_outbox(const size_t bytes) {
+        auto& box = outboxes_[rank_];
+        if (box.size >= bytes) { return true; }
+        const auto size = std::max(bytes, 2 * box.size);
+        return ::ftruncate(box.fd, static_cast<off_t>(size)) == 0 && map_outbox(rank_, size);
+    }
+
+    // True when every rank set the status word
+    bool all_set(const size_t word) const {
+        for (size_t from { 0 }; from < ranks_; ++from) {
+            if (status_in(from)[word] == 0) { return false; }
+        }
+        return true;
+    }
+
+    // Whether the other ranks still run, as far as this one can tell
+    bool others_alive() const {
+        if (rank_ != 0) { return ::getppid() == owner_; }
+        for (const auto child : children_) {
+            siginfo_t info {};
+            // WNOWAIT leaves the exit status for run_ranks to collect
+            if (::waitid(P_PID, static_cast<id_t>(child), &info, WEXITED | WNOHANG | WNOWAIT) != 0 ||
+                info.si_pid != 0) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Locks the barrier, which is aborted when its last holder died with it
+    void lock_barrier() {
+        if (::pthread_mutex_lock(&barrier_->mutex) == EOWNERDEAD) {
+            ::pthread_mutex_consistent(&barrier_->mutex);
+            barrier_->aborted = true;
+        }
+    }
+
+    // Waits for every rank, false when the barrier was aborted before they all arrived
+    bool wait() {
+        lock_barrier();
+        auto& shared = *barrier_;
+        const auto generation = shared.generation;
+        if (!shared.aborted && ++shared.arrived == ranks_) {
+            shared.arrived = 0;
+            ++shared.generation;
+            ::pthread_cond_broadcast(&shared.condition);
+        }
+        while (!shared.aborted && shared.generation == generation) {
+            timespec deadline {};
+            ::clock_gettime(CLOCK_MONOTONIC, &deadline);
+            deadline.tv_nsec += poll_ns_;
+            deadline.tv_sec += deadline.tv_nsec / 1'000'000'000;
+            deadline.tv_nsec %= 1'000'000'000;
+            const auto waited = ::pthread_cond_timedwait(&shared.condition, &shared.mutex, &deadline);
+            if (waited == EOWNERDEAD) { ::pthread_mutex_consistent(&shared.mutex); }
+            if (waited == EOWNERDEAD || (waited == ETIMEDOUT && !others_alive())) {
+                shared.aborted = true;
+                ::pthread_cond_broadcast(&shared.condition);
+            }
+        }
+        const auto passed = shared.generation != generation;
+        ::pthread_mutex_unlock(&shared.mutex);
+        return passed;
+    }
+
+  public:
+    // Creates the outboxes and the barrier of ranks processes, before run_ranks forks them
+    explicit SharedMemoryTransport(const size_t ranks) : ranks_ { ranks } {
+        assert(ranks > 0);
+        outboxes_.resize(ranks);
+        for (auto& box : outboxes_) {
+            box.fd = ::memfd_create("nps-outbox", MFD_CLOEXEC);
+            const auto size = std::max(header_bytes(), size_t { 4096 });
+            if (box.fd >= 0 && ::ftruncate(box.fd, static_cast<off_t>(size)) == 0) {
+                box.size = size;
+                box.data = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, box.fd, 0);
+            }
+        }
+
+        const auto shared = ::mmap(nullptr, sizeof(barrier), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (shared == MAP_FAILED) { return; }
+        barrier_ = static_cast<barrier*>(shared);
+        *barrier_ = { {}, {}, 0, 0, false };
+
+        pthread_mutexattr_t mutex_attributes;
+        ::pthread_mutexattr_init(&mutex_attributes);
+        ::pthread_mutexattr_setpshared(&mutex_attributes, PTHREAD_PROCESS_SHARED);
+        ::pthread_mutexattr_setrobust(&mutex_attributes, PTHREAD_MUTEX_ROBUST);
+        ::pthread_mutex_init(&barrier_->mutex, &mutex_attributes);
+        ::pthread_mutexattr_destroy(&mutex_attributes);
+
+        pthread_condattr_t condition_attributes;
+        ::pthread_condattr_init(&condition_attributes);
+        ::pthread_condattr_setpshared(&condition_attributes, PTHREAD_PROCESS_SHARED);
+        ::pthread_condattr_setclock(&condition_attributes, CLOCK_MONOTONIC);
+        ::pthread_cond_init(&barrier_->condition, &condition_attributes);
+        ::pthread_condattr_destroy(&condition_attributes);
+    }
+
+    SharedMemoryTransport(const SharedMemoryTransport&) = delete;
+    SharedMemoryTransport& operator=(const SharedMemoryTransport&) = delete;
+
+    ~SharedMemoryTransport() override {
+        for (auto& box : outboxes_) {
+            if (box.data != MAP_FAILED) { ::munmap(box.data, box.size); }
+            if (box.fd >= 0) { ::close(box.fd); }
+        }
+        if (barrier_ == MAP_FAILED) { return; }
+        if (::getpid() == owner_) {
+            ::pthread_cond_destroy(&barrier_->condition);
+            ::pthread_mutex_destroy(&barrier_->mutex);
+        }
+        ::munmap(barrier_, sizeof(barrier));
+    }
+
+    // Whether the outboxes and the barrier were created
+    bool valid() const {
+        return barrier_ != MAP_FAILED &&
+               std::ranges::all_of(outboxes_, [](const outbox& box) { return box.data != MAP_FAILED; });
+    }
+
+    size_t rank() const override { return rank_; }
+    size_t ranks() const override { return ranks_; }
+
+    /*
+    Runs f(transport) on ranks() processes, this one as rank 0 and ranks() - 1 forked children, which exit
+    with the result of f and never return. True when f returned true on every rank. Start threads inside f,
+    the simulations and their thread pools included, as only the forking thread survives a fork.
+     */
+    template <typename F>
+    bool run_ranks(F&& f) {
+        if (!valid()) { return false; }
+        // Children exit without flushing, and would print what is still buffered here a second time
+        std::fflush(nullptr);
+        children_.clear();
+        barrier_->arrived = 0;
+        barrier_->aborted = false;
+        for (size_t rank { 1 }; rank < ranks_; ++rank) {
+            const auto pid = ::fork();
+            if (pid == 0) {
+                rank_ = rank;
+                children_.clear();
+                const auto succeeded = f(static_cast<Transport&>(*this));
+                std::fflush(nullptr);
+                ::_exit(succeeded ? 0 : 1);
+            }
+            if (pid < 0) {
+                // The children started so far would wait on the barrier until they find it aborted
+                for (const auto child : children_) {
+                    ::kill(child, SIGKILL);
+                    ::waitpid(child, nullptr, 0);
+                }
+                children_.clear();
+                return false;
+            }
+            children_.push_back(pid);
+        }
+
+        rank_ = 0;
+        auto succeeded = f(static_cast<Transport&>(*this));
+        for (const auto child : children_) {
+            int status { 0 };
+            succeeded = ::waitpid(child, &status, 0) == child && WIFEXITED(status) && WEXITSTATUS(status) == 0 &&
+                        succeeded;
+        }
+        return succeeded;
+    }
+
+    bool exchange(const std::vector<std::vector<double>>& outgoing,
+                  std::vector<std::vector<double>>& incoming) override {
+        assert(outgoing.size() == ranks_);
+        size_t values { 0 };
+        for (const auto& values_for_rank : outgoing) {
+            values += values_for_rank.size();
+        }
+
+        // Without the room to write, the other ranks still need this one at both barriers
+        const auto wrote = reserve_outbox(header_bytes() + values * sizeof(double));
+        const auto status = status_in(rank_);
+        const auto lengths = status + status_words_;
+        status[wrote_word_] = wrote;
+        auto destination = values_in(rank_);
+        for (size_t to { 0 }; to < ranks_; ++to) {
+            lengths[to] = wrote ? outgoing[to].size() : 0;
+            if (wrote) { destination = std::ranges::copy(outgoing[to], destination).out; }
+        }
+        if (!wait()) { return false; }
+
+        // A rank that could not write leaves the others nothing consistent to read
+        const auto all_wrote = all_set(wrote_word_);
+        auto read = all_wrote;
+        incoming.resize(ranks_);
+        for (size_t from { 0 }; from < ranks_; ++from) {
+            incoming[from].clear();
+            if (!all_wrote) { continue; }
+            size_t offset { 0 };
+            for (size_t to { 0 }; to < rank_; ++to) {
+                offset += lengths_in(from)[to];
+            }
+            const auto length = lengths_in(from)[rank_];
+            if (!map_outbox(from, header_bytes() + (offset + length) * sizeof(double))) {
+                read = false;
+                continue;
+            }
+            incoming[from].assign(values_in(from) + offset, values_in(from) + offset + length);
+        }
+        // The read words are only written again after the first barrier of the next exchange,
+        // which every rank reaches after it has read them here
+        status[read_word_] = read;
+        if (!wait()) { return false; }
+        return all_set(read_word_);
+    }
+};
+
+} // namespace nps
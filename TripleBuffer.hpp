@@ -0,0 +1,42 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+
+namespace nps {
+
+/*
+Wait-free hand-over of the latest value from one writer thread to one reader thread.
+
+The writer fills back() and publishes it, which swaps it with the middle buffer. The reader's acquire
+swaps the middle buffer with front() when something was published since its last acquire. Neither
+side ever waits for the other: a slow reader skips values, and a fast reader keeps reading the last one.
+ */
+template <typename T>
+class TripleBuffer {
+  private:
+    // Set in middle_ when the middle buffer was published after the reader's last acquire
+    static constexpr std::uint8_t fresh_bit_ = 4;
+
+    std::array<T, 3> buffers_ {};
+    alignas(64) std::atomic<std::uint8_t> middle_ { 1 };
+    // Owned by the writer and the reader respectively
+    alignas(64) std::uint8_t back_ { 0 };
+    alignas(64) std::uint8_t front_ { 2 };
+
+  public:
+    // Writer side
+    T& back() { return buffers_[back_]; }
+    void publish() { back_ = middle_.exchange(back_ | fresh_bit_, std::memory_order_acq_rel) & ~fresh_bit_; }
+
+    // Reader side, true when front() changed
+    bool acquire() {
+        if ((middle_.load(std::memory_order_relaxed) & fresh_bit_) == 0) { return false; }
+        front_ = middle_.exchange(front_, std::memory_order_acq_rel) & ~fresh_bit_;
+        return true;
+    }
+    const T& front() const { return buffers_[front_]; }
+};
+
+} // namespace nps
@@ -0,0 +1,153 @@
+#define FMT_HEADER_ONLY
+#include "fmt/format.h"
+
+#include <array>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "NewtonPointSimulation.hpp"
+
+/*
+Headless benchmark of every engine over particle counts and thread counts, printed as JSON.
+
+    nps_benchmark [max particles = 1000000] [seconds per run = 0.5]
+
+Initial conditions come from a fixed seed and keep the density constant as N grows, so the
+short range engine sees the same neighbourhood sizes at every N. pairs_per_second counts the
+N (N - 1) / 2 pairs of direct summation per step for every engine, which makes the approximate
+engines comparable with the direct ones, while interactions_per_second is the pair_interactions counter
+of StepMetrics, the interactions an engine actually evaluated. peak_rss_kb is the high water mark of the run, reset
+between runs through /proc/self/clear_refs.
+ */
+
+namespace {
+
+using simulation = nps::NewtonPointSimulation<units::isq::si::metre, units::isq::si::kilogram, units::isq::si::second,
+                                              units::isq::si::metre_per_second, units::isq::si::metre_per_second_sq>;
+
+struct engine_case {
+    nps::engine engine;
+    const char* name;
+    // O(N^2) engines stop early, a step at 10^6 particles would take hours
+    size_t max_particles;
+    bool threaded;
+};
+
+constexpr std::array engine_cases {
+    engine_case { nps::engine::cpu_1, "cpu_1", 10'000, false },
+    engine_case { nps::engine::simd, "simd", 100'000, false },
+    engine_case { nps::engine::cpu_threads, "cpu_threads", 100'000, true },
+    engine_case { nps::engine::barnes_hut, "barnes_hut", 1'000'000, false },
+    engine_case { nps::engine::fmm, "fmm", 1'000'000, false },
+    engine_case { nps::engine::particle_mesh, "particle_mesh", 1'000'000, true },
+    engine_case { nps::engine::short_range, "short_range", 1'000'000, true },
+};
+
+void reset_peak_rss() { std::ofstream("/proc/self/clear_refs") << "5"; }
+
+size_t peak_rss_kb() {
+    std::ifstream status("/proc/self/status");
+    std::string key;
+    while (status >> key) {
+        if (key == "VmHWM:") {
+            size_t kb { 0 };
+            status >> kb;
+            return kb;
+        }
+        status.ignore(256, '\n');
+    }
+    return 0;
+}
+
+void set_initial_conditions(simulation& simulator, const size_t particles) {
+    std::mt19937 gen(42);
+    // 10 particles per unit area at every N
+    const auto half_width = std::sqrt(double(particles) / 10.0) / 2.0;
+    std::uniform_real_distribution<> coordinate_dist(-half_width, half_width);
+    std::uniform_real_distribution<> speed_dist(-0.1, 0.1);
+    std::uniform_real_distribution<> mass_dist(1.0, 1.1);
+
+    std::array<std::vector<double>, 2> coordinates;
+    std::array<std::vector<double>, 2> speeds;
+    std::vector<double> masses;
+    for (size_t i { 0 }; i < particles; ++i) {
+        for (size_t axis { 0 }; axis < 2; ++axis) {
+            coordinates[axis].push_back(coordinate_dist(gen));
+            speeds[axis].push_back(speed_dist(gen));
+        }
+        masses.push_back(mass_dist(gen));
+    }
+    for (size_t axis { 0 }; axis < 2; ++axis) {
+        simulator.set_coordinates(axis, coordinates[axis]);
+        simulator.set_speeds(axis, speeds[axis]);
+    }
+    simulator.set_masses(masses);
+    simulator.set_timestep_from_double(0.01);
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    const auto max_particles = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 1'000'000ull;
+    const auto seconds_per_run = argc > 2 ? std::strtod(argv[2], nullptr) : 0.5;
+
+    const auto hardware_threads = nps::ThreadPool::default_threads();
+    std::vector<size_t> thread_counts;
+    for (size_t threads { 1 }; threads < hardware_threads; threads *= 2) {
+        thread_counts.push_back(threads);
+    }
+    thread_counts.push_back(hardware_threads);
+
+    fmt::print("{{\n  \"hardware_threads\": {},\n  \"seconds_per_run\": {},\n  \"results\": [", hardware_threads,
+               seconds_per_run);
+    bool first { true };
+
+    for (size_t particles { 100 }; particles <= max_particles; particles *= 10) {
+        for (const auto& engine_case : engine_cases) {
+            if (particles > engine_case.max_particles) { continue; }
+            for (const auto threads : thread_counts) {
+                if (!engine_case.threaded && threads > 1) { continue; }
+
+                reset_peak_rss();
+                simulation simulator;
+                simulator.set_threads(threads);
+                simulator.set_engine(engine_case.engine);
+                simulator.set_short_range(1.0, nps::softening::plummer, 0.05);
+                set_initial_conditions(simulator, particles);
+
+                // Warm up, which also grows the tree and mesh storage to its working size
+                simulator.evolve_n_steps(1);
+                simulator.metrics().reset();
+
+                size_t steps { 0 };
+                const auto start = std::chrono::steady_clock::now();
+                auto elapsed = std::chrono::duration<double>::zero();
+                do {
+                    simulator.evolve_n_steps(1);
+                    ++steps;
+                    elapsed = std::chrono::steady_clock::now() - start;
+                } while (elapsed.count() < seconds_per_run);
+
+                const auto particle_steps = double(particles) * double(steps);
+                const auto pairs = double(particles) * double(particles - 1) / 2.0 * double(steps);
+                fmt::print("{}\n    {{ \"engine\": \"{}\", \"particles\": {}, \"threads\": {}, \"steps\": {}, "
+                           "\"seconds\": {:.6f}, \"ns_per_particle_step\": {:.3f}, \"pairs_per_second\": {:.6e}, "
+                           "\"interactions_per_second\": {:.6e}, \"peak_rss_kb\": {} }}",
+                           first ? "" : ",", engine_case.name, particles, threads, steps, elapsed.count(),
+                           elapsed.count() * 1e9 / particle_steps, pairs / elapsed.count(),
+                           double(simulator.metrics().count(nps::counter::pair_interactions)) / elapsed.count(),
+                           peak_rss_kb());
+                std::fflush(stdout);
+                first = false;
+            }
+        }
+    }
+
+    fmt::print("\n  ]\n}}\n");
+}
@@ -16,7 +16,9 @@
 #include <string>
 #include <vector>
 
+#include "AllocationCounter.hpp"
 #include "NewtonPointSimulation.hpp"
+#include <cassert>
 #include <chrono>
 #include <random>
 #include <thread>
@@ -24,7 +26,7 @@
 // Forward declaring our helper function to read compiled shader
 static std::vector<uint32_t>
 readShader(const std::string shader_path);
-int main([[maybe_unused]] int argc, [[maybe_unused]] char* argv[]) {
+int main(int argc, char* argv[]) {
 
     using namespace units;
     using namespace units::isq;
@@ -60,12 +62,37 @@ int main([[maybe_unused]] int argc, [[maybe_unused]] char* argv[]) {
     simulator.set_masses_from_doubles(testing_masses);
     simulator.set_timestep_from_double(0.1);
 
+    // --serial draws after every step from this thread, as before the render thread,
+    // --density shades the particle density instead of marking occupied cells
+    bool serial { false };
+    auto style = nps::render_style::points;
+    for (int arg { 1 }; arg < argc; ++arg) {
+        serial = serial || std::string(argv[arg]) == "--serial";
+        if (std::string(argv[arg]) == "--density") { style = nps::render_style::density; }
+    }
+    simulator.set_render_style(style);
+
+    if (serial) {
+        for (size_t i { 0 }; i < 1000; ++i) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            [[maybe_unused]] const auto allocated_bytes_before_step = nps::allocation_counter::allocated_bytes();
+            simulator.evolve_with_cpu_1();
+            // Setters size the step workspace, so stepping itself must not allocate
+            assert(nps::allocation_counter::allocated_bytes() == allocated_bytes_before_step);
+            simulator.draw();
+        }
+        return 0;
+    }
+
+    // Steps run flat out, the render thread draws the latest published positions at 30 fps
+    nps::RenderThread render_thread(simulator.metrics(), { -10.0, 10.0, -10.0, 10.0 }, 30.0, style);
     for (size_t i { 0 }; i < 1000; ++i) {
-        std::this_thread::sleep_for(std::chrono::milliseconds(10));
-        simulator.start_clock();
+        // The render thread allocates while this one steps, so only the bytes of this thread count
+        [[maybe_unused]] const auto allocated_bytes_before_step =
+            nps::allocation_counter::allocated_bytes_on_this_thread();
         simulator.evolve_with_cpu_1();
-        simulator.stop_clock();
-        simulator.draw();
+        assert(nps::allocation_counter::allocated_bytes_on_this_thread() == allocated_bytes_before_step);
+        simulator.publish_snapshot(render_thread);
     }
 }
 
@@ -0,0 +1,64 @@
+#pragma once
+#define FMT_HEADER_ONLY
+
+#include "fmt/format.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <random>
+#include <span>
+#include <vector>
+
+#include "NewtonPointSimulation.hpp"
+
+/*
+Shared by the programs of `meson test`. A test calls check() for every property it verifies and returns
+exit_code() from main, so one run lists every failed check rather than stopping at the first one.
+ */
+namespace nps::test {
+
+template <size_t dimensions>
+using simulation = NewtonPointSimulation<si::metre, si::kilogram, si::second, si::metre_per_second,
+                                         si::metre_per_second_sq, dimensions>;
+
+inline size_t failed_checks { 0 };
+
+template <typename... Args>
+void check(const bool condition, fmt::format_string<Args...> message, Args&&... args) {
+    if (condition) { return; }
+    ++failed_checks;
+    fmt::print(stderr, "FAILED: {}\n", fmt::format(message, std::forward<Args>(args)...));
+}
+
+inline int exit_code() { return failed_checks == 0 ? 0 : 1; }
+
+// Gaussian blob of particles of masses in [0.5, 1.5) and speeds of about speed, the same for the same seed
+template <size_t dimensions>
+void fill_gaussian(simulation<dimensions>& target, const size_t particles, const std::uint32_t seed,
+                   const double radius = 1.0, const double speed = 0.0) {
+    std::mt19937 generator(seed);
+    std::normal_distribution<double> position(0.0, radius);
+    std::normal_distribution<double> velocity(0.0, speed > 0.0 ? speed : 1.0);
+    std::uniform_real_distribution<double> mass(0.5, 1.5);
+    std::vector<double> values(particles);
+    for_each_axis<dimensions>([&](const size_t axis) {
+        std::ranges::generate(values, [&] { return position(generator); });
+        target.set_coordinates(axis, values);
+        std::ranges::generate(values, [&] { return speed > 0.0 ? velocity(generator) : 0.0; });
+        target.set_speeds(axis, values);
+    });
+    std::ranges::generate(values, [&] { return mass(generator); });
+    target.set_masses(values);
+}
+
+// Largest |a[i] - b[i]|, infinite when the sizes differ
+inline double max_difference(std::span<const double> a, std::span<const double> b) {
+    if (a.size() != b.size()) { return std::numeric_limits<double>::infinity(); }
+    double difference { 0.0 };
+    for (size_t i { 0 }; i < a.size(); ++i) {
+        difference = std::max(difference, std::abs(a[i] - b[i]));
+    }
+    return difference;
+}
+
+} // namespace nps::test
@@ -0,0 +1,110 @@
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <limits>
+#include <string>
+
+#include <unistd.h>
+
+#include "TestSupport.hpp"
+
+/*
+save_checkpoint followed by load_checkpoint restores a simulation bit for bit: the restored one saves
+the same file again and steps exactly like the original. Truncated files, files of the other dimension
+count and crafted headers are refused and leave the simulation as it was.
+ */
+
+namespace {
+
+using nps::test::check;
+
+std::string temporary_path(const std::string& name) {
+    return (std::filesystem::temp_directory_path() / fmt::format("nps_test_{}_{}.bin", ::getpid(), name)).string();
+}
+
+std::string contents_of(const std::string& path) {
+    std::ifstream file(path, std::ios::binary);
+    return { std::istreambuf_iterator<char>(file), {} };
+}
+
+bool bitwise_equal(std::span<const double> a, std::span<const double> b) {
+    return a.size() == b.size() && std::memcmp(a.data(), b.data(), a.size_bytes()) == 0;
+}
+
+template <size_t dimensions>
+bool same_state(const nps::test::simulation<dimensions>& a, const nps::test::simulation<dimensions>& b) {
+    auto same = bitwise_equal(a.masses_view(), b.masses_view());
+    nps::for_each_axis<dimensions>([&](const size_t axis) {
+        same = same && bitwise_equal(a.coordinates_view(axis), b.coordinates_view(axis)) &&
+               bitwise_equal(a.speeds_view(axis), b.speeds_view(axis));
+    });
+    return same;
+}
+
+template <size_t dimensions>
+void check_round_trip() {
+    const auto path = temporary_path(fmt::format("{}d", dimensions));
+    const auto again_path = temporary_path(fmt::format("{}d_again", dimensions));
+
+    nps::test::simulation<dimensions> original;
+    nps::test::fill_gaussian<dimensions>(original, 1000, 3, 1.0, 0.1);
+    original.set_timestep_from_double(1e-3);
+    original.set_integrator(nps::integrator::leapfrog);
+    original.evolve_n_steps(5);
+    check(original.save_checkpoint(path), "{}D save_checkpoint failed", dimensions);
+
+    nps::test::simulation<dimensions> restored;
+    restored.set_integrator(nps::integrator::leapfrog);
+    check(restored.load_checkpoint(path), "{}D load_checkpoint failed", dimensions);
+    check(same_state(original, restored), "{}D restored particles differ from the saved ones", dimensions);
+    check(restored.save_checkpoint(again_path) && contents_of(again_path) == contents_of(path),
+          "{}D saving the restored simulation gives another file", dimensions);
+
+    original.evolve_n_steps(20);
+    restored.evolve_n_steps(20);
+    check(same_state(original, restored), "{}D restored simulation steps differently", dimensions);
+
+    // Cut off in the middle of the mass column
+    const auto bytes = contents_of(path);
+    std::ofstream(again_path, std::ios::binary).write(bytes.data(), std::streamsize(bytes.size() - 100));
+    check(!restored.load_checkpoint(again_path), "{}D truncated checkpoint was loaded", dimensions);
+    check(same_state(original, restored), "{}D refused checkpoint changed the simulation", dimensions);
+
+    // Headers of the same file edited by patch, which must all be refused
+    const auto refuses = [&](auto&& patch) {
+        nps::CheckpointHeader header;
+        std::memcpy(&header, bytes.data(), sizeof(header));
+        patch(header);
+        auto patched = bytes;
+        std::memcpy(patched.data(), &header, sizeof(header));
+        std::ofstream(again_path, std::ios::binary).write(patched.data(), std::streamsize(patched.size()));
+        return !restored.load_checkpoint(again_path) && same_state(original, restored);
+    };
+    // Every column is a multiple of 8 bytes, so 2^61 more particles wrap around to the same file size
+    check(refuses([](auto& header) { header.particles += std::uint64_t { 1 } << 61; }),
+          "{}D checkpoint with a particle count that overflows the file size was loaded", dimensions);
+    check(refuses([](auto& header) { header.units_in_si[0] = std::numeric_limits<double>::quiet_NaN(); }),
+          "{}D checkpoint with a NaN unit was loaded", dimensions);
+    check(refuses([](auto& header) { header.units_in_si[3] = 0.0; }),
+          "{}D checkpoint with a zero unit was loaded", dimensions);
+    check(refuses([](auto& header) { header.units_in_si[1] = -1.0; }),
+          "{}D checkpoint with a negative unit was loaded", dimensions);
+
+    nps::test::simulation<dimensions == 2 ? 3 : 2> other;
+    check(!other.load_checkpoint(path), "{}D checkpoint was loaded by a simulation of the other dimension", dimensions);
+    check(other.particles() == 0, "{}D refused checkpoint changed the other simulation", dimensions);
+
+    std::remove(path.c_str());
+    std::remove(again_path.c_str());
+}
+
+} // namespace
+
+int main() {
+    check_round_trip<2>();
+    check_round_trip<3>();
+    return nps::test::exit_code();
+}
@@ -0,0 +1,174 @@
+#include <array>
+#include <vector>
+
+#include "DomainDecomposition.hpp"
+#include "TestSupport.hpp"
+
+/*
+A DomainDecomposition over 2 to 4 forked ranks steps like one process running the same short range
+simulation: after the steps, with the halo exchanges, migrations and load balancing in between, gather
+hands back every particle where the single process has it, to rounding. Balancing moves the slab bounds
+the same way on every rank, and every particle ends up on the rank that owns its slab. A rank whose local
+simulation runs another engine or integrator makes every rank refuse to distribute or step.
+ */
+
+namespace {
+
+using nps::test::check;
+
+constexpr size_t dimensions { 2 };
+constexpr size_t particles { 1500 };
+constexpr size_t steps { 40 };
+constexpr size_t balance_every { 10 };
+// A rank adds up the pulls on a particle in another order than one process, which differs by roundings
+constexpr double tolerance { 1.0e-10 };
+
+using simulation = nps::test::simulation<dimensions>;
+
+void set_up(simulation& target) {
+    target.set_engine(nps::engine::short_range);
+    target.set_short_range(0.1, nps::softening::plummer, 0.01);
+    target.set_timestep_from_double(2.0e-3);
+}
+
+// Denser in the middle along x, so that the balancing has a cost gradient to follow
+struct initial_state {
+    std::array<std::vector<double>, dimensions> coordinates;
+    std::array<std::vector<double>, dimensions> speeds;
+    std::vector<double> masses;
+
+    initial_state() : masses(particles) {
+        std::mt19937 generator(3);
+        std::uniform_real_distribution<double> unit(-1.0, 1.0);
+        std::uniform_real_distribution<double> velocity(-0.5, 0.5);
+        for (size_t axis { 0 }; axis < dimensions; ++axis) {
+            coordinates[axis].resize(particles);
+            speeds[axis].resize(particles);
+        }
+        for (size_t i { 0 }; i < particles; ++i) {
+            coordinates[0][i] = unit(generator) * (unit(generator) > 0.0 ? 0.3 : 1.0);
+            coordinates[1][i] = unit(generator);
+            speeds[0][i] = velocity(generator);
+            speeds[1][i] = velocity(generator);
+            masses[i] = 1.0 + 0.5 * unit(generator);
+        }
+    }
+};
+
+void check_ranks(const initial_state& initial, const simulation& single, const size_t ranks) {
+    nps::SharedMemoryTransport transport(ranks);
+    check(transport.valid(), "{} ranks: no shared memory transport", ranks);
+    if (!transport.valid()) { return; }
+
+    const auto succeeded = transport.run_ranks([&](nps::Transport& rank_transport) {
+        // Checks of the children fail them through the return value, only rank 0's count at the end
+        const auto failed_before = nps::test::failed_checks;
+        const auto rank = rank_transport.rank();
+        const auto root = rank == 0;
+        simulation local;
+        set_up(local);
+        nps::DomainDecomposition<dimensions, simulation> decomposition(rank_transport, local);
+
+        std::array<std::span<const double>, dimensions> coordinates {};
+        std::array<std::span<const double>, dimensions> speeds {};
+        std::span<const double> masses {};
+        if (root) {
+            coordinates = { initial.coordinates[0], initial.coordinates[1] };
+            speeds = { initial.speeds[0], initial.speeds[1] };
+            masses = initial.masses;
+        }
+        if (!decomposition.distribute(coordinates, speeds, masses)) { return false; }
+        const std::vector<double> distributed_bounds(decomposition.bounds().begin(), decomposition.bounds().end());
+        decomposition.set_balancing(balance_every);
+        if (!decomposition.evolve_n_steps(steps)) { return false; }
+
+        const auto bounds = decomposition.bounds();
+        check(!std::ranges::equal(bounds, distributed_bounds), "{} ranks: rank {} never moved its slab bounds",
+              ranks, rank);
+        std::vector<double> all_bounds {};
+        if (!rank_transport.all_gather(bounds, all_bounds)) { return false; }
+        for (size_t other { 0 }; other < ranks; ++other) {
+            check(std::ranges::equal(bounds, std::span(all_bounds).subspan(other * bounds.size(), bounds.size())),
+                  "{} ranks: ranks {} and {} balanced to different slab bounds", ranks, rank, other);
+        }
+        const auto outside = std::ranges::count_if(local.coordinates_view(0), [&](const double x) {
+            return x < bounds[rank] || x >= bounds[rank + 1];
+        });
+        check(outside == 0, "{} ranks: rank {} holds {} particles outside its slab", ranks, rank, outside);
+
+        std::array<std::vector<double>, dimensions> gathered_coordinates {};
+        std::array<std::vector<double>, dimensions> gathered_speeds {};
+        std::vector<double> gathered_masses {};
+        if (!decomposition.gather(gathered_coordinates, gathered_speeds, gathered_masses)) { return false; }
+        if (root) {
+            check(gathered_masses.size() == particles, "{} ranks: gathered {} particles of {}", ranks,
+                  gathered_masses.size(), particles);
+            if (gathered_masses.size() == particles) {
+                double difference { nps::test::max_difference(gathered_masses, single.masses_view()) };
+                for (size_t axis { 0 }; axis < dimensions; ++axis) {
+                    difference = std::max({ difference,
+                                            nps::test::max_difference(gathered_coordinates[axis],
+                                                                      single.coordinates_view(axis)),
+                                            nps::test::max_difference(gathered_speeds[axis],
+                                                                      single.speeds_view(axis)) });
+                }
+                check(difference < tolerance, "{} ranks: gathered particles differ from one process by {}", ranks,
+                      difference);
+            }
+        }
+        return nps::test::failed_checks == failed_before;
+    });
+    check(succeeded, "{} ranks: a rank failed", ranks);
+}
+
+/*
+The last rank alone runs leapfrog from the start, or switches to barnes_hut after the distribution. Every
+rank must then fail the call rather than step, or wait in an exchange the last rank left.
+ */
+void check_refused(const initial_state& initial, const size_t ranks, const bool switch_after_distribute) {
+    nps::SharedMemoryTransport transport(ranks);
+    if (!transport.valid()) { return; }
+    const auto refused = transport.run_ranks([&](nps::Transport& rank_transport) {
+        const auto last = rank_transport.rank() == ranks - 1;
+        simulation local;
+        set_up(local);
+        if (last && !switch_after_distribute) { local.set_integrator(nps::integrator::leapfrog); }
+        nps::DomainDecomposition<dimensions, simulation> decomposition(rank_transport, local);
+
+        std::array<std::span<const double>, dimensions> coordinates {};
+        std::array<std::span<const double>, dimensions> speeds {};
+        std::span<const double> masses {};
+        if (rank_transport.rank() == 0) {
+            coordinates = { initial.coordinates[0], initial.coordinates[1] };
+            speeds = { initial.speeds[0], initial.speeds[1] };
+            masses = initial.masses;
+        }
+        if (!switch_after_distribute) { return !decomposition.distribute(coordinates, speeds, masses); }
+        if (!decomposition.distribute(coordinates, speeds, masses)) { return false; }
+        if (last) { local.set_engine(nps::engine::barnes_hut); }
+        return !decomposition.evolve_n_steps(steps);
+    });
+    check(refused, "{} ranks: a rank {} was not refused on every rank", ranks,
+          switch_after_distribute ? "switched to barnes_hut" : "running leapfrog");
+}
+
+} // namespace
+
+int main() {
+    const initial_state initial;
+    simulation single;
+    set_up(single);
+    for (size_t axis { 0 }; axis < dimensions; ++axis) {
+        single.set_coordinates(axis, initial.coordinates[axis]);
+        single.set_speeds(axis, initial.speeds[axis]);
+    }
+    single.set_masses(initial.masses);
+    single.evolve_n_steps(steps);
+
+    for (const size_t ranks : { 2, 3, 4 }) {
+        check_ranks(initial, single, ranks);
+        check_refused(initial, ranks, false);
+        check_refused(initial, ranks, true);
+    }
+    return nps::test::exit_code();
+}
@@ -0,0 +1,148 @@
+#include <array>
+#include <vector>
+
+#include "NewtonPointEnsemble.hpp"
+#include "TestSupport.hpp"
+
+/*
+Every system of a NewtonPointEnsemble steps like a NewtonPointSimulation of its own particles with
+leapfrog on the cpu_1 engine, to rounding: the lanes across systems must not mix systems, whatever the
+batch a system lands in, its timestep, the thread count or how the steps are split between calls. A system
+that reaches its end time stops there and keeps its state while the rest of its batch goes on.
+ */
+
+namespace {
+
+using nps::test::check;
+
+constexpr double G { 1.0e-2 };
+// Relative to values of at least one: the summation orders differ by roundings of about 1e-16, which the
+// close pairs of some systems grow to several times that over the steps
+constexpr double tolerance { 1.0e-14 };
+
+template <size_t dimensions>
+struct particle {
+    std::array<double, dimensions> coordinates;
+    std::array<double, dimensions> speeds;
+    double mass;
+};
+
+template <size_t dimensions>
+std::vector<particle<dimensions>> random_particles(const size_t count, const std::uint32_t seed) {
+    std::mt19937 generator(seed);
+    std::uniform_real_distribution<double> position(-1.0, 1.0);
+    std::uniform_real_distribution<double> velocity(-0.05, 0.05);
+    std::uniform_real_distribution<double> mass(0.9, 1.1);
+    std::vector<particle<dimensions>> particles(count);
+    for (auto& p : particles) {
+        for (size_t axis { 0 }; axis < dimensions; ++axis) {
+            p.coordinates[axis] = position(generator);
+            p.speeds[axis] = velocity(generator);
+        }
+        p.mass = mass(generator);
+    }
+    return particles;
+}
+
+double timestep_of(const size_t system) { return 1.0e-3 * double(1 + system % 3); }
+
+// The system's particles stepped on their own, the reference of the ensemble
+template <size_t dimensions>
+nps::test::simulation<dimensions> reference(std::span<const particle<dimensions>> particles, const size_t system,
+                                            const size_t steps) {
+    nps::test::simulation<dimensions> simulation;
+    std::vector<double> values(particles.size());
+    nps::for_each_axis<dimensions>([&](const size_t axis) {
+        std::ranges::transform(particles, values.begin(), [&](const auto& p) { return p.coordinates[axis]; });
+        simulation.set_coordinates(axis, values);
+        std::ranges::transform(particles, values.begin(), [&](const auto& p) { return p.speeds[axis]; });
+        simulation.set_speeds(axis, values);
+    });
+    std::ranges::transform(particles, values.begin(), [](const auto& p) { return p.mass; });
+    simulation.set_masses(values);
+    simulation.set_timestep_from_double(timestep_of(system));
+    simulation.set_integrator(nps::integrator::leapfrog);
+    simulation.set_engine(nps::engine::cpu_1);
+    simulation.evolve_n_steps(steps);
+    return simulation;
+}
+
+template <size_t dimensions>
+double difference_to_reference(const nps::NewtonPointEnsemble<dimensions>& ensemble,
+                               std::span<const particle<dimensions>> particles, const size_t system,
+                               const size_t steps) {
+    const auto simulation = reference<dimensions>(particles, system, steps);
+    double difference { 0.0 };
+    const auto relative = [](const double value, const double expected) {
+        return std::abs(value - expected) / std::max(1.0, std::abs(expected));
+    };
+    for (size_t i { 0 }; i < particles.size(); ++i) {
+        const auto coordinates = ensemble.coordinates_of(system, i);
+        const auto speeds = ensemble.speeds_of(system, i);
+        for (size_t axis { 0 }; axis < dimensions; ++axis) {
+            difference = std::max({ difference, relative(coordinates[axis], simulation.coordinates_view(axis)[i]),
+                                    relative(speeds[axis], simulation.speeds_view(axis)[i]) });
+        }
+    }
+    return difference;
+}
+
+template <size_t dimensions>
+void check_against_simulation(const size_t threads) {
+    // Not a multiple of any lane count, so the last batch is padded
+    constexpr size_t systems { 37 };
+    constexpr size_t particles { 6 };
+    constexpr size_t steps { 50 };
+    // Stops after stopping_steps steps, amid the steps of the rest of its batch
+    constexpr size_t stopping_system { 5 };
+    constexpr size_t stopping_steps { 11 };
+
+    const auto all_particles = random_particles<dimensions>(systems * particles, 7);
+    const auto particles_of = [&](const size_t system) {
+        return std::span(all_particles).subspan(system * particles, particles);
+    };
+
+    nps::NewtonPointEnsemble<dimensions> ensemble(systems, particles, G, threads);
+    for (size_t system { 0 }; system < systems; ++system) {
+        for (size_t i { 0 }; i < particles; ++i) {
+            const auto& p = particles_of(system)[i];
+            ensemble.set_particle(system, i, p.coordinates, p.speeds, p.mass);
+        }
+        ensemble.set_timestep(system, timestep_of(system));
+    }
+    ensemble.set_end_time(stopping_system, (double(stopping_steps) - 0.5) * timestep_of(stopping_system));
+    ensemble.evolve_n_steps(steps / 2 - 3);
+    ensemble.evolve_n_steps(steps - (steps / 2 - 3));
+
+    double difference { 0.0 };
+    for (size_t system { 0 }; system < systems; ++system) {
+        if (system == stopping_system) { continue; }
+        difference = std::max(difference, difference_to_reference<dimensions>(ensemble, particles_of(system),
+                                                                              system, steps));
+    }
+    check(difference < tolerance, "{}D with {} threads: systems differ from their simulations by {}", dimensions,
+          threads, difference);
+    check(ensemble.running_systems() == systems - 1, "{}D with {} threads: {} systems running, {} expected",
+          dimensions, threads, ensemble.running_systems(), systems - 1);
+
+    check(ensemble.outcome_of(stopping_system) == nps::ensemble_outcome::end_time,
+          "{}D with {} threads: the system past its end time did not stop for it", dimensions, threads);
+    const auto stopped_time = double(stopping_steps) * timestep_of(stopping_system);
+    check(std::abs(ensemble.time_of(stopping_system) - stopped_time) < 1e-12,
+          "{}D with {} threads: stopped at time {} rather than {}", dimensions, threads,
+          ensemble.time_of(stopping_system), stopped_time);
+    const auto stopped_difference = difference_to_reference<dimensions>(ensemble, particles_of(stopping_system),
+                                                                        stopping_system, stopping_steps);
+    check(stopped_difference < tolerance, "{}D with {} threads: the stopped system differs by {}", dimensions,
+          threads, stopped_difference);
+}
+
+} // namespace
+
+int main() {
+    for (const size_t threads : { 1, 2 }) {
+        check_against_simulation<2>(threads);
+        check_against_simulation<3>(threads);
+    }
+    return nps::test::exit_code();
+}
@@ -0,0 +1,132 @@
+#include <numeric>
+#include <string_view>
+
+#include "TestSupport.hpp"
+
+/*
+Accelerations of the approximate engines against the direct sum of cpu_1, at the tolerances below.
+Every particle starts at rest, so after one semi_implicit_euler step its speed is its acceleration times
+the timestep and comparing speeds compares accelerations. The particle mesh smooths away forces below a
+few cells, which dominate the direct sum within a random point set, so it is only held to the forces on
+light probes outside of the particles. The engines that walk a tree or cell list per particle split
+the particles between the threads, which must not change a bit of the result or the pairs counted.
+ */
+
+namespace {
+
+using nps::test::check;
+
+constexpr size_t particles = 2000;
+constexpr size_t probes = 64;
+
+// RMS over particles [begin, end) of |v - v_direct| / |v_direct|
+template <size_t dimensions>
+double rms_relative_error(const nps::test::simulation<dimensions>& approximate,
+                          const nps::test::simulation<dimensions>& direct, const size_t begin, const size_t end) {
+    double sum { 0.0 };
+    for (auto i = begin; i < end; ++i) {
+        double error2 { 0.0 };
+        double norm2 { 0.0 };
+        nps::for_each_axis<dimensions>([&](const size_t axis) {
+            const auto error = approximate.speeds_view(axis)[i] - direct.speeds_view(axis)[i];
+            error2 += error * error;
+            norm2 += direct.speeds_view(axis)[i] * direct.speeds_view(axis)[i];
+        });
+        sum += error2 / norm2;
+    }
+    return std::sqrt(sum / double(end - begin));
+}
+
+// Steps copies of initial with cpu_1 and with engine, after configure has set up the copy for engine
+template <size_t dimensions, typename F>
+double error_of(const nps::test::simulation<dimensions>& initial, const nps::engine engine, F&& configure,
+                const size_t begin, const size_t end) {
+    auto direct = initial;
+    auto approximate = initial;
+    direct.set_engine(nps::engine::cpu_1);
+    approximate.set_engine(engine);
+    configure(approximate);
+    direct.evolve_n_steps(1);
+    approximate.evolve_n_steps(1);
+    return rms_relative_error(approximate, direct, begin, end);
+}
+
+// Steps copies of initial on one and on three threads, which must agree exactly
+template <size_t dimensions, typename F>
+void check_threads_agree(const nps::test::simulation<dimensions>& initial, const nps::engine engine,
+                         F&& configure, const std::string_view name) {
+    auto one = initial;
+    auto three = initial;
+    for (auto* simulation : { &one, &three }) {
+        simulation->set_engine(engine);
+        simulation->set_integrator(nps::integrator::leapfrog);
+        configure(*simulation);
+    }
+    three.set_threads(3);
+    one.evolve_n_steps(2);
+    three.evolve_n_steps(2);
+    bool same { true };
+    nps::for_each_axis<dimensions>([&](const size_t axis) {
+        same = same && std::ranges::equal(one.coordinates_view(axis), three.coordinates_view(axis)) &&
+               std::ranges::equal(one.speeds_view(axis), three.speeds_view(axis));
+    });
+    check(same, "{}D {} on three threads differs from one thread", dimensions, name);
+    const auto pairs = [](const auto& s) { return s.metrics().count(nps::counter::pair_interactions); };
+    check(pairs(one) == pairs(three), "{}D {} counted {} pairs on one thread and {} on three", dimensions, name,
+          pairs(one), pairs(three));
+}
+
+template <size_t dimensions>
+void check_engines() {
+    nps::test::simulation<dimensions> initial;
+    nps::test::fill_gaussian<dimensions>(initial, particles, 7);
+    initial.set_timestep_from_double(1e-3);
+    const auto all = [&](const nps::engine engine, auto&& configure) {
+        return error_of<dimensions>(initial, engine, configure, 0, particles);
+    };
+
+    const auto exact = all(nps::engine::barnes_hut, [](auto& s) { s.set_barnes_hut_theta(0.0); });
+    check(exact < 1e-12, "{}D Barnes-Hut at theta 0 differs from the direct sum by {}", dimensions, exact);
+    const auto barnes_hut = all(nps::engine::barnes_hut, [](auto& s) { s.set_barnes_hut_theta(0.5); });
+    check(barnes_hut < 3e-2, "{}D Barnes-Hut at theta 0.5 has an rms error of {}", dimensions, barnes_hut);
+    const auto fmm = all(nps::engine::fmm, [](auto& s) { s.set_fmm(6, 0.5); });
+    check(fmm < 1e-4, "{}D FMM of order 6 has an rms error of {}", dimensions, fmm);
+
+    check_threads_agree<dimensions>(initial, nps::engine::barnes_hut, [](auto& s) { s.set_barnes_hut_theta(0.5); },
+                                    "Barnes-Hut");
+    check_threads_agree<dimensions>(initial, nps::engine::fmm, [](auto& s) { s.set_fmm(6, 0.5); }, "FMM");
+    check_threads_agree<dimensions>(initial, nps::engine::short_range,
+                                    [](auto& s) { s.set_short_range(0.3, nps::softening::plummer, 0.01); },
+                                    "short range");
+
+    // Probes of negligible mass 4 to 8 standard deviations out of the blob
+    auto probed = initial;
+    probed.set_particle_count(particles + probes);
+    std::mt19937 generator(11);
+    std::uniform_real_distribution<double> unit(0.0, 1.0);
+    for (auto p = particles; p < particles + probes; ++p) {
+        std::array<double, dimensions> direction {};
+        double norm2 { 0.0 };
+        while (norm2 < 1e-2 || norm2 > 1.0) {
+            std::ranges::generate(direction, [&] { return 2.0 * unit(generator) - 1.0; });
+            norm2 = std::inner_product(direction.begin(), direction.end(), direction.begin(), 0.0);
+        }
+        const auto radius = 4.0 + 4.0 * unit(generator);
+        nps::for_each_axis<dimensions>([&](const size_t axis) {
+            probed.mutable_coordinates_view(axis)[p] = radius * direction[axis] / std::sqrt(norm2);
+        });
+        probed.mutable_masses_view()[p] = 1e-6;
+    }
+    const auto cells = dimensions == 2 ? 256 : 64;
+    const auto mesh = error_of<dimensions>(probed, nps::engine::particle_mesh,
+                                           [&](auto& s) { s.set_particle_mesh(cells); }, particles, particles + probes);
+    check(mesh < 2e-3, "{}D particle mesh of {} cells has an rms error of {} on the probes", dimensions, cells, mesh);
+}
+
+} // namespace
+
+int main() {
+    check_engines<2>();
+    check_engines<3>();
+    return nps::test::exit_code();
+}
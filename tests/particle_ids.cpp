@@ -0,0 +1,171 @@
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+#include "TestSupport.hpp"
+
+/*
+Particle IDs stay attached to their particles through Morton reordering and mergers: index_of_particle
+finds every particle where the views hold it, absorbed particles lead to the body that absorbed them,
+trajectory frames list the surviving particles by ID with their masses, and the setters start the IDs over.
+ */
+
+namespace {
+
+using nps::test::check;
+
+// particle_ids() and index_of_particle() are inverse on the surviving particles
+template <size_t dimensions>
+bool consistent_ids(const nps::test::simulation<dimensions>& simulation) {
+    const auto ids = simulation.particle_ids();
+    for (size_t i { 0 }; i < ids.size(); ++i) {
+        if (simulation.index_of_particle(ids[i]) != i) { return false; }
+    }
+    return ids.size() == simulation.particles();
+}
+
+template <size_t dimensions>
+void check_reordering() {
+    constexpr size_t particles = 1000;
+    nps::test::simulation<dimensions> plain;
+    nps::test::fill_gaussian<dimensions>(plain, particles, 13, 1.0, 0.1);
+    plain.set_timestep_from_double(1e-3);
+    plain.set_integrator(nps::integrator::leapfrog);
+    auto reordered = plain;
+    reordered.set_morton_reordering(3);
+    plain.evolve_n_steps(20);
+    reordered.evolve_n_steps(20);
+
+    size_t moved { 0 };
+    double difference { 0.0 };
+    for (size_t id { 0 }; id < particles; ++id) {
+        const auto i = reordered.index_of_particle(id);
+        moved += i != id;
+        nps::for_each_axis<dimensions>([&](const size_t axis) {
+            difference = std::max(difference, std::abs(reordered.coordinates_view(axis)[i] -
+                                                       plain.coordinates_view(axis)[id]));
+        });
+    }
+    check(moved > particles / 2, "{}D reordering moved only {} particles", dimensions, moved);
+    check(consistent_ids(reordered), "{}D IDs are inconsistent after reordering", dimensions);
+    check(difference < 1e-12, "{}D particles found by ID are {} away from the unreordered run", dimensions,
+          difference);
+
+    // New state of the same size has nothing to do with the old permutation
+    nps::test::fill_gaussian<dimensions>(reordered, particles, 14);
+    size_t off_index { 0 };
+    for (size_t i { 0 }; i < particles; ++i) {
+        off_index += reordered.particle_ids()[i] != i || reordered.index_of_particle(i) != i;
+    }
+    check(off_index == 0, "{}D {} IDs survived the setters", dimensions, off_index);
+}
+
+template <size_t dimensions>
+void check_merger() {
+    // A grid of particles 1 apart, apart from `absorbed`, which sits next to `absorber`. The masses are small
+    // enough that the rest of the grid does not change the momentum of the pair measurably.
+    constexpr size_t side = dimensions == 2 ? 16 : 6;
+    constexpr size_t particles = dimensions == 2 ? side * side : side * side * side;
+    constexpr size_t absorber = 17;
+    constexpr size_t absorbed = particles - 5;
+    nps::test::simulation<dimensions> simulation;
+    simulation.set_particle_count(particles);
+    for (size_t id { 0 }; id < particles; ++id) {
+        auto cell = id;
+        nps::for_each_axis<dimensions>([&](const size_t axis) {
+            simulation.mutable_coordinates_view(axis)[id] = double(side - 1 - cell % side);
+            simulation.mutable_speeds_view(axis)[id] = 1e-3 * double(axis + 1) * double(id % 7);
+            cell /= side;
+        });
+        simulation.mutable_masses_view()[id] = 1e-6 * (1.0 + 0.01 * double(id));
+    }
+    nps::for_each_axis<dimensions>([&](const size_t axis) {
+        simulation.mutable_coordinates_view(axis)[absorbed] =
+            simulation.coordinates_view(axis)[absorber] + (axis == 0 ? 1e-3 : 0.0);
+    });
+    const auto mass = simulation.masses_view()[absorber] + simulation.masses_view()[absorbed];
+    std::array<double, dimensions> momentum {};
+    nps::for_each_axis<dimensions>([&](const size_t axis) {
+        momentum[axis] = simulation.masses_view()[absorber] * simulation.speeds_view(axis)[absorber] +
+                         simulation.masses_view()[absorbed] * simulation.speeds_view(axis)[absorbed];
+    });
+
+    simulation.set_timestep_from_double(1e-6);
+    simulation.set_morton_reordering(1);
+    simulation.set_mergers(1e-2);
+    simulation.evolve_n_steps(3);
+
+    check(simulation.particles() == particles - 1, "{}D {} particles left of {} after one merger", dimensions,
+          simulation.particles(), particles);
+    check(consistent_ids(simulation), "{}D IDs are inconsistent after the merger", dimensions);
+    const auto body = simulation.index_of_particle(absorber);
+    check(simulation.index_of_particle(absorbed) == body, "{}D the absorbed particle does not lead to its body",
+          dimensions);
+    check(std::abs(simulation.masses_view()[body] - mass) < 1e-12 * mass, "{}D the body has mass {} instead of {}",
+          dimensions, simulation.masses_view()[body], mass);
+    nps::for_each_axis<dimensions>([&](const size_t axis) {
+        const auto body_momentum = simulation.masses_view()[body] * simulation.speeds_view(axis)[body];
+        check(std::abs(body_momentum - momentum[axis]) < 1e-9 * std::abs(momentum[axis]),
+              "{}D the body has momentum {} instead of {}",
+              dimensions, body_momentum, momentum[axis]);
+    });
+
+    // The other particles are still on their grid points, moved by 3 steps of their speeds, while the body
+    // sits at the center of mass of the pair
+    double farthest { 0.0 };
+    for (size_t id { 0 }; id < particles; ++id) {
+        if (id == absorber || id == absorbed) { continue; }
+        const auto i = simulation.index_of_particle(id);
+        auto cell = id;
+        nps::for_each_axis<dimensions>([&](const size_t axis) {
+            const auto expected = double(side - 1 - cell % side);
+            farthest = std::max(farthest, std::abs(simulation.coordinates_view(axis)[i] - expected));
+            cell /= side;
+        });
+    }
+    check(farthest < 1e-6, "{}D a particle found by ID is {} off its grid point", dimensions, farthest);
+
+    // A frame lists the survivors by ascending ID with their masses
+    const auto path = (std::filesystem::temp_directory_path() /
+                       fmt::format("nps_test_{}_ids_{}d.bin", ::getpid(), dimensions)).string();
+    {
+        nps::TrajectoryWriter<dimensions> writer(path, simulation.units_in_si());
+        simulation.record_frame(writer);
+    }
+    std::ifstream file(path, std::ios::binary);
+    nps::TrajectoryHeader header;
+    nps::TrajectoryFrameHeader frame;
+    file.read(reinterpret_cast<char*>(&header), sizeof(header));
+    file.read(reinterpret_cast<char*>(&frame), sizeof(frame));
+    const auto rows = static_cast<size_t>(frame.particles);
+    std::vector<double> columns((2 * dimensions + 1) * std::min(rows, particles));
+    std::vector<std::uint64_t> ids(std::min(rows, particles));
+    file.read(reinterpret_cast<char*>(columns.data()), std::streamsize(columns.size() * sizeof(double)));
+    file.read(reinterpret_cast<char*>(ids.data()), std::streamsize(ids.size() * sizeof(std::uint64_t)));
+    check(file.good() && header.version == nps::TrajectoryHeader::current_version && rows == particles - 1,
+          "{}D the frame has {} rows instead of {}", dimensions, rows, particles - 1);
+    bool rows_match { file.good() };
+    for (size_t k { 0 }; rows_match && k < ids.size(); ++k) {
+        const auto expected_id = k < absorbed ? k : k + 1;
+        const auto i = simulation.index_of_particle(expected_id);
+        rows_match = ids[k] == expected_id && columns[2 * dimensions * rows + k] == simulation.masses_view()[i] &&
+                     columns[k] == simulation.coordinates_view(0)[i];
+    }
+    check(rows_match, "{}D the frame rows do not match the particles of their IDs", dimensions);
+    file.close();
+    std::filesystem::remove(path);
+}
+
+} // namespace
+
+int main() {
+    check_reordering<2>();
+    check_reordering<3>();
+    check_merger<2>();
+    check_merger<3>();
+    return nps::test::exit_code();
+}
@@ -0,0 +1,121 @@
+#include <filesystem>
+#include <string>
+
+#include <unistd.h>
+
+#include "AllocationCounter.hpp"
+#include "TestSupport.hpp"
+
+/*
+Once the setters have sized the workspace and a few warm up steps have grown the trees, cell lists and
+meshes, stepping does not allocate: with every engine and integrator, on one and on several threads, with
+block timesteps, Morton reordering, mergers and diagnostics, and while recording a trajectory.
+Built with NPS_COUNT_ALLOCATIONS=1, see meson.build, so that operator new counts in every build type.
+ */
+
+namespace {
+
+using nps::test::check;
+
+constexpr size_t particles = 500;
+
+// Allocations made by f on any thread
+template <typename F>
+size_t allocations_of(F&& f) {
+    const auto before = nps::allocation_counter::allocations();
+    f();
+    return nps::allocation_counter::allocations() - before;
+}
+
+template <size_t dimensions>
+nps::test::simulation<dimensions> make_simulation() {
+    nps::test::simulation<dimensions> simulation;
+    nps::test::fill_gaussian<dimensions>(simulation, particles, 5, 1.0, 0.1);
+    simulation.set_timestep_from_double(1e-3);
+    simulation.set_fmm(4);
+    simulation.set_particle_mesh(dimensions == 2 ? 128 : 32);
+    simulation.set_short_range(0.3, nps::softening::plummer, 0.01);
+    return simulation;
+}
+
+// Warm up steps, then the steps that must not allocate. The warm up takes more diagnostics reports than
+// the steps after it, so that the cleared log has the capacity for them.
+template <size_t dimensions>
+void check_steps(nps::test::simulation<dimensions>& simulation, const std::string& name) {
+    simulation.evolve_n_steps(20);
+    simulation.clear_diagnostics();
+    const auto allocations = allocations_of([&] {
+        simulation.evolve_n_steps(10);
+        simulation.evolve_n_steps(1);
+    });
+    check(allocations == 0, "{}D {} allocated {} times in steady state", dimensions, name, allocations);
+}
+
+template <size_t dimensions>
+void check_modes() {
+    constexpr std::array engines { std::pair(nps::engine::cpu_1, "cpu_1"),
+                                   std::pair(nps::engine::simd, "simd"),
+                                   std::pair(nps::engine::cpu_threads, "cpu_threads"),
+                                   std::pair(nps::engine::barnes_hut, "barnes_hut"),
+                                   std::pair(nps::engine::fmm, "fmm"),
+                                   std::pair(nps::engine::particle_mesh, "particle_mesh"),
+                                   std::pair(nps::engine::short_range, "short_range") };
+    constexpr std::array integrators { std::pair(nps::integrator::semi_implicit_euler, "semi_implicit_euler"),
+                                       std::pair(nps::integrator::leapfrog, "leapfrog"),
+                                       std::pair(nps::integrator::yoshida4, "yoshida4") };
+    for (const auto& [engine, engine_name] : engines) {
+        for (const auto& [integrator, integrator_name] : integrators) {
+            for (const size_t threads : { 1, 2 }) {
+                auto simulation = make_simulation<dimensions>();
+                simulation.set_engine(engine);
+                simulation.set_integrator(integrator);
+                simulation.set_threads(threads);
+                check_steps(simulation, fmt::format("{} with {} on {} threads", engine_name, integrator_name, threads));
+            }
+        }
+    }
+
+    auto reordered = make_simulation<dimensions>();
+    reordered.set_engine(nps::engine::cpu_threads);
+    reordered.set_threads(2);
+    reordered.set_morton_reordering(3);
+    reordered.set_diagnostics(4);
+    check_steps(reordered, "Morton reordering with diagnostics");
+
+    auto merging = make_simulation<dimensions>();
+    merging.set_engine(nps::engine::barnes_hut);
+    merging.set_mergers(0.01);
+    check_steps(merging, "mergers");
+
+    auto blocks = make_simulation<dimensions>();
+    blocks.set_block_timesteps(4);
+    blocks.evolve_with_block_timesteps(3);
+    const auto block_allocations = allocations_of([&] { blocks.evolve_with_block_timesteps(3); });
+    check(block_allocations == 0, "{}D block timesteps allocated {} times", dimensions, block_allocations);
+
+    const auto path = (std::filesystem::temp_directory_path() /
+                       fmt::format("nps_test_{}_trajectory_{}d.bin", ::getpid(), dimensions)).string();
+    {
+        auto recorded = make_simulation<dimensions>();
+        recorded.set_morton_reordering(2);
+        nps::TrajectoryWriter<dimensions> writer(path, recorded.units_in_si());
+        recorded.evolve_n_steps(8, writer, 2);
+        writer.flush();
+        const auto recording_allocations = allocations_of([&] {
+            recorded.evolve_n_steps(8, writer, 2);
+            writer.flush();
+        });
+        check(recording_allocations == 0, "{}D trajectory recording allocated {} times", dimensions,
+              recording_allocations);
+    }
+    std::filesystem::remove(path);
+}
+
+} // namespace
+
+int main() {
+    check(nps::allocation_counter::enabled, "operator new is not instrumented");
+    check_modes<2>();
+    check_modes<3>();
+    return nps::test::exit_code();
+}